@@ -3,6 +3,8 @@
 -m conntrack --ctstate NEW,ESTABLISHED;=;OK
 -m conntrack --ctstate NEW,RELATED,ESTABLISHED;=;OK
 -m conntrack --ctstate INVALID;=;OK
+-m conntrack ! --ctstate NEW;=;OK
+-m conntrack --ctstate NEW -m conntrack ! --ctstate INVALID;=;OK
 -m conntrack --ctstate UNTRACKED;=;OK
 -m conntrack --ctstate SNAT,DNAT;=;OK
 -m conntrack --ctstate wrong;;FAIL
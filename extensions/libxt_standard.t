@@ -2,3 +2,5 @@
 -j DROP;=;OK
 -j ACCEPT;=;OK
 -j RETURN;=;OK
+-s 10.0.0.1,10.0.0.3,10.0.0.5,10.0.0.7,10.0.0.9,10.0.0.11,10.0.0.13,10.0.0.15 -j ACCEPT;-s 10.0.0.1/32,10.0.0.3/32,10.0.0.5/32,10.0.0.7/32,10.0.0.9/32,10.0.0.11/32,10.0.0.13/32,10.0.0.15/32 -j ACCEPT;OK
+-s 10.0.0.1,10.0.0.3,10.0.0.5,10.0.0.7,10.0.0.9,10.0.0.11,10.0.0.13,10.0.0.15 -d 10.1.0.1,10.1.0.3 -j ACCEPT;-s 10.0.0.1/32,10.0.0.3/32,10.0.0.5/32,10.0.0.7/32,10.0.0.9/32,10.0.0.11/32,10.0.0.13/32,10.0.0.15/32 -d 10.1.0.1/32,10.1.0.3/32 -j ACCEPT;OK
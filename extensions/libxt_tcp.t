@@ -22,5 +22,11 @@
 -p tcp -m tcp --tcp-flags FIN,SYN,RST,PSH,ACK,URG SYN;=;OK
 -p tcp -m tcp ! --tcp-flags FIN,SYN,RST,PSH,ACK,URG SYN;=;OK
 -p tcp -m tcp --tcp-flags FIN,SYN,RST,PSH,ACK,URG RST;=;OK
+-p tcp -f -m tcp --dport 22;=;OK
+-p tcp ! -f -m tcp --dport 22;=;OK
+-p tcp ! -f -m tcp --sport 1024:65535 --dport 22;=;OK
+! -p tcp -m tcp --dport 22;;FAIL
+-p udp -m tcp --dport 22;;FAIL
+-p tcp -m tcp --sport 1024:65535 -m tcp --dport 22;=;OK
 # should we accept this below?
 -p tcp -m tcp;=;OK
@@ -18,5 +18,10 @@
 # -p udp -m udp --sport 65536;;FAIL
 -p udp -m udp --sport -1;;FAIL
 -p udp -m udp --dport -1;;FAIL
+-p udp -f -m udp --dport 22;=;OK
+-p udp ! -f -m udp --dport 22;=;OK
+-p udp ! -f -m udp --sport 1024:65535 --dport 22;=;OK
+! -p udp -m udp --dport 22;;FAIL
+-p tcp -m udp --dport 22;;FAIL
 # should we accept this below?
 -p udp -m udp;=;OK
@@ -26,9 +26,23 @@ int ip6tc_is_chain(const char *chain, struct xtc_handle *const handle);
 /* Take a snapshot of the rules. Returns NULL on error. */
 struct xtc_handle *ip6tc_init(const char *tablename);
 
+/* Take a snapshot of the rules for listing only.  The rules stay in the
+   buffer returned by the kernel; changing the table fails with EROFS. */
+struct xtc_handle *ip6tc_init_readonly(const char *tablename);
+
+/* Start from an empty table (builtin chains without rules) that replaces
+   the kernel's on commit, without reading its rules.  Policies not set
+   before the commit are taken over from the kernel. */
+struct xtc_handle *ip6tc_init_flushed(const char *tablename);
+
 /* Cleanup after ip6tc_init(). */
 void ip6tc_free(struct xtc_handle *h);
 
+/* Bring a handle kept across transactions up to date with the kernel,
+   re-reading the table only if it changed.  Also keeps the handle valid
+   after a commit.  Returns 0 and sets errno on error. */
+int ip6tc_refresh(struct xtc_handle *handle);
+
 /* Iterator functions to run through the chains.  Returns NULL at end. */
 const char *ip6tc_first_chain(struct xtc_handle *handle);
 const char *ip6tc_next_chain(struct xtc_handle *handle);
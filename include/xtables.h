@@ -462,6 +462,12 @@ extern struct option *xtables_merge_options(struct option *origopts,
 	unsigned int *option_offset);
 
 extern int xtables_init_all(struct xtables_globals *xtp, uint8_t nfproto);
+
+/* startup tracer, see xttrace.c */
+extern void xtables_trace_init(bool force);
+extern void xtables_trace_args(int *argc, char *argv[]);
+extern void xtables_trace_begin(const char *phase);
+extern void xtables_trace_end(void);
 extern struct xtables_match *xtables_find_match(const char *name,
 	enum xtables_tryload, struct xtables_rule_match **match);
 extern struct xtables_target *xtables_find_target(const char *name,
@@ -545,10 +551,30 @@ extern void xtables_print_num(uint64_t number, unsigned int format);
 	extern void init_extensions(void);
 	extern void init_extensions4(void);
 	extern void init_extensions6(void);
+#elif defined(XTABLES_BUNDLE)
+	/* bundled extensions are initialized on first use */
+#	ifdef _INIT
+#		undef _init
+#		define _init _INIT
+#	endif
 #else
 #	define _init __attribute__((constructor)) _INIT
 #endif
 
+/**
+ * Index embedded in the single-file extension bundle, see "make bundle" in
+ * extensions/. Sorted by @name, which is the name the extension would have
+ * as a separate shared object without ".so", e.g. "libxt_tcp". The last
+ * entry has a NULL @name.
+ */
+struct xtables_bundle_ext {
+	const char *name;
+	void (*init)(void);
+};
+
+#define XTABLES_BUNDLE_FILE	"libxtables_bundle.so"
+#define XTABLES_BUNDLE_INDEX	"xtables_bundle_index"
+
 extern const struct xtables_pprot xtables_chain_protos[];
 extern uint16_t xtables_parse_protocol(const char *s);
 
@@ -267,8 +267,19 @@ def main():
                         help='Run only this test')
     parser.add_argument('-m', '--missing', action='store_true',
                         help='Check for missing tests')
+    parser.add_argument('-n', '--nftables', action='store_true',
+                        help='Test iptables-over-nftables')
     args = parser.parse_args()
 
+    if args.nftables:
+        global IPTABLES, IP6TABLES, IPTABLES_SAVE, IP6TABLES_SAVE
+        IPTABLES = "iptables-compat"
+        IP6TABLES = "ip6tables-compat"
+        IPTABLES_SAVE = "iptables-compat-save"
+        IP6TABLES_SAVE = "ip6tables-compat-save"
+        # check every directly encoded rule against libnftnl
+        os.environ["XTABLES_CHECK_ENCODE"] = "1"
+
     #
     # show list of missing test files
     #
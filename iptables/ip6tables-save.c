@@ -63,10 +63,10 @@ static int do_output(const char *tablename) {
     if (!tablename)
         return for_each_table(&do_output);
 
-    h = ip6tc_init(tablename);
+    h = ip6tc_init_readonly(tablename);
     if (h == NULL) {
         xtables_load_ko(xtables_modprobe_program, false);
-        h = ip6tc_init(tablename);
+        h = ip6tc_init_readonly(tablename);
     }
     if (!h)
         xtables_error(OTHER_PROBLEM, "Cannot initialize: %s\n",
@@ -43,6 +43,7 @@ int ip6tables_main(int argc, char *argv[]) {
     struct xtc_handle *handle = NULL;
 
     ip6tables_globals.program_name = "ip6tables";
+    xtables_trace_args(&argc, argv);
     ret = xtables_init_all(&ip6tables_globals, NFPROTO_IPV6);
     if (ret < 0) {
         fprintf(stderr, "%s/%s Failed to initialize xtables\n",
@@ -52,13 +53,19 @@ int ip6tables_main(int argc, char *argv[]) {
     }
 
 #if defined(ALL_INCLUSIVE) || defined(NO_SHARED_LIBS)
+    xtables_trace_begin("init_extensions");
     init_extensions();
     init_extensions6();
+    xtables_trace_end();
 #endif
 
+    xtables_trace_begin("do_command");
     ret = do_command6(argc, argv, &table, &handle, false);
+    xtables_trace_end();
     if (ret) {
+        xtables_trace_begin("commit");
         ret = ip6tc_commit(handle);
+        xtables_trace_end();
         ip6tc_free(handle);
     }
 
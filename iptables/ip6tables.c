@@ -1281,6 +1281,7 @@ int do_command6(int argc, char *argv[], char **table,
     struct xtables_rule_match *matchp;
     struct xtables_target *t;
     unsigned long long cnt;
+    struct xtc_handle *(*init)(const char *) = ip6tc_init;
 
     memset(&cs, 0, sizeof(cs));
     cs.jumpto = "";
@@ -1700,13 +1701,17 @@ int do_command6(int argc, char *argv[], char **table,
         exit(RESOURCE_PROBLEM);
     }
 
+    /* plain listing never changes the table, no need to copy the rules */
+    if (command == CMD_LIST || command == CMD_LIST_RULES)
+        init = ip6tc_init_readonly;
+
     /* only allocate handle if we weren't called with a handle */
     if (!*handle)
-        *handle = ip6tc_init(*table);
+        *handle = init(*table);
 
     /* try to insmod the module if iptc_init failed */
     if (!*handle && xtables_load_ko(xtables_modprobe_program, false) != -1)
-        *handle = ip6tc_init(*table);
+        *handle = init(*table);
 
     if (!*handle)
         xtables_error(VERSION_PROBLEM,
@@ -24,6 +24,7 @@
 #endif
 
 static int counters, verbose, noflush, wait;
+static unsigned int jobs = 1;
 
 static struct timeval wait_interval = {
     .tv_sec = 1,
@@ -41,6 +42,7 @@ static const struct option options[] = {
     {.name = "table", .has_arg = 1, .val = 'T'},
     {.name = "wait", .has_arg = 2, .val = 'w'},
     {.name = "wait-interval", .has_arg = 2, .val = 'W'},
+    {.name = "jobs", .has_arg = 1, .val = 'j'},
     {NULL},
 };
 
@@ -49,8 +51,8 @@ static const struct option options[] = {
 
 static void print_usage(const char *name, const char *version) {
     fprintf(stderr,
-            "Usage: %s [-c] [-v] [-V] [-t] [-h] [-n] [-w secs] [-W usecs] [-T "
-            "table] [-M command]\n"
+            "Usage: %s [-c] [-v] [-V] [-t] [-h] [-n] [-w secs] [-W usecs] "
+            "[-j jobs] [-T table] [-M command]\n"
             "	   [ --counters ]\n"
             "	   [ --verbose ]\n"
             "	   [ --version]\n"
@@ -59,20 +61,26 @@ static void print_usage(const char *name, const char *version) {
             "	   [ --noflush ]\n"
             "	   [ --wait=<seconds>\n"
             "	   [ --wait-interval=<usecs>\n"
+            "	   [ --jobs=<number> ]\n"
             "	   [ --table=<TABLE> ]\n"
             "	   [ --modprobe=<command> ]\n",
             name);
 }
 
 static struct xtc_handle *create_handle(const char *tablename) {
+    struct xtc_handle *(*init)(const char *) = iptc_init;
     struct xtc_handle *handle;
 
-    handle = iptc_init(tablename);
+    /* The table is replaced as a whole, no need to read its rules */
+    if (noflush == 0)
+        init = iptc_init_flushed;
+
+    handle = init(tablename);
 
     if (!handle) {
         /* try to insmod the module if iptc_init failed */
         xtables_load_ko(xtables_modprobe_program, false);
-        handle = iptc_init(tablename);
+        handle = init(tablename);
     }
 
     if (!handle) {
@@ -182,6 +190,200 @@ static void add_param_to_argv(char *parsestart) {
     }
 }
 
+/* Run a rule line of the current table through do_command4() */
+static int parse_rule_line(char *buffer, char *prog, char *table,
+                           struct xtc_handle **handle) {
+    int a, ret;
+    char *ptr = buffer;
+    char *pcnt = NULL;
+    char *bcnt = NULL;
+    char *parsestart;
+
+    /* reset the newargv */
+    newargc = 0;
+
+    if (buffer[0] == '[') {
+        /* we have counters in our input */
+        ptr = strchr(buffer, ']');
+        if (!ptr)
+            xtables_error(PARAMETER_PROBLEM, "Bad line %u: need ]\n", line);
+
+        pcnt = strtok(buffer + 1, ":");
+        if (!pcnt)
+            xtables_error(PARAMETER_PROBLEM, "Bad line %u: need :\n", line);
+
+        bcnt = strtok(NULL, "]");
+        if (!bcnt)
+            xtables_error(PARAMETER_PROBLEM, "Bad line %u: need ]\n", line);
+
+        /* start command parsing after counter */
+        parsestart = ptr + 1;
+    } else {
+        /* start command parsing at start of line */
+        parsestart = buffer;
+    }
+
+    add_argv(prog);
+    add_argv("-t");
+    add_argv(table);
+
+    if (counters && pcnt && bcnt) {
+        add_argv("--set-counters");
+        add_argv((char *)pcnt);
+        add_argv((char *)bcnt);
+    }
+
+    add_param_to_argv(parsestart);
+
+    DEBUGP("calling do_command4(%u, argv, &%s, handle):\n", newargc, table);
+
+    for (a = 0; a < newargc; a++)
+        DEBUGP("argv[%u]: %s\n", a, newargv[a]);
+
+    ret = do_command4(newargc, newargv, &newargv[2], handle, true);
+
+    free_argv();
+    fflush(stdout);
+    return ret;
+}
+
+/* Rule lines held back to be parsed in parallel, see flush_rule_lines() */
+static struct {
+    char *buffer;
+    unsigned int line;
+} *held;
+static unsigned int num_held, held_sz;
+
+/* Only runs of appends are parsed in parallel; each chain then gets the
+ * rules of one run after those of the previous one, whichever way the
+ * lines were split */
+static bool is_append_line(const char *buffer) {
+    if (buffer[0] == '[') {
+        buffer = strchr(buffer, ']');
+        if (!buffer)
+            return false;
+        buffer++;
+    }
+    buffer += strspn(buffer, " \t");
+    return strncmp(buffer, "-A ", 3) == 0 ||
+           strncmp(buffer, "--append ", 9) == 0;
+}
+
+static void hold_rule_line(const char *buffer) {
+    if (num_held == held_sz) {
+        held_sz = held_sz ? held_sz * 2 : 1024;
+        held = xtables_realloc(held, held_sz * sizeof(*held));
+    }
+    held[num_held].buffer = strdup(buffer);
+    if (!held[num_held].buffer)
+        xtables_error(RESOURCE_PROBLEM, "strdup");
+    held[num_held].line = line;
+    num_held++;
+}
+
+/* What the children need, set by flush_rule_lines() */
+static struct xtc_handle *job_handle;
+static char *job_prog, *job_table;
+
+/* Child side: parse lines into a copy of the handle that was emptied
+ * first, then write out the new rules chain by chain */
+static void parse_rules_job(unsigned int first, unsigned int last,
+                            FILE *out) {
+    const struct ipt_entry *e;
+    const char *chain;
+    unsigned int i;
+
+    for (chain = iptc_first_chain(job_handle); chain;
+         chain = iptc_next_chain(job_handle))
+        iptc_flush_entries(chain, job_handle);
+
+    for (i = first; i < last; i++) {
+        line = held[i].line;
+        if (!parse_rule_line(held[i].buffer, job_prog, job_table,
+                             &job_handle)) {
+            fprintf(stderr, "%s: line %u failed\n", xt_params->program_name,
+                    line);
+            exit(1);
+        }
+    }
+
+    for (chain = iptc_first_chain(job_handle); chain;
+         chain = iptc_next_chain(job_handle)) {
+        xt_chainlabel label;
+
+        memset(label, 0, sizeof(label));
+        strcpy(label, chain);
+        for (e = iptc_first_rule(chain, job_handle); e;
+             e = iptc_next_rule(e, job_handle)) {
+            const char *target = iptc_get_target(e, job_handle);
+            struct xt_entry_target *t;
+            struct ipt_entry *copy;
+
+            /* the cache keeps standard verdicts, not their names */
+            copy = xtables_malloc(e->next_offset);
+            memcpy(copy, e, e->next_offset);
+            t = ipt_get_target(copy);
+            memset(t->u.user.name, 0, sizeof(t->u.user.name));
+            strcpy(t->u.user.name, target);
+
+            fwrite(label, sizeof(label), 1, out);
+            fwrite(copy, copy->next_offset, 1, out);
+            free(copy);
+        }
+    }
+}
+
+/* Parent side: append the rules of a run */
+static void merge_rules_job(FILE *in) {
+    struct ipt_entry hdr, *e;
+    xt_chainlabel chain;
+
+    while (fread(chain, sizeof(chain), 1, in) == 1) {
+        if (fread(&hdr, sizeof(hdr), 1, in) != 1)
+            xtables_error(OTHER_PROBLEM, "truncated parser output");
+        e = xtables_malloc(hdr.next_offset);
+        *e = hdr;
+        if (fread(e + 1, hdr.next_offset - sizeof(hdr), 1, in) != 1)
+            xtables_error(OTHER_PROBLEM, "truncated parser output");
+        if (!iptc_append_entry(chain, e, job_handle))
+            xtables_error(OTHER_PROBLEM, "can't append to chain `%s': %s",
+                          chain, iptc_strerror(errno));
+        free(e);
+    }
+}
+
+/* Parse the held back rule lines, in parallel if there are enough of
+ * them to make up for the fork()s */
+static void flush_rule_lines(char *prog, char *table,
+                             struct xtc_handle **handle) {
+    unsigned int i, n = num_held;
+    int cur_line = line;
+
+    if (n == 0)
+        return;
+    num_held = 0;
+
+    if (n >= jobs * 256) {
+        job_handle = *handle;
+        job_prog = prog;
+        job_table = table;
+        xs_restore_jobs(jobs, n, parse_rules_job, merge_rules_job);
+    } else {
+        for (i = 0; i < n; i++) {
+            line = held[i].line;
+            if (!parse_rule_line(held[i].buffer, prog, table, handle)) {
+                fprintf(stderr, "%s: line %u failed\n",
+                        xt_params->program_name, line);
+                exit(1);
+            }
+        }
+    }
+
+    for (i = 0; i < n; i++)
+        free(held[i].buffer);
+    line = cur_line;
+}
+
 int iptables_restore_main(int argc, char *argv[]) {
     struct xtc_handle *handle = NULL;
     char buffer[10240];
@@ -208,7 +410,7 @@ int iptables_restore_main(int argc, char *argv[]) {
     init_extensions4();
 #endif
 
-    while ((c = getopt_long(argc, argv, "bcvVthnwWM:T:", options, NULL)) !=
+    while ((c = getopt_long(argc, argv, "bcvVthnwWj:M:T:", options, NULL)) !=
            -1) {
         switch (c) {
         case 'b':
@@ -238,6 +440,11 @@ int iptables_restore_main(int argc, char *argv[]) {
         case 'W':
             parse_wait_interval(argc, argv, &wait_interval);
             break;
+        case 'j':
+            if (!xtables_strtoui(optarg, NULL, &jobs, 1, 64))
+                xtables_error(PARAMETER_PROBLEM,
+                              "invalid number of jobs `%s'", optarg);
+            break;
         case 'M':
             xtables_modprobe_program = optarg;
             break;
@@ -269,6 +476,13 @@ int iptables_restore_main(int argc, char *argv[]) {
         int ret = 0;
 
         line++;
+        if (jobs > 1 && in_table && is_append_line(buffer)) {
+            hold_rule_line(buffer);
+            continue;
+        }
+        if (buffer[0] != '\n')
+            flush_rule_lines(argv[0], curtable, &handle);
+
         if (buffer[0] == '\n')
             continue;
         else if (buffer[0] == '#') {
@@ -411,61 +625,7 @@ int iptables_restore_main(int argc, char *argv[]) {
             ret = 1;
 
         } else if (in_table) {
-            int a;
-            char *ptr = buffer;
-            char *pcnt = NULL;
-            char *bcnt = NULL;
-            char *parsestart;
-
-            /* reset the newargv */
-            newargc = 0;
-
-            if (buffer[0] == '[') {
-                /* we have counters in our input */
-                ptr = strchr(buffer, ']');
-                if (!ptr)
-                    xtables_error(PARAMETER_PROBLEM, "Bad line %u: need ]\n",
-                                  line);
-
-                pcnt = strtok(buffer + 1, ":");
-                if (!pcnt)
-                    xtables_error(PARAMETER_PROBLEM, "Bad line %u: need :\n",
-                                  line);
-
-                bcnt = strtok(NULL, "]");
-                if (!bcnt)
-                    xtables_error(PARAMETER_PROBLEM, "Bad line %u: need ]\n",
-                                  line);
-
-                /* start command parsing after counter */
-                parsestart = ptr + 1;
-            } else {
-                /* start command parsing at start of line */
-                parsestart = buffer;
-            }
-
-            add_argv(argv[0]);
-            add_argv("-t");
-            add_argv(curtable);
-
-            if (counters && pcnt && bcnt) {
-                add_argv("--set-counters");
-                add_argv((char *)pcnt);
-                add_argv((char *)bcnt);
-            }
-
-            add_param_to_argv(parsestart);
-
-            DEBUGP("calling do_command4(%u, argv, &%s, handle):\n", newargc,
-                   curtable);
-
-            for (a = 0; a < newargc; a++)
-                DEBUGP("argv[%u]: %s\n", a, newargv[a]);
-
-            ret = do_command4(newargc, newargv, &newargv[2], &handle, true);
-
-            free_argv();
-            fflush(stdout);
+            ret = parse_rule_line(buffer, argv[0], curtable, &handle);
         }
         if (tablename && (strcmp(tablename, curtable) != 0))
             continue;
@@ -476,6 +636,7 @@ int iptables_restore_main(int argc, char *argv[]) {
         }
     }
     if (in_table) {
+        flush_rule_lines(argv[0], curtable, &handle);
         fprintf(stderr, "%s: COMMIT expected at line %u\n",
                 xt_params->program_name, line + 1);
         exit(1);
@@ -62,10 +62,10 @@ static int do_output(const char *tablename) {
     if (!tablename)
         return for_each_table(&do_output);
 
-    h = iptc_init(tablename);
+    h = iptc_init_readonly(tablename);
     if (h == NULL) {
         xtables_load_ko(xtables_modprobe_program, false);
-        h = iptc_init(tablename);
+        h = iptc_init_readonly(tablename);
     }
     if (!h)
         xtables_error(OTHER_PROBLEM, "Cannot initialize: %s\n",
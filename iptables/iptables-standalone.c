@@ -44,6 +44,7 @@ int iptables_main(int argc, char *argv[]) {
     struct xtc_handle *handle = NULL;
 
     iptables_globals.program_name = "iptables";
+    xtables_trace_args(&argc, argv);
     ret = xtables_init_all(&iptables_globals, NFPROTO_IPV4);
     if (ret < 0) {
         fprintf(stderr, "%s/%s Failed to initialize xtables\n",
@@ -52,13 +53,19 @@ int iptables_main(int argc, char *argv[]) {
         exit(1);
     }
 #if defined(ALL_INCLUSIVE) || defined(NO_SHARED_LIBS)
+    xtables_trace_begin("init_extensions");
     init_extensions();
     init_extensions4();
+    xtables_trace_end();
 #endif
 
+    xtables_trace_begin("do_command");
     ret = do_command4(argc, argv, &table, &handle, false);
+    xtables_trace_end();
     if (ret) {
+        xtables_trace_begin("commit");
         ret = iptc_commit(handle);
+        xtables_trace_end();
         iptc_free(handle);
     }
 
@@ -29,6 +29,7 @@
 static int nft_ipv4_add(struct nftnl_rule *r, void *data) {
     struct iptables_command_state *cs = data;
     struct xtables_rule_match *matchp;
+    uint8_t l4proto;
     uint32_t op;
     int ret;
 
@@ -47,36 +48,40 @@ static int nft_ipv4_add(struct nftnl_rule *r, void *data) {
         add_proto(r, offsetof(struct iphdr, protocol), 1, cs->fw.ip.proto, op);
     }
 
-    if (cs->fw.ip.src.s_addr != 0) {
+    if (cs->src_set.name[0] != '\0') {
+        add_addr_set(r, offsetof(struct iphdr, saddr), sizeof(struct in_addr),
+                     &cs->src_set);
+    } else if (cs->fw.ip.src.s_addr != 0) {
         op = nft_invflags2cmp(cs->fw.ip.invflags, IPT_INV_SRCIP);
         add_addr(r, offsetof(struct iphdr, saddr), &cs->fw.ip.src.s_addr,
                  &cs->fw.ip.smsk.s_addr, sizeof(struct in_addr), op);
     }
-    if (cs->fw.ip.dst.s_addr != 0) {
+    if (cs->dst_set.name[0] != '\0') {
+        add_addr_set(r, offsetof(struct iphdr, daddr), sizeof(struct in_addr),
+                     &cs->dst_set);
+    } else if (cs->fw.ip.dst.s_addr != 0) {
         op = nft_invflags2cmp(cs->fw.ip.invflags, IPT_INV_DSTIP);
         add_addr(r, offsetof(struct iphdr, daddr), &cs->fw.ip.dst.s_addr,
                  &cs->fw.ip.dmsk.s_addr, sizeof(struct in_addr), op);
     }
     if (cs->fw.ip.flags & IPT_F_FRAG) {
-        add_payload(r, offsetof(struct iphdr, frag_off), 2,
-                    NFT_PAYLOAD_NETWORK_HEADER);
-        /* get the 13 bits that contain the fragment offset */
-        add_bitwise_u16(r, 0x1fff, !0x1fff);
-
         /* if offset is non-zero, this is a fragment */
         op = nft_invflags2cmp(cs->fw.ip.invflags, IPT_INV_FRAG);
-        add_cmp_u16(r, 0, op);
+        add_frag(r, op);
     }
 
     add_compat(r, cs->fw.ip.proto, cs->fw.ip.invflags);
 
+    /* protocol the port matches may rely on, see add_native_match() */
+    l4proto = cs->fw.ip.invflags & XT_INV_PROTO ? 0 : cs->fw.ip.proto;
+
     for (matchp = cs->matches; matchp; matchp = matchp->next) {
         /* Use nft built-in comments support instead of comment match */
         if (strcmp(matchp->match->name, "comment") == 0) {
             ret = add_comment(r, (char *)matchp->match->m->data);
             if (ret < 0)
                 return ret;
-        } else {
+        } else if (!add_native_match(r, matchp->match->m, l4proto)) {
             ret = add_match(r, matchp->match->m);
             if (ret < 0)
                 return ret;
@@ -92,6 +97,65 @@ static int nft_ipv4_add(struct nftnl_rule *r, void *data) {
     return add_action(r, cs, !!(cs->fw.ip.flags & IPT_F_GOTO));
 }
 
+/* Same as nft_ipv4_add(), but straight to netlink attributes */
+static int nft_ipv4_encode(struct nft_rule_enc *e, void *data) {
+    struct iptables_command_state *cs = data;
+    struct xtables_rule_match *matchp;
+    uint8_t l4proto;
+    uint32_t op;
+
+    if (cs->fw.ip.iniface[0] != '\0') {
+        op = nft_invflags2cmp(cs->fw.ip.invflags, IPT_INV_VIA_IN);
+        enc_iniface(e, cs->fw.ip.iniface, op);
+    }
+
+    if (cs->fw.ip.outiface[0] != '\0') {
+        op = nft_invflags2cmp(cs->fw.ip.invflags, IPT_INV_VIA_OUT);
+        enc_outiface(e, cs->fw.ip.outiface, op);
+    }
+
+    if (cs->fw.ip.proto != 0) {
+        op = nft_invflags2cmp(cs->fw.ip.invflags, XT_INV_PROTO);
+        enc_proto(e, offsetof(struct iphdr, protocol), 1, cs->fw.ip.proto, op);
+    }
+
+    if (cs->src_set.name[0] != '\0') {
+        enc_addr_set(e, offsetof(struct iphdr, saddr), sizeof(struct in_addr),
+                     &cs->src_set);
+    } else if (cs->fw.ip.src.s_addr != 0) {
+        op = nft_invflags2cmp(cs->fw.ip.invflags, IPT_INV_SRCIP);
+        enc_addr(e, offsetof(struct iphdr, saddr), &cs->fw.ip.src.s_addr,
+                 &cs->fw.ip.smsk.s_addr, sizeof(struct in_addr), op);
+    }
+    if (cs->dst_set.name[0] != '\0') {
+        enc_addr_set(e, offsetof(struct iphdr, daddr), sizeof(struct in_addr),
+                     &cs->dst_set);
+    } else if (cs->fw.ip.dst.s_addr != 0) {
+        op = nft_invflags2cmp(cs->fw.ip.invflags, IPT_INV_DSTIP);
+        enc_addr(e, offsetof(struct iphdr, daddr), &cs->fw.ip.dst.s_addr,
+                 &cs->fw.ip.dmsk.s_addr, sizeof(struct in_addr), op);
+    }
+    if (cs->fw.ip.flags & IPT_F_FRAG) {
+        op = nft_invflags2cmp(cs->fw.ip.invflags, IPT_INV_FRAG);
+        enc_frag(e, op);
+    }
+
+    enc_compat(e, cs->fw.ip.proto, cs->fw.ip.invflags);
+
+    l4proto = cs->fw.ip.invflags & XT_INV_PROTO ? 0 : cs->fw.ip.proto;
+    for (matchp = cs->matches; matchp; matchp = matchp->next) {
+        if (strcmp(matchp->match->name, "comment") == 0)
+            enc_comment(e, (char *)matchp->match->m->data);
+        else if (!enc_native_match(e, matchp->match->m, l4proto))
+            enc_match(e, matchp->match->m);
+    }
+
+    enc_counters(e, cs->counters.pcnt, cs->counters.bcnt);
+    enc_action(e, cs, !!(cs->fw.ip.flags & IPT_F_GOTO));
+
+    return e->error ? -1 : 0;
+}
+
 static bool nft_ipv4_is_same(const void *data_a, const void *data_b) {
     const struct iptables_command_state *a = data_a;
     const struct iptables_command_state *b = data_b;
@@ -106,6 +170,11 @@ static bool nft_ipv4_is_same(const void *data_a, const void *data_b) {
         return false;
     }
 
+    if (!is_same_addr_sets(a, b)) {
+        DEBUGP("different address sets\n");
+        return false;
+    }
+
     return is_same_interfaces(a->fw.ip.iniface, a->fw.ip.outiface,
                               a->fw.ip.iniface_mask, a->fw.ip.outiface_mask,
                               b->fw.ip.iniface, b->fw.ip.outiface,
@@ -208,10 +277,16 @@ static void nft_ipv4_parse_payload(struct nft_xt_ctx *ctx, struct nftnl_expr *e,
             cs->fw.ip.invflags |= IPT_INV_PROTO;
         break;
     case offsetof(struct iphdr, frag_off):
+        /* this may be the check of tcp or udp ports, see add_native_match() */
+        ctx->frag.flags = cs->fw.ip.flags & IPT_F_FRAG;
+        ctx->frag.invflags = cs->fw.ip.invflags & IPT_INV_FRAG;
+
         cs->fw.ip.flags |= IPT_F_FRAG;
         get_frag(ctx, e, &inv);
-        if (inv)
+        if (inv) {
             cs->fw.ip.invflags |= IPT_INV_FRAG;
+            ctx->flags |= NFT_XT_CTX_FRAG;
+        }
         break;
     default:
         DEBUGP("unknown payload offset %d\n", ctx->payload.offset);
@@ -236,12 +311,29 @@ static void nft_ipv4_print_header(unsigned int format, const char *chain,
     print_header(format, chain, pol, counters, basechain, refs);
 }
 
+static void nft_ipv4_parse_lookup(struct nft_xt_ctx *ctx, const char *set,
+                                  void *data) {
+    struct iptables_command_state *cs = data;
+
+    switch (ctx->payload.offset) {
+    case offsetof(struct iphdr, saddr):
+        snprintf(cs->src_set.name, sizeof(cs->src_set.name), "%s", set);
+        break;
+    case offsetof(struct iphdr, daddr):
+        snprintf(cs->dst_set.name, sizeof(cs->dst_set.name), "%s", set);
+        break;
+    }
+}
+
 static void print_ipv4_addr(const struct iptables_command_state *cs,
                             unsigned int format) {
     char buf[BUFSIZ];
 
     fputc(cs->fw.ip.invflags & IPT_INV_SRCIP ? '!' : ' ', stdout);
-    if (cs->fw.ip.smsk.s_addr == 0L && !(format & FMT_NUMERIC))
+    if (cs->src_set.name[0] != '\0') {
+        snprintf(buf, sizeof(buf), "@%s", cs->src_set.name);
+        printf(FMT("%-19s ", "%s "), buf);
+    } else if (cs->fw.ip.smsk.s_addr == 0L && !(format & FMT_NUMERIC))
         printf(FMT("%-19s ", "%s "), "anywhere");
     else {
         if (format & FMT_NUMERIC)
@@ -253,7 +345,10 @@ static void print_ipv4_addr(const struct iptables_command_state *cs,
     }
 
     fputc(cs->fw.ip.invflags & IPT_INV_DSTIP ? '!' : ' ', stdout);
-    if (cs->fw.ip.dmsk.s_addr == 0L && !(format & FMT_NUMERIC))
+    if (cs->dst_set.name[0] != '\0') {
+        snprintf(buf, sizeof(buf), "@%s", cs->dst_set.name);
+        printf(FMT("%-19s ", "-> %s"), buf);
+    } else if (cs->fw.ip.dmsk.s_addr == 0L && !(format & FMT_NUMERIC))
         printf(FMT("%-19s ", "-> %s"), "anywhere");
     else {
         if (format & FMT_NUMERIC)
@@ -326,10 +421,16 @@ static void nft_ipv4_save_firewall(const void *data, unsigned int format) {
         printf("-f ");
     }
 
-    save_ipv4_addr('s', &cs->fw.ip.src, cs->fw.ip.smsk.s_addr,
-                   cs->fw.ip.invflags & IPT_INV_SRCIP);
-    save_ipv4_addr('d', &cs->fw.ip.dst, cs->fw.ip.dmsk.s_addr,
-                   cs->fw.ip.invflags & IPT_INV_DSTIP);
+    if (cs->src_set.name[0] != '\0')
+        save_addr_set('s', &cs->src_set);
+    else
+        save_ipv4_addr('s', &cs->fw.ip.src, cs->fw.ip.smsk.s_addr,
+                       cs->fw.ip.invflags & IPT_INV_SRCIP);
+    if (cs->dst_set.name[0] != '\0')
+        save_addr_set('d', &cs->dst_set);
+    else
+        save_ipv4_addr('d', &cs->fw.ip.dst, cs->fw.ip.dmsk.s_addr,
+                       cs->fw.ip.invflags & IPT_INV_DSTIP);
 
     save_matches_and_target(cs->matches, cs->target, cs->jumpto,
                             cs->fw.ip.flags, &cs->fw);
@@ -466,9 +567,11 @@ static int nft_ipv4_xlate(const void *data, struct xt_xlate *xl) {
 
 struct nft_family_ops nft_family_ops_ipv4 = {
     .add = nft_ipv4_add,
+    .encode = nft_ipv4_encode,
     .is_same = nft_ipv4_is_same,
     .parse_meta = nft_ipv4_parse_meta,
     .parse_payload = nft_ipv4_parse_payload,
+    .parse_lookup = nft_ipv4_parse_lookup,
     .parse_immediate = nft_ipv4_parse_immediate,
     .print_header = nft_ipv4_print_header,
     .print_firewall = nft_ipv4_print_firewall,
@@ -47,12 +47,18 @@ static int nft_ipv6_add(struct nftnl_rule *r, void *data) {
                   op);
     }
 
-    if (!IN6_IS_ADDR_UNSPECIFIED(&cs->fw6.ipv6.src)) {
+    if (cs->src_set.name[0] != '\0') {
+        add_addr_set(r, offsetof(struct ip6_hdr, ip6_src),
+                     sizeof(struct in6_addr), &cs->src_set);
+    } else if (!IN6_IS_ADDR_UNSPECIFIED(&cs->fw6.ipv6.src)) {
         op = nft_invflags2cmp(cs->fw6.ipv6.invflags, IPT_INV_SRCIP);
         add_addr(r, offsetof(struct ip6_hdr, ip6_src), &cs->fw6.ipv6.src,
                  &cs->fw6.ipv6.smsk, sizeof(struct in6_addr), op);
     }
-    if (!IN6_IS_ADDR_UNSPECIFIED(&cs->fw6.ipv6.dst)) {
+    if (cs->dst_set.name[0] != '\0') {
+        add_addr_set(r, offsetof(struct ip6_hdr, ip6_dst),
+                     sizeof(struct in6_addr), &cs->dst_set);
+    } else if (!IN6_IS_ADDR_UNSPECIFIED(&cs->fw6.ipv6.dst)) {
         op = nft_invflags2cmp(cs->fw6.ipv6.invflags, IPT_INV_DSTIP);
         add_addr(r, offsetof(struct ip6_hdr, ip6_dst), &cs->fw6.ipv6.dst,
                  &cs->fw6.ipv6.dmsk, sizeof(struct in6_addr), op);
@@ -65,7 +71,7 @@ static int nft_ipv6_add(struct nftnl_rule *r, void *data) {
             ret = add_comment(r, (char *)matchp->match->m->data);
             if (ret < 0)
                 return ret;
-        } else {
+        } else if (!add_native_match(r, matchp->match->m, 0)) {
             ret = add_match(r, matchp->match->m);
             if (ret < 0)
                 return ret;
@@ -81,6 +87,59 @@ static int nft_ipv6_add(struct nftnl_rule *r, void *data) {
     return add_action(r, cs, !!(cs->fw6.ipv6.flags & IP6T_F_GOTO));
 }
 
+/* Same as nft_ipv6_add(), but straight to netlink attributes */
+static int nft_ipv6_encode(struct nft_rule_enc *e, void *data) {
+    struct iptables_command_state *cs = data;
+    struct xtables_rule_match *matchp;
+    uint32_t op;
+
+    if (cs->fw6.ipv6.iniface[0] != '\0') {
+        op = nft_invflags2cmp(cs->fw6.ipv6.invflags, IPT_INV_VIA_IN);
+        enc_iniface(e, cs->fw6.ipv6.iniface, op);
+    }
+
+    if (cs->fw6.ipv6.outiface[0] != '\0') {
+        op = nft_invflags2cmp(cs->fw6.ipv6.invflags, IPT_INV_VIA_OUT);
+        enc_outiface(e, cs->fw6.ipv6.outiface, op);
+    }
+
+    if (cs->fw6.ipv6.proto != 0) {
+        op = nft_invflags2cmp(cs->fw6.ipv6.invflags, XT_INV_PROTO);
+        enc_proto(e, offsetof(struct ip6_hdr, ip6_nxt), 1, cs->fw6.ipv6.proto,
+                  op);
+    }
+
+    if (cs->src_set.name[0] != '\0') {
+        enc_addr_set(e, offsetof(struct ip6_hdr, ip6_src),
+                     sizeof(struct in6_addr), &cs->src_set);
+    } else if (!IN6_IS_ADDR_UNSPECIFIED(&cs->fw6.ipv6.src)) {
+        op = nft_invflags2cmp(cs->fw6.ipv6.invflags, IPT_INV_SRCIP);
+        enc_addr(e, offsetof(struct ip6_hdr, ip6_src), &cs->fw6.ipv6.src,
+                 &cs->fw6.ipv6.smsk, sizeof(struct in6_addr), op);
+    }
+    if (cs->dst_set.name[0] != '\0') {
+        enc_addr_set(e, offsetof(struct ip6_hdr, ip6_dst),
+                     sizeof(struct in6_addr), &cs->dst_set);
+    } else if (!IN6_IS_ADDR_UNSPECIFIED(&cs->fw6.ipv6.dst)) {
+        op = nft_invflags2cmp(cs->fw6.ipv6.invflags, IPT_INV_DSTIP);
+        enc_addr(e, offsetof(struct ip6_hdr, ip6_dst), &cs->fw6.ipv6.dst,
+                 &cs->fw6.ipv6.dmsk, sizeof(struct in6_addr), op);
+    }
+    enc_compat(e, cs->fw6.ipv6.proto, cs->fw6.ipv6.invflags);
+
+    for (matchp = cs->matches; matchp; matchp = matchp->next) {
+        if (strcmp(matchp->match->name, "comment") == 0)
+            enc_comment(e, (char *)matchp->match->m->data);
+        else if (!enc_native_match(e, matchp->match->m, 0))
+            enc_match(e, matchp->match->m);
+    }
+
+    enc_counters(e, cs->counters.pcnt, cs->counters.bcnt);
+    enc_action(e, cs, !!(cs->fw6.ipv6.flags & IP6T_F_GOTO));
+
+    return e->error ? -1 : 0;
+}
+
 static bool nft_ipv6_is_same(const void *data_a, const void *data_b) {
     const struct iptables_command_state *a = data_a;
     const struct iptables_command_state *b = data_b;
@@ -96,6 +155,11 @@ static bool nft_ipv6_is_same(const void *data_a, const void *data_b) {
         return false;
     }
 
+    if (!is_same_addr_sets(a, b)) {
+        DEBUGP("different address sets\n");
+        return false;
+    }
+
     return is_same_interfaces(
         a->fw6.ipv6.iniface, a->fw6.ipv6.outiface, a->fw6.ipv6.iniface_mask,
         a->fw6.ipv6.outiface_mask, b->fw6.ipv6.iniface, b->fw6.ipv6.outiface,
@@ -178,12 +242,30 @@ static void nft_ipv6_print_header(unsigned int format, const char *chain,
     print_header(format, chain, pol, counters, basechain, refs);
 }
 
+static void nft_ipv6_parse_lookup(struct nft_xt_ctx *ctx, const char *set,
+                                  void *data) {
+    struct iptables_command_state *cs = data;
+
+    switch (ctx->payload.offset) {
+    case offsetof(struct ip6_hdr, ip6_src):
+        snprintf(cs->src_set.name, sizeof(cs->src_set.name), "%s", set);
+        break;
+    case offsetof(struct ip6_hdr, ip6_dst):
+        snprintf(cs->dst_set.name, sizeof(cs->dst_set.name), "%s", set);
+        break;
+    }
+}
+
 static void print_ipv6_addr(const struct iptables_command_state *cs,
                             unsigned int format) {
     char buf[BUFSIZ];
 
     fputc(cs->fw6.ipv6.invflags & IP6T_INV_SRCIP ? '!' : ' ', stdout);
-    if (IN6_IS_ADDR_UNSPECIFIED(&cs->fw6.ipv6.src) && !(format & FMT_NUMERIC))
+    if (cs->src_set.name[0] != '\0') {
+        snprintf(buf, sizeof(buf), "@%s", cs->src_set.name);
+        printf(FMT("%-19s ", "%s "), buf);
+    } else if (IN6_IS_ADDR_UNSPECIFIED(&cs->fw6.ipv6.src) &&
+               !(format & FMT_NUMERIC))
         printf(FMT("%-19s ", "%s "), "anywhere");
     else {
         if (format & FMT_NUMERIC)
@@ -195,7 +277,11 @@ static void print_ipv6_addr(const struct iptables_command_state *cs,
     }
 
     fputc(cs->fw6.ipv6.invflags & IP6T_INV_DSTIP ? '!' : ' ', stdout);
-    if (IN6_IS_ADDR_UNSPECIFIED(&cs->fw6.ipv6.dst) && !(format & FMT_NUMERIC))
+    if (cs->dst_set.name[0] != '\0') {
+        snprintf(buf, sizeof(buf), "@%s", cs->dst_set.name);
+        printf(FMT("%-19s ", "-> %s"), buf);
+    } else if (IN6_IS_ADDR_UNSPECIFIED(&cs->fw6.ipv6.dst) &&
+               !(format & FMT_NUMERIC))
         printf(FMT("%-19s ", "-> %s"), "anywhere");
     else {
         if (format & FMT_NUMERIC)
@@ -250,10 +336,16 @@ static void nft_ipv6_save_firewall(const void *data, unsigned int format) {
                           cs->fw6.ipv6.iniface, cs->fw6.ipv6.iniface_mask,
                           cs->fw6.ipv6.outiface, cs->fw6.ipv6.outiface_mask);
 
-    save_ipv6_addr('s', &cs->fw6.ipv6.src,
-                   cs->fw6.ipv6.invflags & IP6T_INV_SRCIP);
-    save_ipv6_addr('d', &cs->fw6.ipv6.dst,
-                   cs->fw6.ipv6.invflags & IP6T_INV_DSTIP);
+    if (cs->src_set.name[0] != '\0')
+        save_addr_set('s', &cs->src_set);
+    else
+        save_ipv6_addr('s', &cs->fw6.ipv6.src,
+                       cs->fw6.ipv6.invflags & IP6T_INV_SRCIP);
+    if (cs->dst_set.name[0] != '\0')
+        save_addr_set('d', &cs->dst_set);
+    else
+        save_ipv6_addr('d', &cs->fw6.ipv6.dst,
+                       cs->fw6.ipv6.invflags & IP6T_INV_DSTIP);
 
     save_matches_and_target(cs->matches, cs->target, cs->jumpto,
                             cs->fw6.ipv6.flags, &cs->fw6);
@@ -407,9 +499,11 @@ static int nft_ipv6_xlate(const void *data, struct xt_xlate *xl) {
 
 struct nft_family_ops nft_family_ops_ipv6 = {
     .add = nft_ipv6_add,
+    .encode = nft_ipv6_encode,
     .is_same = nft_ipv6_is_same,
     .parse_meta = nft_ipv6_parse_meta,
     .parse_payload = nft_ipv6_parse_payload,
+    .parse_lookup = nft_ipv6_parse_lookup,
     .parse_immediate = nft_ipv6_parse_immediate,
     .print_header = nft_ipv6_print_header,
     .print_firewall = nft_ipv6_print_firewall,
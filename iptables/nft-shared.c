@@ -12,6 +12,7 @@
 
 #include <errno.h>
 #include <netdb.h>
+#include <netinet/ip.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -20,6 +21,9 @@
 #include <xtables.h>
 
 #include <linux/netfilter/nf_tables.h>
+#include <linux/netfilter/xt_conntrack.h>
+#include <linux/netfilter/xt_mark.h>
+#include <linux/netfilter/xt_tcpudp.h>
 
 #include <libmnl/libmnl.h>
 #include <libnftnl/expr.h>
@@ -48,6 +52,19 @@ void add_meta(struct nftnl_rule *r, uint32_t key) {
     nftnl_rule_add_expr(r, expr);
 }
 
+void add_ct(struct nftnl_rule *r, uint32_t key) {
+    struct nftnl_expr *expr;
+
+    expr = nftnl_expr_alloc("ct");
+    if (expr == NULL)
+        return;
+
+    nftnl_expr_set_u32(expr, NFTNL_EXPR_CT_KEY, key);
+    nftnl_expr_set_u32(expr, NFTNL_EXPR_CT_DREG, NFT_REG_1);
+
+    nftnl_rule_add_expr(r, expr);
+}
+
 void add_payload(struct nftnl_rule *r, int offset, int len, uint32_t base) {
     struct nftnl_expr *expr;
 
@@ -155,12 +172,441 @@ void add_addr(struct nftnl_rule *r, int offset, void *data, void *mask,
     add_cmp_ptr(r, op, data, len);
 }
 
+/* Matches the address at @offset against the elements of @set */
+void add_addr_set(struct nftnl_rule *r, int offset, size_t len,
+                  const struct xt_addr_set *set) {
+    struct nftnl_expr *expr;
+
+    add_payload(r, offset, len, NFT_PAYLOAD_NETWORK_HEADER);
+
+    expr = nftnl_expr_alloc("lookup");
+    if (expr == NULL)
+        return;
+
+    nftnl_expr_set_u32(expr, NFTNL_EXPR_LOOKUP_SREG, NFT_REG_1);
+    nftnl_expr_set_str(expr, NFTNL_EXPR_LOOKUP_SET, set->name);
+    if (set->id != 0)
+        nftnl_expr_set_u32(expr, NFTNL_EXPR_LOOKUP_SET_ID, set->id);
+
+    nftnl_rule_add_expr(r, expr);
+}
+
 void add_proto(struct nftnl_rule *r, int offset, size_t len, uint8_t proto,
                uint32_t op) {
     add_payload(r, offset, len, NFT_PAYLOAD_NETWORK_HEADER);
     add_cmp_u8(r, proto, op);
 }
 
+/* Fragment offset of IPv4, it is zero for unfragmented packets and first
+ * fragments, see -f.
+ */
+void add_frag(struct nftnl_rule *r, uint32_t op) {
+    uint16_t mask = htons(0x1fff);
+
+    add_payload(r, offsetof(struct iphdr, frag_off), sizeof(uint16_t),
+                NFT_PAYLOAD_NETWORK_HEADER);
+    add_bitwise(r, (uint8_t *)&mask, sizeof(mask));
+    add_cmp_u16(r, 0, op);
+}
+
+/*
+ * Some matches are compiled into native expressions, which the kernel
+ * evaluates without calling back into x_tables. nft_parse_cmp() turns the
+ * expressions back into the match, so only what it can rebuild exactly is
+ * translated, anything else stays a compat match.
+ *
+ * Port matches of tcp and udp become payload and cmp. Like the x_tables
+ * matches, the expressions must only see first fragments of packets of
+ * their protocol. So ports are only translated if the rule is restricted
+ * to that protocol, which the match requires anyway, and the caller can
+ * guard them with the fragment check of -f, which only IPv4 does (@l4proto
+ * is 0 otherwise). Matches using tcp flags or options, inverted port ranges
+ * or no ports at all stay compat matches.
+ */
+struct th_ports {
+    const uint16_t *spts;
+    const uint16_t *dpts;
+    bool sinv;
+    bool dinv;
+};
+
+static bool th_port_any(const uint16_t *pts, bool inv) {
+    return !inv && pts[0] == 0 && pts[1] == 0xffff;
+}
+
+static bool th_ports_get(const struct xt_entry_match *m, uint8_t l4proto,
+                         struct th_ports *p) {
+    if (m->u.user.revision != 0)
+        return false;
+
+    if (strcmp(m->u.user.name, "tcp") == 0 && l4proto == IPPROTO_TCP) {
+        const struct xt_tcp *tcp = (const void *)m->data;
+
+        if (tcp->option || tcp->flg_mask ||
+            (tcp->invflags & ~(XT_TCP_INV_SRCPT | XT_TCP_INV_DSTPT)))
+            return false;
+
+        p->spts = tcp->spts;
+        p->dpts = tcp->dpts;
+        p->sinv = tcp->invflags & XT_TCP_INV_SRCPT;
+        p->dinv = tcp->invflags & XT_TCP_INV_DSTPT;
+    } else if (strcmp(m->u.user.name, "udp") == 0 &&
+               l4proto == IPPROTO_UDP) {
+        const struct xt_udp *udp = (const void *)m->data;
+
+        if (udp->invflags & ~(XT_UDP_INV_SRCPT | XT_UDP_INV_DSTPT))
+            return false;
+
+        p->spts = udp->spts;
+        p->dpts = udp->dpts;
+        p->sinv = udp->invflags & XT_UDP_INV_SRCPT;
+        p->dinv = udp->invflags & XT_UDP_INV_DSTPT;
+    } else {
+        return false;
+    }
+
+    /* an inverted range would take two cmps or'ed together */
+    if ((p->sinv && p->spts[0] != p->spts[1]) ||
+        (p->dinv && p->dpts[0] != p->dpts[1]))
+        return false;
+
+    return !th_port_any(p->spts, p->sinv) || !th_port_any(p->dpts, p->dinv);
+}
+
+/* -m mark, revision 1 only, becomes meta mark, bitwise and cmp */
+static bool mark_get(const struct xt_entry_match *m,
+                     struct xt_mark_mtinfo1 *info) {
+    if (strcmp(m->u.user.name, "mark") != 0 || m->u.user.revision != 1)
+        return false;
+
+    memcpy(info, m->data, sizeof(*info));
+    return true;
+}
+
+/*
+ * -m conntrack --ctstate becomes ct state, bitwise and cmp. The bits of
+ * INVALID, ESTABLISHED, RELATED and NEW are the same in both, the other
+ * states have no ct state counterpart. The state match, an alias of
+ * conntrack, is left alone since the expressions can't tell it apart.
+ */
+#define CT_STATE_MASK 0xf
+static bool ctstate_get(const struct xt_entry_match *m, uint32_t *state,
+                        bool *inv) {
+    const struct xt_conntrack_mtinfo1 *info1 = (const void *)m->data;
+    const struct xt_conntrack_mtinfo2 *info2 = (const void *)m->data;
+
+    if (strcmp(m->u.user.name, "conntrack") != 0)
+        return false;
+
+    /* the flags are at the same place in all revisions */
+    switch (m->u.user.revision) {
+    case 1:
+        *state = info1->state_mask;
+        break;
+    case 2:
+    case 3:
+        *state = info2->state_mask;
+        break;
+    default:
+        return false;
+    }
+    if (info1->match_flags != XT_CONNTRACK_STATE ||
+        (info1->invert_flags & ~XT_CONNTRACK_STATE) ||
+        (*state & ~CT_STATE_MASK))
+        return false;
+
+    *inv = info1->invert_flags & XT_CONNTRACK_STATE;
+    return true;
+}
+
+static void add_th_port(struct nftnl_rule *r, int offset, const uint16_t *pts,
+                        bool inv) {
+    if (th_port_any(pts, inv))
+        return;
+
+    add_payload(r, offset, sizeof(uint16_t), NFT_PAYLOAD_TRANSPORT_HEADER);
+    if (pts[0] == pts[1]) {
+        add_cmp_u16(r, htons(pts[0]), inv ? NFT_CMP_NEQ : NFT_CMP_EQ);
+    } else {
+        add_cmp_u16(r, htons(pts[0]), NFT_CMP_GTE);
+        add_cmp_u16(r, htons(pts[1]), NFT_CMP_LTE);
+    }
+}
+
+bool add_native_match(struct nftnl_rule *r, const struct xt_entry_match *m,
+                      uint8_t l4proto) {
+    struct xt_mark_mtinfo1 mark;
+    struct th_ports p;
+    uint32_t state;
+    bool inv;
+
+    if (th_ports_get(m, l4proto, &p)) {
+        add_frag(r, NFT_CMP_EQ);
+        add_th_port(r, 0, p.spts, p.sinv);
+        add_th_port(r, 2, p.dpts, p.dinv);
+    } else if (mark_get(m, &mark)) {
+        add_meta(r, NFT_META_MARK);
+        if (mark.mask != 0xffffffff)
+            add_bitwise(r, (uint8_t *)&mark.mask, sizeof(mark.mask));
+        add_cmp_u32(r, mark.mark, mark.invert ? NFT_CMP_NEQ : NFT_CMP_EQ);
+    } else if (ctstate_get(m, &state, &inv)) {
+        add_ct(r, NFT_CT_STATE);
+        add_bitwise(r, (uint8_t *)&state, sizeof(state));
+        add_cmp_u32(r, 0, inv ? NFT_CMP_EQ : NFT_CMP_NEQ);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Direct encoder counterparts of the add_*() helpers above. They append
+ * the same attributes libnftnl would build for the expression.
+ */
+
+/* Room for the attributes of an expression besides its variable data */
+#define ENC_EXPR_ROOM 128
+
+void enc_put(struct nft_rule_enc *e, uint16_t type, size_t len,
+             const void *data) {
+    mnl_attr_put(e->nlh, type, len, data);
+}
+
+void enc_put_u32(struct nft_rule_enc *e, uint16_t type, uint32_t data) {
+    mnl_attr_put_u32(e->nlh, type, htonl(data));
+}
+
+void enc_put_strz(struct nft_rule_enc *e, uint16_t type, const char *data) {
+    mnl_attr_put_strz(e->nlh, type, data);
+}
+
+struct nlattr *enc_nest_start(struct nft_rule_enc *e, uint16_t type) {
+    return mnl_attr_nest_start(e->nlh, type);
+}
+
+void enc_nest_end(struct nft_rule_enc *e, struct nlattr *nest) {
+    mnl_attr_nest_end(e->nlh, nest);
+}
+
+bool enc_expr_start(struct nft_rule_enc *e, const char *name, size_t len,
+                    struct nlattr *nest[2]) {
+    if (e->error || e->nlh->nlmsg_len + ENC_EXPR_ROOM + len > e->size) {
+        e->error = true;
+        return false;
+    }
+
+    nest[0] = enc_nest_start(e, NFTA_LIST_ELEM);
+    enc_put_strz(e, NFTA_EXPR_NAME, name);
+    nest[1] = enc_nest_start(e, NFTA_EXPR_DATA);
+    return true;
+}
+
+void enc_expr_end(struct nft_rule_enc *e, struct nlattr *nest[2]) {
+    enc_nest_end(e, nest[1]);
+    enc_nest_end(e, nest[0]);
+}
+
+static void enc_data(struct nft_rule_enc *e, uint16_t type, const void *data,
+                     size_t len) {
+    struct nlattr *nest;
+
+    nest = enc_nest_start(e, type);
+    enc_put(e, NFTA_DATA_VALUE, len, data);
+    enc_nest_end(e, nest);
+}
+
+void enc_meta(struct nft_rule_enc *e, uint32_t key) {
+    struct nlattr *nest[2];
+
+    if (!enc_expr_start(e, "meta", 0, nest))
+        return;
+
+    enc_put_u32(e, NFTA_META_KEY, key);
+    enc_put_u32(e, NFTA_META_DREG, NFT_REG_1);
+    enc_expr_end(e, nest);
+}
+
+void enc_ct(struct nft_rule_enc *e, uint32_t key) {
+    struct nlattr *nest[2];
+
+    if (!enc_expr_start(e, "ct", 0, nest))
+        return;
+
+    enc_put_u32(e, NFTA_CT_KEY, key);
+    enc_put_u32(e, NFTA_CT_DREG, NFT_REG_1);
+    enc_expr_end(e, nest);
+}
+
+void enc_payload(struct nft_rule_enc *e, int offset, int len, uint32_t base) {
+    struct nlattr *nest[2];
+
+    if (!enc_expr_start(e, "payload", 0, nest))
+        return;
+
+    enc_put_u32(e, NFTA_PAYLOAD_DREG, NFT_REG_1);
+    enc_put_u32(e, NFTA_PAYLOAD_BASE, base);
+    enc_put_u32(e, NFTA_PAYLOAD_OFFSET, offset);
+    enc_put_u32(e, NFTA_PAYLOAD_LEN, len);
+    enc_expr_end(e, nest);
+}
+
+static void enc_bitwise(struct nft_rule_enc *e, const void *mask,
+                        const void *xor, size_t len) {
+    struct nlattr *nest[2];
+
+    if (!enc_expr_start(e, "bitwise", 2 * len, nest))
+        return;
+
+    enc_put_u32(e, NFTA_BITWISE_SREG, NFT_REG_1);
+    enc_put_u32(e, NFTA_BITWISE_DREG, NFT_REG_1);
+    enc_put_u32(e, NFTA_BITWISE_LEN, len);
+    enc_data(e, NFTA_BITWISE_MASK, mask, len);
+    enc_data(e, NFTA_BITWISE_XOR, xor, len);
+    enc_expr_end(e, nest);
+}
+
+void enc_cmp_ptr(struct nft_rule_enc *e, uint32_t op, const void *data,
+                 size_t len) {
+    struct nlattr *nest[2];
+
+    if (!enc_expr_start(e, "cmp", len, nest))
+        return;
+
+    enc_put_u32(e, NFTA_CMP_SREG, NFT_REG_1);
+    enc_put_u32(e, NFTA_CMP_OP, op);
+    enc_data(e, NFTA_CMP_DATA, data, len);
+    enc_expr_end(e, nest);
+}
+
+void enc_cmp_u16(struct nft_rule_enc *e, uint16_t val, uint32_t op) {
+    enc_cmp_ptr(e, op, &val, sizeof(val));
+}
+
+void enc_cmp_u32(struct nft_rule_enc *e, uint32_t val, uint32_t op) {
+    enc_cmp_ptr(e, op, &val, sizeof(val));
+}
+
+static void enc_iface(struct nft_rule_enc *e, uint32_t key, const char *iface,
+                      uint32_t op) {
+    int iface_len = strlen(iface);
+
+    enc_meta(e, key);
+    if (iface[iface_len - 1] == '+')
+        enc_cmp_ptr(e, op, iface, iface_len - 1);
+    else
+        enc_cmp_ptr(e, op, iface, iface_len + 1);
+}
+
+void enc_iniface(struct nft_rule_enc *e, const char *iface, uint32_t op) {
+    enc_iface(e, NFT_META_IIFNAME, iface, op);
+}
+
+void enc_outiface(struct nft_rule_enc *e, const char *iface, uint32_t op) {
+    enc_iface(e, NFT_META_OIFNAME, iface, op);
+}
+
+void enc_addr(struct nft_rule_enc *e, int offset, const void *data,
+              const void *mask, size_t len, uint32_t op) {
+    static const uint32_t xor[4];
+
+    enc_payload(e, offset, len, NFT_PAYLOAD_NETWORK_HEADER);
+    enc_bitwise(e, mask, xor, len);
+    enc_cmp_ptr(e, op, data, len);
+}
+
+void enc_addr_set(struct nft_rule_enc *e, int offset, size_t len,
+                  const struct xt_addr_set *set) {
+    struct nlattr *nest[2];
+    uint32_t id = htonl(set->id);
+
+    enc_payload(e, offset, len, NFT_PAYLOAD_NETWORK_HEADER);
+
+    if (!enc_expr_start(e, "lookup", sizeof(set->name), nest))
+        return;
+
+    enc_put_strz(e, NFTA_LOOKUP_SET, set->name);
+    enc_put_u32(e, NFTA_LOOKUP_SREG, NFT_REG_1);
+    if (set->id != 0)
+        enc_put(e, NFTA_LOOKUP_SET_ID, sizeof(id), &id);
+    enc_expr_end(e, nest);
+}
+
+void enc_proto(struct nft_rule_enc *e, int offset, size_t len, uint8_t proto,
+               uint32_t op) {
+    enc_payload(e, offset, len, NFT_PAYLOAD_NETWORK_HEADER);
+    enc_cmp_ptr(e, op, &proto, sizeof(proto));
+}
+
+void enc_frag(struct nft_rule_enc *e, uint32_t op) {
+    static const uint16_t xor;
+    uint16_t mask = htons(0x1fff);
+
+    enc_payload(e, offsetof(struct iphdr, frag_off), sizeof(uint16_t),
+                NFT_PAYLOAD_NETWORK_HEADER);
+    enc_bitwise(e, &mask, &xor, sizeof(mask));
+    enc_cmp_u16(e, 0, op);
+}
+
+static void enc_th_port(struct nft_rule_enc *e, int offset,
+                        const uint16_t *pts, bool inv) {
+    if (th_port_any(pts, inv))
+        return;
+
+    enc_payload(e, offset, sizeof(uint16_t), NFT_PAYLOAD_TRANSPORT_HEADER);
+    if (pts[0] == pts[1]) {
+        enc_cmp_u16(e, htons(pts[0]), inv ? NFT_CMP_NEQ : NFT_CMP_EQ);
+    } else {
+        enc_cmp_u16(e, htons(pts[0]), NFT_CMP_GTE);
+        enc_cmp_u16(e, htons(pts[1]), NFT_CMP_LTE);
+    }
+}
+
+bool enc_native_match(struct nft_rule_enc *e, const struct xt_entry_match *m,
+                      uint8_t l4proto) {
+    static const uint32_t xor;
+    struct xt_mark_mtinfo1 mark;
+    struct th_ports p;
+    uint32_t state;
+    bool inv;
+
+    if (th_ports_get(m, l4proto, &p)) {
+        enc_frag(e, NFT_CMP_EQ);
+        enc_th_port(e, 0, p.spts, p.sinv);
+        enc_th_port(e, 2, p.dpts, p.dinv);
+    } else if (mark_get(m, &mark)) {
+        enc_meta(e, NFT_META_MARK);
+        if (mark.mask != 0xffffffff)
+            enc_bitwise(e, &mark.mask, &xor, sizeof(mark.mask));
+        enc_cmp_u32(e, mark.mark, mark.invert ? NFT_CMP_NEQ : NFT_CMP_EQ);
+    } else if (ctstate_get(m, &state, &inv)) {
+        enc_ct(e, NFT_CT_STATE);
+        enc_bitwise(e, &state, &xor, sizeof(state));
+        enc_cmp_u32(e, 0, inv ? NFT_CMP_EQ : NFT_CMP_NEQ);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void enc_compat(struct nft_rule_enc *e, uint32_t proto, bool inv) {
+    e->compat = true;
+    e->compat_proto = proto;
+    e->compat_flags = inv ? NFT_RULE_COMPAT_F_INV : 0;
+}
+
+/*
+ * Rules staged from the command line carry "__set%d" until the kernel names
+ * the set, so they never match a rule using a set, as with two different
+ * address lists.
+ */
+bool is_same_addr_sets(const struct iptables_command_state *a,
+                       const struct iptables_command_state *b) {
+    return strcmp(a->src_set.name, b->src_set.name) == 0 &&
+           strcmp(a->dst_set.name, b->dst_set.name) == 0 &&
+           strchr(a->src_set.name, '%') == NULL &&
+           strchr(a->dst_set.name, '%') == NULL;
+}
+
 bool is_same_interfaces(const char *a_iniface, const char *a_outiface,
                         unsigned const char *a_iniface_mask,
                         unsigned const char *a_outiface_mask,
@@ -379,12 +825,23 @@ void nft_parse_meta(struct nft_xt_ctx *ctx, struct nftnl_expr *e) {
     ctx->reg = nftnl_expr_get_u32(e, NFTNL_EXPR_META_DREG);
     ctx->meta.key = nftnl_expr_get_u32(e, NFTNL_EXPR_META_KEY);
     ctx->flags |= NFT_XT_CTX_META;
+    ctx->flags &= ~NFT_XT_CTX_BITWISE;
+}
+
+void nft_parse_ct(struct nft_xt_ctx *ctx, struct nftnl_expr *e) {
+    ctx->reg = nftnl_expr_get_u32(e, NFTNL_EXPR_CT_DREG);
+    ctx->ct.key = nftnl_expr_get_u32(e, NFTNL_EXPR_CT_KEY);
+    ctx->flags |= NFT_XT_CTX_CT;
+    ctx->flags &= ~NFT_XT_CTX_BITWISE;
 }
 
 void nft_parse_payload(struct nft_xt_ctx *ctx, struct nftnl_expr *e) {
     ctx->reg = nftnl_expr_get_u32(e, NFTNL_EXPR_META_DREG);
+    ctx->payload.base = nftnl_expr_get_u32(e, NFTNL_EXPR_PAYLOAD_BASE);
     ctx->payload.offset = nftnl_expr_get_u32(e, NFTNL_EXPR_PAYLOAD_OFFSET);
     ctx->flags |= NFT_XT_CTX_PAYLOAD;
+    if (ctx->payload.base != NFT_PAYLOAD_TRANSPORT_HEADER)
+        ctx->flags &= ~NFT_XT_CTX_FRAG;
 }
 
 void nft_parse_bitwise(struct nft_xt_ctx *ctx, struct nftnl_expr *e) {
@@ -402,26 +859,237 @@ void nft_parse_bitwise(struct nft_xt_ctx *ctx, struct nftnl_expr *e) {
     ctx->flags |= NFT_XT_CTX_BITWISE;
 }
 
+/*
+ * Returns the @name match that native expressions are parsed into, see
+ * add_native_match(). Unless @fresh, the last match of the rule is reused
+ * if it is the one, ports of tcp and udp are spread over several cmps. The
+ * match is only added if it loads in one of the revisions from @min_rev to
+ * @max_rev, whose layouts the caller knows.
+ */
+static struct xt_entry_match *nft_native_match(struct nft_xt_ctx *ctx,
+                                               const char *name, bool fresh,
+                                               uint8_t min_rev,
+                                               uint8_t max_rev) {
+    struct iptables_command_state *cs = ctx->state.cs;
+    struct xtables_rule_match *rm = NULL, **tail, *new = NULL;
+    struct xtables_match *match;
+    struct xt_entry_match *m;
+    struct nft_family_ops *ops;
+    size_t size;
+
+    for (tail = &cs->matches; *tail != NULL; tail = &(*tail)->next)
+        rm = *tail;
+    if (!fresh && rm != NULL && strcmp(rm->match->name, name) == 0 &&
+        rm->match->m != NULL)
+        return rm->match->m;
+
+    match = xtables_find_match(name, XTF_TRY_LOAD, &new);
+    if (match == NULL)
+        return NULL;
+    if (match->revision < min_rev || match->revision > max_rev) {
+        xtables_rule_matches_free(&new);
+        return NULL;
+    }
+    *tail = new;
+
+    size = XT_ALIGN(sizeof(struct xt_entry_match)) + match->size;
+    m = calloc(1, size);
+    if (m == NULL) {
+        fprintf(stderr, "OOM");
+        exit(EXIT_FAILURE);
+    }
+
+    m->u.match_size = size;
+    m->u.user.revision = match->revision;
+    strcpy(m->u.user.name, match->name);
+    match->m = m;
+    if (match->init != NULL)
+        match->init(m);
+
+    ops = nft_family_ops_lookup(ctx->family);
+    if (ops->parse_match != NULL)
+        ops->parse_match(match, nft_get_data(ctx));
+
+    return m;
+}
+
+static void nft_parse_th_port(struct nft_xt_ctx *ctx, struct nftnl_expr *e) {
+    struct iptables_command_state *cs = ctx->state.cs;
+    struct xt_entry_match *m;
+    uint16_t *pts, port;
+    uint8_t *invflags, inv;
+    uint8_t proto;
+    uint32_t len;
+    bool fresh;
+
+    /* only IPv4 rules get ports, see th_ports_get() */
+    if (ctx->family != NFPROTO_IPV4 || (cs->fw.ip.invflags & XT_INV_PROTO))
+        return;
+    proto = cs->fw.ip.proto;
+
+    if (ctx->payload.offset != 0 && ctx->payload.offset != 2)
+        return;
+
+    /* the fragment check starts each match, the ports follow */
+    fresh = ctx->flags & NFT_XT_CTX_FRAG;
+
+    if (proto == IPPROTO_TCP) {
+        struct xt_tcp *tcp;
+
+        m = nft_native_match(ctx, "tcp", fresh, 0, 0);
+        if (m == NULL)
+            return;
+        tcp = (void *)m->data;
+        pts = ctx->payload.offset == 0 ? tcp->spts : tcp->dpts;
+        invflags = &tcp->invflags;
+        inv = ctx->payload.offset == 0 ? XT_TCP_INV_SRCPT : XT_TCP_INV_DSTPT;
+    } else if (proto == IPPROTO_UDP) {
+        struct xt_udp *udp;
+
+        m = nft_native_match(ctx, "udp", fresh, 0, 0);
+        if (m == NULL)
+            return;
+        udp = (void *)m->data;
+        pts = ctx->payload.offset == 0 ? udp->spts : udp->dpts;
+        invflags = &udp->invflags;
+        inv = ctx->payload.offset == 0 ? XT_UDP_INV_SRCPT : XT_UDP_INV_DSTPT;
+    } else {
+        return;
+    }
+
+    /* the fragment check right before belongs to the ports, not to -f */
+    if (ctx->flags & NFT_XT_CTX_FRAG) {
+        cs->fw.ip.flags = (cs->fw.ip.flags & ~IPT_F_FRAG) | ctx->frag.flags;
+        cs->fw.ip.invflags =
+            (cs->fw.ip.invflags & ~IPT_INV_FRAG) | ctx->frag.invflags;
+        ctx->flags &= ~NFT_XT_CTX_FRAG;
+    }
+
+    memcpy(&port, nftnl_expr_get(e, NFTNL_EXPR_CMP_DATA, &len), sizeof(port));
+    port = ntohs(port);
+
+    switch (nftnl_expr_get_u32(e, NFTNL_EXPR_CMP_OP)) {
+    case NFT_CMP_NEQ:
+        *invflags |= inv;
+        /* fall through */
+    case NFT_CMP_EQ:
+        pts[0] = pts[1] = port;
+        break;
+    case NFT_CMP_GTE:
+        pts[0] = port;
+        break;
+    case NFT_CMP_LTE:
+        pts[1] = port;
+        break;
+    }
+}
+
+static void nft_parse_mark(struct nft_xt_ctx *ctx, struct nftnl_expr *e) {
+    struct xt_mark_mtinfo1 *info;
+    struct xt_entry_match *m;
+    uint32_t mask = 0xffffffff;
+    uint32_t mark;
+    bool inv;
+
+    if (ctx->flags & NFT_XT_CTX_BITWISE) {
+        mask = ctx->bitwise.mask[0];
+        ctx->flags &= ~NFT_XT_CTX_BITWISE;
+    }
+    get_cmp_data(e, &mark, sizeof(mark), &inv);
+
+    m = nft_native_match(ctx, "mark", true, 1, 1);
+    if (m == NULL)
+        return;
+
+    info = (void *)m->data;
+    info->mark = mark;
+    info->mask = mask;
+    info->invert = inv;
+}
+
+static void nft_parse_ctstate(struct nft_xt_ctx *ctx, struct nftnl_expr *e) {
+    struct xt_conntrack_mtinfo1 *info1;
+    struct xt_conntrack_mtinfo2 *info2;
+    struct xt_entry_match *m;
+    uint32_t state;
+    bool inv;
+
+    if (!(ctx->flags & NFT_XT_CTX_BITWISE))
+        return;
+    ctx->flags &= ~NFT_XT_CTX_BITWISE;
+
+    get_cmp_data(e, &state, sizeof(state), &inv);
+    if (state != 0)
+        return;
+
+    m = nft_native_match(ctx, "conntrack", true, 1, 3);
+    if (m == NULL)
+        return;
+
+    /* see ctstate_get() */
+    info1 = (void *)m->data;
+    info2 = (void *)m->data;
+    if (m->u.user.revision == 1)
+        info1->state_mask = ctx->bitwise.mask[0];
+    else
+        info2->state_mask = ctx->bitwise.mask[0];
+    info1->match_flags = XT_CONNTRACK_STATE;
+    /* the cmp tests for no state bits, so a match is a NEQ */
+    if (!inv)
+        info1->invert_flags = XT_CONNTRACK_STATE;
+}
+
 void nft_parse_cmp(struct nft_xt_ctx *ctx, struct nftnl_expr *e) {
     struct nft_family_ops *ops = nft_family_ops_lookup(ctx->family);
     void *data = nft_get_data(ctx);
+    bool native;
     uint32_t reg;
 
     reg = nftnl_expr_get_u32(e, NFTNL_EXPR_CMP_SREG);
     if (ctx->reg && reg != ctx->reg)
         return;
 
+    native = ctx->family == NFPROTO_IPV4 || ctx->family == NFPROTO_IPV6;
     if (ctx->flags & NFT_XT_CTX_META) {
-        ops->parse_meta(ctx, e, data);
+        if (native && ctx->meta.key == NFT_META_MARK)
+            nft_parse_mark(ctx, e);
+        else
+            ops->parse_meta(ctx, e, data);
         ctx->flags &= ~NFT_XT_CTX_META;
     }
+    if (ctx->flags & NFT_XT_CTX_CT) {
+        if (native && ctx->ct.key == NFT_CT_STATE)
+            nft_parse_ctstate(ctx, e);
+        ctx->flags &= ~NFT_XT_CTX_CT;
+    }
     /* bitwise context is interpreted from payload */
-    if (ctx->flags & NFT_XT_CTX_PAYLOAD) {
+    if (ctx->flags & NFT_XT_CTX_PAYLOAD &&
+        ctx->payload.base == NFT_PAYLOAD_TRANSPORT_HEADER) {
+        nft_parse_th_port(ctx, e);
+        /* a port range is a GTE and a LTE on the same payload */
+        if (nftnl_expr_get_u32(e, NFTNL_EXPR_CMP_OP) != NFT_CMP_GTE)
+            ctx->flags &= ~NFT_XT_CTX_PAYLOAD;
+    } else if (ctx->flags & NFT_XT_CTX_PAYLOAD) {
         ops->parse_payload(ctx, e, data);
         ctx->flags &= ~NFT_XT_CTX_PAYLOAD;
     }
 }
 
+void nft_parse_lookup(struct nft_xt_ctx *ctx, struct nftnl_expr *e) {
+    struct nft_family_ops *ops = nft_family_ops_lookup(ctx->family);
+    const char *set = nftnl_expr_get_str(e, NFTNL_EXPR_LOOKUP_SET);
+    uint32_t reg;
+
+    reg = nftnl_expr_get_u32(e, NFTNL_EXPR_LOOKUP_SREG);
+    if (ctx->reg && reg != ctx->reg)
+        return;
+
+    if ((ctx->flags & NFT_XT_CTX_PAYLOAD) && ops->parse_lookup) {
+        ops->parse_lookup(ctx, set, nft_get_data(ctx));
+        ctx->flags &= ~NFT_XT_CTX_PAYLOAD;
+    }
+}
+
 void nft_parse_counter(struct nftnl_expr *e, struct xt_counters *counters) {
     counters->pcnt = nftnl_expr_get_u64(e, NFTNL_EXPR_CTR_PACKETS);
     counters->bcnt = nftnl_expr_get_u64(e, NFTNL_EXPR_CTR_BYTES);
@@ -476,16 +1144,24 @@ void nft_rule_to_iptables_command_state(struct nftnl_rule *r,
     while (expr != NULL) {
         const char *name = nftnl_expr_get_str(expr, NFTNL_EXPR_NAME);
 
+        /* see nft_parse_th_port() */
+        if (strcmp(name, "payload") != 0 && strcmp(name, "cmp") != 0)
+            ctx.flags &= ~NFT_XT_CTX_FRAG;
+
         if (strcmp(name, "counter") == 0)
             nft_parse_counter(expr, &ctx.state.cs->counters);
         else if (strcmp(name, "payload") == 0)
             nft_parse_payload(&ctx, expr);
         else if (strcmp(name, "meta") == 0)
             nft_parse_meta(&ctx, expr);
+        else if (strcmp(name, "ct") == 0)
+            nft_parse_ct(&ctx, expr);
         else if (strcmp(name, "bitwise") == 0)
             nft_parse_bitwise(&ctx, expr);
         else if (strcmp(name, "cmp") == 0)
             nft_parse_cmp(&ctx, expr);
+        else if (strcmp(name, "lookup") == 0)
+            nft_parse_lookup(&ctx, expr);
         else if (strcmp(name, "immediate") == 0)
             nft_parse_immediate(&ctx, expr);
         else if (strcmp(name, "match") == 0)
@@ -660,6 +1336,14 @@ static void print_iface(char letter, const char *iface,
     printf(" ");
 }
 
+/* The list is filled in by nft_rule_save(), the set name is a last resort */
+void save_addr_set(char letter, const struct xt_addr_set *set) {
+    if (set->list != NULL)
+        printf("-%c %s ", letter, set->list);
+    else
+        printf("-%c @%s ", letter, set->name);
+}
+
 void save_firewall_details(const struct iptables_command_state *cs,
                            uint8_t invflags, uint16_t proto,
                            const char *iniface,
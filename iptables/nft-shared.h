@@ -31,6 +31,7 @@
 #define FMT_VIA		0x0040
 #define FMT_NONEWLINE	0x0080
 #define FMT_LINENUMBERS 0x0100
+#define FMT_HANDLES	0x0200
 
 #define FMT_PRINT_RULE (FMT_NOCOUNTS | FMT_OPTIONS | FMT_VIA \
 			| FMT_NUMERIC | FMT_NOTABLE)
@@ -38,11 +39,15 @@
 
 struct xtables_args;
 struct xt_xlate;
+struct nft_rule_enc;
+struct nlattr;
 
 enum {
 	NFT_XT_CTX_PAYLOAD	= (1 << 0),
 	NFT_XT_CTX_META		= (1 << 1),
 	NFT_XT_CTX_BITWISE	= (1 << 2),
+	NFT_XT_CTX_FRAG		= (1 << 3),
+	NFT_XT_CTX_CT		= (1 << 4),
 };
 
 struct nft_xt_ctx {
@@ -57,20 +62,29 @@ struct nft_xt_ctx {
 
 	uint32_t reg;
 	struct {
+		uint32_t base;
 		uint32_t offset;
 		uint32_t len;
 	} payload;
 	struct {
 		uint32_t key;
 	} meta;
+	struct {
+		uint32_t key;
+	} ct;
 	struct {
 		uint32_t mask[4];
 		uint32_t xor[4];
 	} bitwise;
+	struct {
+		uint8_t flags;
+		uint8_t invflags;
+	} frag;		/* -f before the last fragment check */
 };
 
 struct nft_family_ops {
 	int (*add)(struct nftnl_rule *r, void *data);
+	int (*encode)(struct nft_rule_enc *e, void *data); /* optional */
 	bool (*is_same)(const void *data_a,
 			const void *data_b);
 	void (*print_payload)(struct nftnl_expr *e,
@@ -83,6 +97,8 @@ struct nft_family_ops {
 			      void *data);
 	void (*parse_cmp)(struct nft_xt_ctx *ctx, struct nftnl_expr *e,
 			  void *data);
+	void (*parse_lookup)(struct nft_xt_ctx *ctx, const char *set,
+			     void *data); /* optional */
 	void (*parse_immediate)(const char *jumpto, bool nft_goto, void *data);
 
 	void (*print_table_header)(const char *tablename);
@@ -106,6 +122,7 @@ struct nft_family_ops {
 };
 
 void add_meta(struct nftnl_rule *r, uint32_t key);
+void add_ct(struct nftnl_rule *r, uint32_t key);
 void add_payload(struct nftnl_rule *r, int offset, int len, uint32_t base);
 void add_bitwise_u16(struct nftnl_rule *r, int mask, int xor);
 void add_cmp_ptr(struct nftnl_rule *r, uint32_t op, void *data, size_t len);
@@ -116,10 +133,61 @@ void add_iniface(struct nftnl_rule *r, char *iface, uint32_t op);
 void add_outiface(struct nftnl_rule *r, char *iface, uint32_t op);
 void add_addr(struct nftnl_rule *r, int offset,
 	      void *data, void *mask, size_t len, uint32_t op);
+void add_addr_set(struct nftnl_rule *r, int offset, size_t len,
+		  const struct xt_addr_set *set);
+void add_frag(struct nftnl_rule *r, uint32_t op);
+bool add_native_match(struct nftnl_rule *r, const struct xt_entry_match *m,
+		      uint8_t l4proto);
 void add_proto(struct nftnl_rule *r, int offset, size_t len,
 	       uint8_t proto, uint32_t op);
 void add_compat(struct nftnl_rule *r, uint32_t proto, bool inv);
 
+/*
+ * Direct rule encoder: appends the netlink attributes of the expressions
+ * to a scratch message instead of building a nftnl_rule, see
+ * nft_rule_encode().
+ */
+struct nft_rule_enc {
+	struct nlmsghdr	*nlh;
+	size_t		size;		/* of the buffer nlh points to */
+	const char	*comment;	/* user data, set by the family */
+	bool		compat;
+	uint32_t	compat_proto;
+	uint32_t	compat_flags;
+	bool		error;		/* out of room, use nft_rule_new() */
+};
+
+void enc_put(struct nft_rule_enc *e, uint16_t type, size_t len,
+	     const void *data);
+void enc_put_u32(struct nft_rule_enc *e, uint16_t type, uint32_t data);
+void enc_put_strz(struct nft_rule_enc *e, uint16_t type, const char *data);
+struct nlattr *enc_nest_start(struct nft_rule_enc *e, uint16_t type);
+void enc_nest_end(struct nft_rule_enc *e, struct nlattr *nest);
+bool enc_expr_start(struct nft_rule_enc *e, const char *name, size_t len,
+		    struct nlattr *nest[2]);
+void enc_expr_end(struct nft_rule_enc *e, struct nlattr *nest[2]);
+void enc_meta(struct nft_rule_enc *e, uint32_t key);
+void enc_ct(struct nft_rule_enc *e, uint32_t key);
+void enc_payload(struct nft_rule_enc *e, int offset, int len, uint32_t base);
+void enc_cmp_ptr(struct nft_rule_enc *e, uint32_t op, const void *data,
+		 size_t len);
+void enc_cmp_u16(struct nft_rule_enc *e, uint16_t val, uint32_t op);
+void enc_cmp_u32(struct nft_rule_enc *e, uint32_t val, uint32_t op);
+void enc_iniface(struct nft_rule_enc *e, const char *iface, uint32_t op);
+void enc_outiface(struct nft_rule_enc *e, const char *iface, uint32_t op);
+void enc_addr(struct nft_rule_enc *e, int offset, const void *data,
+	      const void *mask, size_t len, uint32_t op);
+void enc_addr_set(struct nft_rule_enc *e, int offset, size_t len,
+		  const struct xt_addr_set *set);
+void enc_proto(struct nft_rule_enc *e, int offset, size_t len,
+	       uint8_t proto, uint32_t op);
+void enc_compat(struct nft_rule_enc *e, uint32_t proto, bool inv);
+void enc_frag(struct nft_rule_enc *e, uint32_t op);
+bool enc_native_match(struct nft_rule_enc *e, const struct xt_entry_match *m,
+		      uint8_t l4proto);
+
+bool is_same_addr_sets(const struct iptables_command_state *a,
+		       const struct iptables_command_state *b);
 bool is_same_interfaces(const char *a_iniface, const char *a_outiface,
 			unsigned const char *a_iniface_mask,
 			unsigned const char *a_outiface_mask,
@@ -134,9 +202,11 @@ void print_proto(uint16_t proto, int invert);
 void get_cmp_data(struct nftnl_expr *e, void *data, size_t dlen, bool *inv);
 void nft_parse_bitwise(struct nft_xt_ctx *ctx, struct nftnl_expr *e);
 void nft_parse_cmp(struct nft_xt_ctx *ctx, struct nftnl_expr *e);
+void nft_parse_lookup(struct nft_xt_ctx *ctx, struct nftnl_expr *e);
 void nft_parse_match(struct nft_xt_ctx *ctx, struct nftnl_expr *e);
 void nft_parse_target(struct nft_xt_ctx *ctx, struct nftnl_expr *e);
 void nft_parse_meta(struct nft_xt_ctx *ctx, struct nftnl_expr *e);
+void nft_parse_ct(struct nft_xt_ctx *ctx, struct nftnl_expr *e);
 void nft_parse_payload(struct nft_xt_ctx *ctx, struct nftnl_expr *e);
 void nft_parse_counter(struct nftnl_expr *e, struct xt_counters *counters);
 void nft_parse_immediate(struct nft_xt_ctx *ctx, struct nftnl_expr *e);
@@ -159,6 +229,7 @@ void save_firewall_details(const struct iptables_command_state *cs,
 			   unsigned const char *iniface_mask,
 			   const char *outiface,
 			   unsigned const char *outiface_mask);
+void save_addr_set(char letter, const struct xt_addr_set *set);
 void save_counters(uint64_t pcnt, uint64_t bcnt);
 void save_matches_and_target(struct xtables_rule_match *m,
 			     struct xtables_target *target,
@@ -222,6 +293,8 @@ struct xtables_args {
 struct nft_xt_cmd_parse {
 	unsigned int			command;
 	unsigned int			rulenum;
+	uint64_t			handle;
+	bool				show_handles;
 	char				*table;
 	char				*chain;
 	char				*newname;
@@ -233,6 +306,12 @@ struct nft_xt_cmd_parse {
 void do_parse(struct nft_handle *h, int argc, char *argv[],
 	      struct nft_xt_cmd_parse *p, struct iptables_command_state *cs,
 	      struct xtables_args *args);
+int do_commandx_state(struct nft_handle *h, int argc, char *argv[],
+		      char **table, bool restore,
+		      struct iptables_command_state *cs,
+		      struct xtables_args *args);
+void do_commandx_free(struct nft_handle *h, struct iptables_command_state *cs,
+		      struct xtables_args *args);
 
 struct nft_xt_restore_parse {
 	FILE		*in;
@@ -268,5 +347,7 @@ void xtables_restore_parse(struct nft_handle *h,
 			   struct nft_xt_restore_parse *p,
 			   struct nft_xt_restore_cb *cb,
 			   int argc, char *argv[]);
+char **xtables_restore_split(const char *prog, char *buffer, int *argc);
+void xtables_restore_split_free(void);
 
 #endif
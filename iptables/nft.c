@@ -13,6 +13,7 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <netdb.h> /* getprotobynumber */
+#include <poll.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <sys/socket.h>
@@ -30,6 +31,7 @@
 #include <linux/netfilter/x_tables.h>
 #include <linux/netfilter_ipv4/ip_tables.h>
 #include <linux/netfilter_ipv6/ip6_tables.h>
+#include <netinet/ip.h>
 #include <netinet/ip6.h>
 
 #include <linux/netfilter/nf_tables.h>
@@ -178,46 +180,116 @@ static ssize_t mnl_nft_socket_sendmsg(const struct mnl_socket *nl) {
     return ret;
 }
 
-static int mnl_nftnl_batch_talk(struct nft_handle *h) {
-    int ret, fd = mnl_socket_get_fd(h->nl);
+struct batch_ack {
+    uint32_t barrier_seq;
+    bool barrier_done;
+    int err;          /* first error reported for the batch */
+    uint32_t err_seq; /* sequence number of the message that failed */
+};
+
+static int mnl_nftnl_batch_recv(struct nft_handle *h, struct batch_ack *ack) {
     char rcv_buf[MNL_SOCKET_BUFFER_SIZE];
-    fd_set readfds;
-    struct timeval tv = {.tv_sec = 0, .tv_usec = 0};
-    int err = 0;
+    const struct nlmsghdr *nlh;
+    int len;
 
-    ret = mnl_nft_socket_sendmsg(h->nl);
-    if (ret == -1)
-        return -1;
+    len = mnl_socket_recvfrom(h->nl, rcv_buf, sizeof(rcv_buf));
+    if (len == -1) {
+        /* replies were dropped, the batch failed anyway */
+        if (errno != ENOBUFS)
+            return -1;
+        if (!ack->err)
+            ack->err = ENOBUFS;
+        return 0;
+    }
 
-    FD_ZERO(&readfds);
-    FD_SET(fd, &readfds);
+    for (nlh = (const struct nlmsghdr *)rcv_buf; mnl_nlmsg_ok(nlh, len);
+         nlh = mnl_nlmsg_next(nlh, &len)) {
+        const struct nlmsgerr *e;
 
-    /* receive and digest all the acknowledgments from the kernel. */
-    ret = select(fd + 1, &readfds, NULL, NULL, &tv);
-    if (ret == -1)
-        return -1;
+        if (nlh->nlmsg_type != NLMSG_ERROR)
+            continue;
 
-    while (ret > 0 && FD_ISSET(fd, &readfds)) {
-        ret = mnl_socket_recvfrom(h->nl, rcv_buf, sizeof(rcv_buf));
-        if (ret == -1)
-            return -1;
+        if (nlh->nlmsg_seq == ack->barrier_seq) {
+            ack->barrier_done = true;
+            continue;
+        }
 
-        ret = mnl_cb_run(rcv_buf, ret, 0, h->portid, NULL, NULL);
         /* Annotate first error and continue, make sure we get all
          * acknoledgments.
          */
-        if (!err && ret == -1)
-            err = errno;
+        e = mnl_nlmsg_get_payload(nlh);
+        if (e->error && !ack->err) {
+            ack->err = -e->error;
+            ack->err_seq = nlh->nlmsg_seq;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Any request sent after the batch is answered after the batch, so the
+ * acknowledgment of a NFT_MSG_GETGEN tells that all replies to the batch
+ * have been received. Kernels without it report an error, which does too.
+ */
+static int mnl_nftnl_batch_barrier(struct nft_handle *h, uint32_t seq) {
+    char buf[MNL_SOCKET_BUFFER_SIZE];
+    struct nlmsghdr *nlh;
+    struct nfgenmsg *nfg;
+
+    nlh = mnl_nlmsg_put_header(buf);
+    nlh->nlmsg_type = (NFNL_SUBSYS_NFTABLES << 8) | NFT_MSG_GETGEN;
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    nlh->nlmsg_seq = seq;
+
+    nfg = mnl_nlmsg_put_extra_header(nlh, sizeof(*nfg));
+    nfg->nfgen_family = AF_UNSPEC;
+    nfg->version = NFNETLINK_V0;
+    nfg->res_id = 0;
+
+    return mnl_socket_sendto(h->nl, nlh, nlh->nlmsg_len) < 0 ? -1 : 0;
+}
 
-        ret = select(fd + 1, &readfds, NULL, NULL, &tv);
-        if (ret == -1)
+static int mnl_nftnl_batch_talk(struct nft_handle *h, uint32_t seq,
+                                uint32_t *err_seq) {
+    struct pollfd pfd = {
+        .fd = mnl_socket_get_fd(h->nl),
+        .events = POLLIN,
+    };
+    struct batch_ack ack = {
+        .barrier_seq = seq,
+    };
+    int ret;
+
+    ret = mnl_nft_socket_sendmsg(h->nl);
+    if (ret == -1)
+        return -1;
+
+    /* drain what is queued already so the barrier reply is not dropped */
+    while ((ret = poll(&pfd, 1, 0)) > 0) {
+        if (mnl_nftnl_batch_recv(h, &ack) < 0)
             return -1;
+    }
+    if (ret == -1)
+        return -1;
+
+    if (mnl_nftnl_batch_barrier(h, seq) < 0)
+        return -1;
 
-        FD_ZERO(&readfds);
-        FD_SET(fd, &readfds);
+    /* receive and digest all the acknowledgments from the kernel. */
+    while (!ack.barrier_done) {
+        ret = poll(&pfd, 1, -1);
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (mnl_nftnl_batch_recv(h, &ack) < 0)
+            return -1;
     }
-    errno = err;
-    return err ? -1 : 0;
+
+    *err_seq = ack.err_seq;
+    errno = ack.err;
+    return ack.err ? -1 : 0;
 }
 
 static void mnl_nftnl_batch_begin(struct mnl_nlmsg_batch *batch, uint32_t seq) {
@@ -244,6 +316,8 @@ enum obj_update_type {
     NFT_COMPAT_RULE_REPLACE,
     NFT_COMPAT_RULE_DELETE,
     NFT_COMPAT_RULE_FLUSH,
+    NFT_COMPAT_SET_ADD,
+    NFT_COMPAT_SET_ELEM_ADD,
 };
 
 enum obj_action {
@@ -254,6 +328,8 @@ enum obj_action {
 struct obj_update {
     struct list_head head;
     enum obj_update_type type;
+    uint32_t line; /* input line that staged it, see nft_handle */
+    uint32_t len;  /* if set, ptr holds message attributes, see batch_nla_add */
     union {
         struct nftnl_table *table;
         struct nftnl_chain *chain;
@@ -262,16 +338,70 @@ struct obj_update {
     };
 };
 
+/*
+ * Staged objects and encoded rules are carved out of blocks that live as
+ * long as the transaction, nft_action() releases them all at once.
+ */
+#define OBJ_BLOCK_SIZE (64 * 1024)
+
+struct obj_block {
+    struct list_head head;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+static void *obj_arena_alloc(struct nft_handle *h, size_t size) {
+    struct obj_block *b = NULL;
+    void *ptr;
+
+    size = (size + 7) & ~7;
+
+    if (!list_empty(&h->obj_blocks))
+        b = list_entry(h->obj_blocks.prev, struct obj_block, head);
+
+    if (b == NULL || b->used + size > b->size) {
+        size_t bsize = size > OBJ_BLOCK_SIZE ? size : OBJ_BLOCK_SIZE;
+
+        b = malloc(sizeof(*b) + bsize);
+        if (b == NULL)
+            return NULL;
+        b->used = 0;
+        b->size = bsize;
+        list_add_tail(&b->head, &h->obj_blocks);
+    }
+
+    ptr = b->data + b->used;
+    b->used += size;
+    return ptr;
+}
+
+/* Unless @all is set, the first block is kept for the next transaction */
+static void obj_arena_release(struct nft_handle *h, bool all) {
+    struct obj_block *b, *tmp;
+
+    list_for_each_entry_safe(b, tmp, &h->obj_blocks, head) {
+        if (!all && b->head.prev == &h->obj_blocks) {
+            b->used = 0;
+            continue;
+        }
+        list_del(&b->head);
+        free(b);
+    }
+}
+
 static int batch_add(struct nft_handle *h, enum obj_update_type type,
                      void *ptr) {
     struct obj_update *obj;
 
-    obj = calloc(1, sizeof(struct obj_update));
+    obj = obj_arena_alloc(h, sizeof(*obj));
     if (obj == NULL)
         return -1;
 
     obj->ptr = ptr;
+    obj->len = 0;
     obj->type = type;
+    obj->line = h->line;
     list_add_tail(&obj->head, &h->obj_list);
     h->obj_list_num++;
 
@@ -293,6 +423,18 @@ static int batch_rule_add(struct nft_handle *h, enum obj_update_type type,
     return batch_add(h, type, r);
 }
 
+static int batch_nla_add(struct nft_handle *h, enum obj_update_type type,
+                         void *nla, uint32_t len) {
+    struct obj_update *obj;
+
+    if (batch_add(h, type, nla) < 0)
+        return -1;
+
+    obj = list_entry(h->obj_list.prev, struct obj_update, head);
+    obj->len = len;
+    return 0;
+}
+
 struct builtin_table xtables_ipv4[TABLES_MAX] = {
         [RAW] =
             {
@@ -566,6 +708,14 @@ static int nft_table_builtin_add(struct nft_handle *h,
     return ret;
 }
 
+/* The table add that was staged is gone, stage it again on the next use */
+static void nft_table_builtin_reset(struct nft_handle *h) {
+    int i;
+
+    for (i = 0; i < TABLES_MAX; i++)
+        h->tables[i].initialized = false;
+}
+
 static struct nftnl_chain *nft_chain_builtin_alloc(struct builtin_table *table,
                                                    struct builtin_chain *chain,
                                                    int policy) {
@@ -673,7 +823,7 @@ static void nft_chain_builtin_init(struct nft_handle *h,
         nft_chain_builtin_add(h, table, &table->chains[i]);
     }
 
-    nftnl_chain_list_free(list);
+    nft_chain_list_free(list);
 }
 
 static int nft_xt_builtin_init(struct nft_handle *h, const char *table) {
@@ -754,6 +904,7 @@ int nft_init(struct nft_handle *h, struct builtin_table *t) {
     h->tables = t;
 
     INIT_LIST_HEAD(&h->obj_list);
+    INIT_LIST_HEAD(&h->obj_blocks);
 
     h->batch = mnl_nftnl_batch_alloc();
     h->batch_support = mnl_batch_supported(h);
@@ -761,16 +912,333 @@ int nft_init(struct nft_handle *h, struct builtin_table *t) {
     return 0;
 }
 
-static void flush_rule_cache(struct nft_handle *h) {
+/*
+ * The rule cache keeps the rules of the last dump per table and per chain,
+ * each chain holding its rules in order, so that chain-scoped operations
+ * only walk the rules of that chain and rule numbers index it directly.
+ */
+struct nft_cache_chain {
+    struct list_head head;
+    char *name;
+    struct nftnl_rule **rules;
+    /*
+     * nft_rule_fp() of each rule, to skip decoding rules that cannot match.
+     * Only taken once a rule is looked up in the chain, see nft_rule_find().
+     */
+    uint32_t *fps;
+    unsigned int num_rules;
+    unsigned int rules_sz;
+};
+
+struct nft_cache_table {
+    struct list_head head;
+    char *name;
+    struct list_head chains;
+};
+
+struct nft_rule_cache {
+    struct list_head tables;
+    /* holds every rule of the family, not only the chains asked for */
+    bool complete;
+    /* dumps come grouped by chain, remember where the last rule went */
+    struct nft_cache_table *last_table;
+    struct nft_cache_chain *last_chain;
+};
+
+static struct nft_cache_table *nft_cache_table_find(struct nft_rule_cache *rc,
+                                                    const char *table) {
+    struct nft_cache_table *t;
+
+    list_for_each_entry(t, &rc->tables, head) {
+        if (strcmp(t->name, table) == 0)
+            return t;
+    }
+    return NULL;
+}
+
+static struct nft_cache_chain *nft_cache_chain_find(struct nft_cache_table *t,
+                                                    const char *chain) {
+    struct nft_cache_chain *c;
+
+    list_for_each_entry(c, &t->chains, head) {
+        if (strcmp(c->name, chain) == 0)
+            return c;
+    }
+    return NULL;
+}
+
+/* Returns NULL if the chain holds no rules */
+static struct nft_cache_chain *nft_rule_cache_chain(struct nft_rule_cache *rc,
+                                                    const char *table,
+                                                    const char *chain) {
+    struct nft_cache_table *t;
+
+    t = nft_cache_table_find(rc, table);
+    if (t == NULL)
+        return NULL;
+
+    return nft_cache_chain_find(t, chain);
+}
+
+static struct nft_cache_chain *
+nft_rule_cache_chain_add(struct nft_rule_cache *rc, const char *table,
+                         const char *chain) {
+    struct nft_cache_table *t = rc->last_table;
+    struct nft_cache_chain *c = rc->last_chain;
+
+    if (t == NULL || strcmp(t->name, table) != 0) {
+        t = nft_cache_table_find(rc, table);
+        if (t == NULL) {
+            t = calloc(1, sizeof(*t));
+            if (t == NULL)
+                return NULL;
+            t->name = strdup(table);
+            if (t->name == NULL) {
+                free(t);
+                return NULL;
+            }
+            INIT_LIST_HEAD(&t->chains);
+            list_add_tail(&t->head, &rc->tables);
+        }
+        c = NULL;
+    }
+
+    if (c == NULL || strcmp(c->name, chain) != 0) {
+        c = nft_cache_chain_find(t, chain);
+        if (c == NULL) {
+            c = calloc(1, sizeof(*c));
+            if (c == NULL)
+                return NULL;
+            c->name = strdup(chain);
+            if (c->name == NULL) {
+                free(c);
+                return NULL;
+            }
+            list_add_tail(&c->head, &t->chains);
+        }
+    }
+
+    rc->last_table = t;
+    rc->last_chain = c;
+    return c;
+}
+
+static uint32_t fp_mix(uint32_t fp, const void *data, uint32_t len) {
+    const unsigned char *p = data;
+
+    while (len--)
+        fp = fp * 33 + *p++;
+    return fp;
+}
+
+static uint32_t fp_mix_attr(uint32_t fp, const struct nftnl_expr *e,
+                            uint16_t type) {
+    const void *data;
+    uint32_t len;
+
+    if (!nftnl_expr_is_set(e, type))
+        return fp;
+
+    data = nftnl_expr_get(e, type, &len);
+    return fp_mix(fp, data, len);
+}
+
+static uint32_t fp_mix_str(uint32_t fp, const struct nftnl_expr *e,
+                           uint16_t type) {
+    const char *str;
+
+    if (!nftnl_expr_is_set(e, type))
+        return fp;
+
+    str = nftnl_expr_get_str(e, type);
+    return fp_mix(fp, str, strlen(str) + 1);
+}
+
+/*
+ * Fingerprint of the parts of a rule that are the same whether the rule
+ * comes from a dump or is built from the command line: expression types,
+ * what they load and the data they compare against. Counter values, set
+ * names, match and target payloads and the comment are left out, since
+ * ops->rule_find() ignores them or compares them more loosely. Rules with
+ * different fingerprints never match, equal ones still go through
+ * ops->rule_find().
+ */
+static uint32_t nft_rule_fp(const struct nftnl_rule *r) {
+    struct nftnl_expr_iter *iter;
+    struct nftnl_expr *e;
+    uint32_t fp = 5381;
+    const char *name;
+
+    iter = nftnl_expr_iter_create(r);
+    if (iter == NULL)
+        return 0;
+
+    e = nftnl_expr_iter_next(iter);
+    while (e != NULL) {
+        name = nftnl_expr_get_str(e, NFTNL_EXPR_NAME);
+        fp = fp_mix(fp, name, strlen(name) + 1);
+
+        if (strcmp(name, "meta") == 0) {
+            fp = fp_mix_attr(fp, e, NFTNL_EXPR_META_KEY);
+        } else if (strcmp(name, "payload") == 0) {
+            fp = fp_mix_attr(fp, e, NFTNL_EXPR_PAYLOAD_BASE);
+            fp = fp_mix_attr(fp, e, NFTNL_EXPR_PAYLOAD_OFFSET);
+            fp = fp_mix_attr(fp, e, NFTNL_EXPR_PAYLOAD_LEN);
+        } else if (strcmp(name, "cmp") == 0) {
+            fp = fp_mix_attr(fp, e, NFTNL_EXPR_CMP_OP);
+            fp = fp_mix_attr(fp, e, NFTNL_EXPR_CMP_DATA);
+        } else if (strcmp(name, "bitwise") == 0) {
+            fp = fp_mix_attr(fp, e, NFTNL_EXPR_BITWISE_MASK);
+            fp = fp_mix_attr(fp, e, NFTNL_EXPR_BITWISE_XOR);
+        } else if (strcmp(name, "match") == 0) {
+            fp = fp_mix_str(fp, e, NFTNL_EXPR_MT_NAME);
+            fp = fp_mix_attr(fp, e, NFTNL_EXPR_MT_REV);
+        } else if (strcmp(name, "target") == 0) {
+            fp = fp_mix_str(fp, e, NFTNL_EXPR_TG_NAME);
+            fp = fp_mix_attr(fp, e, NFTNL_EXPR_TG_REV);
+        } else if (strcmp(name, "immediate") == 0) {
+            fp = fp_mix_attr(fp, e, NFTNL_EXPR_IMM_VERDICT);
+            fp = fp_mix_str(fp, e, NFTNL_EXPR_IMM_CHAIN);
+        }
+
+        e = nftnl_expr_iter_next(iter);
+    }
+    nftnl_expr_iter_destroy(iter);
+
+    return fp;
+}
+
+static int nft_rule_cache_add(struct nft_rule_cache *rc, struct nftnl_rule *r) {
+    struct nft_cache_chain *c;
+
+    c = nft_rule_cache_chain_add(rc, nftnl_rule_get_str(r, NFTNL_RULE_TABLE),
+                                 nftnl_rule_get_str(r, NFTNL_RULE_CHAIN));
+    if (c == NULL)
+        return -1;
+
+    if (c->num_rules == c->rules_sz) {
+        unsigned int sz = c->rules_sz ? c->rules_sz * 2 : 16;
+        struct nftnl_rule **rules;
+
+        rules = realloc(c->rules, sz * sizeof(*rules));
+        if (rules == NULL)
+            return -1;
+        c->rules = rules;
+        c->rules_sz = sz;
+    }
+    c->rules[c->num_rules++] = r;
+
+    /* taken again on the next lookup */
+    free(c->fps);
+    c->fps = NULL;
+    return 0;
+}
+
+/* Takes the fingerprints of the rules in @c, unless it has them already */
+static bool nft_cache_chain_fps(struct nft_cache_chain *c) {
+    unsigned int i;
+
+    if (c->fps != NULL)
+        return true;
+
+    c->fps = malloc(c->rules_sz * sizeof(*c->fps));
+    if (c->fps == NULL)
+        return false;
+
+    for (i = 0; i < c->num_rules; i++)
+        c->fps[i] = nft_rule_fp(c->rules[i]);
+    return true;
+}
+
+/* Unlinks the rule at @pos, the caller takes over the rule object */
+static struct nftnl_rule *nft_cache_chain_del(struct nft_cache_chain *c,
+                                              unsigned int pos) {
+    struct nftnl_rule *r = c->rules[pos];
+
+    c->num_rules--;
+    memmove(&c->rules[pos], &c->rules[pos + 1],
+            (c->num_rules - pos) * sizeof(c->rules[0]));
+    if (c->fps != NULL)
+        memmove(&c->fps[pos], &c->fps[pos + 1],
+                (c->num_rules - pos) * sizeof(c->fps[0]));
+    return r;
+}
+
+static void nft_rule_cache_free(struct nft_rule_cache *rc) {
+    struct nft_cache_table *t, *tmp_t;
+    struct nft_cache_chain *c, *tmp_c;
+    unsigned int i;
+
+    list_for_each_entry_safe(t, tmp_t, &rc->tables, head) {
+        list_for_each_entry_safe(c, tmp_c, &t->chains, head) {
+            for (i = 0; i < c->num_rules; i++)
+                nftnl_rule_free(c->rules[i]);
+            free(c->rules);
+            free(c->fps);
+            free(c->name);
+            free(c);
+        }
+        free(t->name);
+        free(t);
+    }
+    free(rc);
+}
+
+void flush_rule_cache(struct nft_handle *h) {
     if (!h->rule_cache)
         return;
 
-    nftnl_rule_list_free(h->rule_cache);
+    nft_rule_cache_free(h->rule_cache);
     h->rule_cache = NULL;
 }
 
+/**
+ * nft_batch_drop - unstage the objects added after the first @num ones
+ *
+ * Encoded attributes live in the arena and go with it on the next commit.
+ * Rules the dropped ones deleted are still cached as gone, so the rule
+ * cache is dropped too.
+ */
+void nft_batch_drop(struct nft_handle *h, unsigned int num) {
+    struct obj_update *obj;
+
+    while (h->obj_list_num > num) {
+        obj = list_entry(h->obj_list.prev, struct obj_update, head);
+        list_del(&obj->head);
+        h->obj_list_num--;
+        if (obj->len > 0)
+            continue;
+
+        switch (obj->type) {
+        case NFT_COMPAT_TABLE_ADD:
+            nftnl_table_free(obj->table);
+            nft_table_builtin_reset(h);
+            break;
+        case NFT_COMPAT_CHAIN_ADD:
+        case NFT_COMPAT_CHAIN_USER_ADD:
+        case NFT_COMPAT_CHAIN_USER_DEL:
+        case NFT_COMPAT_CHAIN_UPDATE:
+        case NFT_COMPAT_CHAIN_RENAME:
+            nftnl_chain_free(obj->chain);
+            break;
+        case NFT_COMPAT_RULE_APPEND:
+        case NFT_COMPAT_RULE_INSERT:
+        case NFT_COMPAT_RULE_REPLACE:
+        case NFT_COMPAT_RULE_DELETE:
+        case NFT_COMPAT_RULE_FLUSH:
+            nftnl_rule_free(obj->rule);
+            break;
+        case NFT_COMPAT_SET_ADD:
+        case NFT_COMPAT_SET_ELEM_ADD:
+            break;
+        }
+    }
+    flush_rule_cache(h);
+}
+
 void nft_fini(struct nft_handle *h) {
     flush_rule_cache(h);
+    obj_arena_release(h, true);
     mnl_socket_close(h->nl);
     free(mnl_nlmsg_batch_head(h->batch));
     mnl_nlmsg_batch_stop(h->batch);
@@ -958,6 +1426,68 @@ int add_action(struct nftnl_rule *r, struct iptables_command_state *cs,
     return ret;
 }
 
+static void enc_xt(struct nft_rule_enc *e, const char *expr, uint16_t name,
+                   const char *xt_name, uint8_t rev, const void *info,
+                   size_t len) {
+    struct nlattr *nest[2];
+
+    if (!enc_expr_start(e, expr, len, nest))
+        return;
+
+    /* NFTA_{MATCH,TARGET}_{NAME,REV,INFO} are consecutive */
+    enc_put_strz(e, name, xt_name);
+    enc_put_u32(e, name + 1, rev);
+    enc_put(e, name + 2, len, info);
+    enc_expr_end(e, nest);
+}
+
+void enc_match(struct nft_rule_enc *e, struct xt_entry_match *m) {
+    enc_xt(e, "match", NFTA_MATCH_NAME, m->u.user.name, m->u.user.revision,
+           m->data, m->u.match_size - sizeof(*m));
+}
+
+void enc_target(struct nft_rule_enc *e, struct xt_entry_target *t) {
+    enc_xt(e, "target", NFTA_TARGET_NAME, t->u.user.name, t->u.user.revision,
+           t->data, t->u.target_size - sizeof(*t));
+}
+
+static void enc_verdict(struct nft_rule_enc *e, int verdict,
+                        const char *chain) {
+    struct nlattr *nest[2], *data, *v;
+
+    if (!enc_expr_start(e, "immediate", chain ? strlen(chain) : 0, nest))
+        return;
+
+    enc_put_u32(e, NFTA_IMMEDIATE_DREG, NFT_REG_VERDICT);
+    data = enc_nest_start(e, NFTA_IMMEDIATE_DATA);
+    v = enc_nest_start(e, NFTA_DATA_VERDICT);
+    enc_put_u32(e, NFTA_VERDICT_CODE, verdict);
+    if (chain != NULL)
+        enc_put_strz(e, NFTA_VERDICT_CHAIN, chain);
+    enc_nest_end(e, v);
+    enc_nest_end(e, data);
+    enc_expr_end(e, nest);
+}
+
+void enc_action(struct nft_rule_enc *e, struct iptables_command_state *cs,
+                bool goto_set) {
+    /* If no target at all, add nothing (default to continue) */
+    if (cs->target != NULL) {
+        /* Standard target? */
+        if (strcmp(cs->jumpto, XTC_LABEL_ACCEPT) == 0)
+            enc_verdict(e, NF_ACCEPT, NULL);
+        else if (strcmp(cs->jumpto, XTC_LABEL_DROP) == 0)
+            enc_verdict(e, NF_DROP, NULL);
+        else if (strcmp(cs->jumpto, XTC_LABEL_RETURN) == 0)
+            enc_verdict(e, NFT_RETURN, NULL);
+        else
+            enc_target(e, cs->target->t);
+    } else if (strlen(cs->jumpto) > 0) {
+        /* Not standard, then it's a go / jump to chain */
+        enc_verdict(e, goto_set ? NFT_GOTO : NFT_JUMP, cs->jumpto);
+    }
+}
+
 static void nft_rule_print_debug(struct nftnl_rule *r, struct nlmsghdr *nlh) {
 #ifdef NLDEBUG
     char tmp[1024];
@@ -968,6 +1498,19 @@ static void nft_rule_print_debug(struct nftnl_rule *r, struct nlmsghdr *nlh) {
 #endif
 }
 
+void enc_counters(struct nft_rule_enc *e, uint64_t packets, uint64_t bytes) {
+    struct nlattr *nest[2];
+
+    if (!enc_expr_start(e, "counter", 0, nest))
+        return;
+
+    bytes = htobe64(bytes);
+    packets = htobe64(packets);
+    enc_put(e, NFTA_COUNTER_BYTES, sizeof(bytes), &bytes);
+    enc_put(e, NFTA_COUNTER_PACKETS, sizeof(packets), &packets);
+    enc_expr_end(e, nest);
+}
+
 int add_counters(struct nftnl_rule *r, uint64_t packets, uint64_t bytes) {
     struct nftnl_expr *expr;
 
@@ -1006,6 +1549,10 @@ int add_comment(struct nftnl_rule *r, const char *comment) {
     return 0;
 }
 
+void enc_comment(struct nft_rule_enc *e, const char *comment) {
+    e->comment = comment;
+}
+
 static int parse_udata_cb(const struct nftnl_udata *attr, void *data) {
     unsigned char *value = nftnl_udata_get(attr);
     uint8_t type = nftnl_udata_type(attr);
@@ -1063,9 +1610,160 @@ err:
     return NULL;
 }
 
+/*
+ * Largest rule the direct encoder handles, others go through libnftnl. It
+ * gets a batch page of its own if needed, see nft_batch_room().
+ */
+#define NFT_RULE_ENC_SIZE 16384
+
+/*
+ * libnftnl puts the user data ahead of the expressions, but the comment is
+ * only known once those are encoded: move them up and insert it in front.
+ */
+static int nft_rule_enc_comment(struct nft_rule_enc *e, struct nlattr *exprs) {
+    char *tail = mnl_nlmsg_get_payload_tail(e->nlh);
+    size_t clen = strlen(e->comment) + 1;
+    size_t len = MNL_ATTR_HDRLEN + MNL_ALIGN(clen + 2);
+    uint8_t *udata;
+
+    /* a single nftnl_udata: type, length, value */
+    if (clen + 2 > NFT_USERDATA_MAXLEN || e->nlh->nlmsg_len + len > e->size)
+        return -1;
+
+    memmove((char *)exprs + len, exprs, tail - (char *)exprs);
+    e->nlh->nlmsg_len += len;
+
+    memset(exprs, 0, len);
+    exprs->nla_type = NFTA_RULE_USERDATA;
+    exprs->nla_len = MNL_ATTR_HDRLEN + clen + 2;
+    udata = mnl_attr_get_payload(exprs);
+    udata[0] = UDATA_TYPE_COMMENT;
+    udata[1] = clen;
+    memcpy(&udata[2], e->comment, clen);
+
+    return 0;
+}
+
+static int nft_rule_enc_run(struct nft_handle *h, struct nft_rule_enc *e,
+                            const char *chain, const char *table, void *data,
+                            uint64_t handle, uint64_t position) {
+    struct nlattr *nest;
+    uint32_t val;
+
+    enc_put_strz(e, NFTA_RULE_TABLE, table);
+    enc_put_strz(e, NFTA_RULE_CHAIN, chain);
+    if (handle > 0) {
+        handle = htobe64(handle);
+        enc_put(e, NFTA_RULE_HANDLE, sizeof(handle), &handle);
+    }
+    if (position > 0) {
+        position = htobe64(position);
+        enc_put(e, NFTA_RULE_POSITION, sizeof(position), &position);
+    }
+
+    nest = enc_nest_start(e, NFTA_RULE_EXPRESSIONS);
+    if (h->ops->encode(e, data) < 0 || e->error)
+        return -1;
+    enc_nest_end(e, nest);
+
+    if (e->comment != NULL && nft_rule_enc_comment(e, nest) < 0)
+        return -1;
+
+    if (e->compat) {
+        nest = enc_nest_start(e, NFTA_RULE_COMPAT);
+        val = htonl(e->compat_proto);
+        enc_put(e, NFTA_RULE_COMPAT_PROTO, sizeof(val), &val);
+        val = htonl(e->compat_flags);
+        enc_put(e, NFTA_RULE_COMPAT_FLAGS, sizeof(val), &val);
+        enc_nest_end(e, nest);
+    }
+
+    return e->error ? -1 : 0;
+}
+
+/*
+ * Builds the same rule through nft_rule_new() and compares the attributes
+ * with what the encoder produced. Both paths must stay byte-identical, so
+ * this runs with XTABLES_CHECK_ENCODE set, as iptables-test.py -n does.
+ */
+static bool nft_rule_encode_check(struct nft_handle *h, const char *chain,
+                                  const char *table, void *data,
+                                  uint64_t handle, uint64_t position,
+                                  const void *nla, uint32_t len) {
+    size_t off = MNL_ALIGN(sizeof(struct nfgenmsg));
+    struct nlmsghdr *nlh;
+    struct nftnl_rule *r;
+    bool same;
+    char *buf;
+
+    r = nft_rule_new(h, chain, table, data);
+    if (r == NULL)
+        return false;
+    if (handle > 0)
+        nftnl_rule_set_u64(r, NFTNL_RULE_HANDLE, handle);
+    if (position > 0)
+        nftnl_rule_set_u64(r, NFTNL_RULE_POSITION, position);
+
+    buf = malloc(BATCH_PAGE_SIZE);
+    if (buf == NULL) {
+        nftnl_rule_free(r);
+        return false;
+    }
+
+    nlh = nftnl_rule_nlmsg_build_hdr(buf, NFT_MSG_NEWRULE, h->family, 0, 0);
+    nftnl_rule_nlmsg_build_payload(nlh, r);
+    nftnl_rule_free(r);
+
+    same = nlh->nlmsg_len == MNL_NLMSG_HDRLEN + off + len &&
+           memcmp((char *)mnl_nlmsg_get_payload(nlh) + off, nla, len) == 0;
+    free(buf);
+
+    return same;
+}
+
+/*
+ * Encodes the rule attributes straight into the transaction arena, for the
+ * families that provide an encoder. Returns NULL if the rule has to be built
+ * with nft_rule_new() instead.
+ */
+static void *nft_rule_encode(struct nft_handle *h, const char *chain,
+                             const char *table, void *data, uint64_t handle,
+                             uint64_t position, uint32_t *len) {
+    char buf[NFT_RULE_ENC_SIZE];
+    struct nft_rule_enc e = {};
+    void *nla;
+
+    if (h->ops->encode == NULL)
+        return NULL;
+
+    e.nlh = mnl_nlmsg_put_header(buf);
+    e.size = sizeof(buf);
+    if (nft_rule_enc_run(h, &e, chain, table, data, handle, position) < 0)
+        return NULL;
+
+    *len = e.nlh->nlmsg_len - MNL_NLMSG_HDRLEN;
+    if (getenv("XTABLES_CHECK_ENCODE") != NULL &&
+        !nft_rule_encode_check(h, chain, table, data, handle, position,
+                               mnl_nlmsg_get_payload(e.nlh), *len)) {
+        fprintf(stderr, "rule in chain %s encodes differently than with "
+                        "libnftnl\n", chain);
+        exit(OTHER_PROBLEM);
+    }
+
+    nla = obj_arena_alloc(h, *len);
+    if (nla == NULL)
+        return NULL;
+
+    memcpy(nla, mnl_nlmsg_get_payload(e.nlh), *len);
+
+    return nla;
+}
+
 int nft_rule_append(struct nft_handle *h, const char *chain, const char *table,
                     void *data, uint64_t handle, bool verbose) {
     struct nftnl_rule *r;
+    uint32_t len;
+    void *nla;
     int type;
 
     /* If built-in chains don't exist for this table, create them */
@@ -1074,6 +1772,17 @@ int nft_rule_append(struct nft_handle *h, const char *chain, const char *table,
 
     nft_fn = nft_rule_append;
 
+    type = handle > 0 ? NFT_COMPAT_RULE_REPLACE : NFT_COMPAT_RULE_APPEND;
+
+    nla = nft_rule_encode(h, chain, table, data, handle, 0, &len);
+    if (nla != NULL) {
+        if (batch_nla_add(h, type, nla, len) < 0)
+            return 0;
+
+        flush_rule_cache(h);
+        return 1;
+    }
+
     r = nft_rule_new(h, chain, table, data);
     if (r == NULL)
         return 0;
@@ -1206,90 +1915,638 @@ int nft_chain_save(struct nft_handle *h, struct nftnl_chain_list *list,
     }
 
     nftnl_chain_list_iter_destroy(iter);
-    nftnl_chain_list_free(list);
+    nft_chain_list_free(list);
 
     return 1;
 }
 
-static int nftnl_rule_list_cb(const struct nlmsghdr *nlh, void *data) {
+struct nft_rule_dump {
+    struct nft_rule_cache *rc;
+    const char *table;
+    const char *chain;
+};
+
+static int nft_rule_cache_cb(const struct nlmsghdr *nlh, void *data) {
+    struct nft_rule_dump *d = data;
     struct nftnl_rule *r;
-    struct nftnl_rule_list *list = data;
 
     r = nftnl_rule_alloc();
     if (r == NULL)
-        goto err;
+        return MNL_CB_ERROR;
 
     if (nftnl_rule_nlmsg_parse(nlh, r) < 0)
         goto out;
 
-    nftnl_rule_list_add_tail(r, list);
+    /* kernels without dump filtering send the whole family */
+    if (d->chain != NULL &&
+        (strcmp(d->table, nftnl_rule_get_str(r, NFTNL_RULE_TABLE)) != 0 ||
+         strcmp(d->chain, nftnl_rule_get_str(r, NFTNL_RULE_CHAIN)) != 0))
+        goto out;
+
+    if (nft_rule_cache_add(d->rc, r) < 0) {
+        nftnl_rule_free(r);
+        return MNL_CB_ERROR;
+    }
 
     return MNL_CB_OK;
 out:
     nftnl_rule_free(r);
-    nftnl_rule_list_free(list);
-err:
     return MNL_CB_OK;
 }
 
-static struct nftnl_rule_list *nft_rule_list_get(struct nft_handle *h) {
+/* Dumps the rules of @chain in @table into @rc, all rules if @chain is NULL */
+static int nft_rule_cache_dump(struct nft_handle *h, struct nft_rule_cache *rc,
+                               const char *table, const char *chain) {
     char buf[MNL_SOCKET_BUFFER_SIZE];
+    struct nft_rule_dump d = {
+        .rc = rc,
+        .table = table,
+        .chain = chain,
+    };
+    struct nlmsghdr *nlh;
+    struct nftnl_rule *r;
+
+    nlh = nftnl_rule_nlmsg_build_hdr(buf, NFT_MSG_GETRULE, h->family,
+                                     NLM_F_DUMP, h->seq);
+
+    if (chain != NULL) {
+        r = nftnl_rule_alloc();
+        if (r == NULL)
+            return -1;
+
+        nftnl_rule_set(r, NFTNL_RULE_TABLE, (char *)table);
+        nftnl_rule_set(r, NFTNL_RULE_CHAIN, (char *)chain);
+        nftnl_rule_nlmsg_build_payload(nlh, r);
+        nftnl_rule_free(r);
+    }
+
+    return mnl_talk(h, nlh, nft_rule_cache_cb, &d);
+}
+
+static struct nft_rule_cache *nft_rule_cache_alloc(void) {
+    struct nft_rule_cache *rc;
+
+    rc = calloc(1, sizeof(*rc));
+    if (rc == NULL)
+        return NULL;
+
+    INIT_LIST_HEAD(&rc->tables);
+    return rc;
+}
+
+/* Returns a cache holding every rule of the family, for save and listings */
+static struct nft_rule_cache *nft_rule_cache_get(struct nft_handle *h) {
+    struct nft_rule_cache *rc;
+
+    if (h->rule_cache && h->rule_cache->complete)
+        return h->rule_cache;
+
+    flush_rule_cache(h);
+
+    rc = nft_rule_cache_alloc();
+    if (rc == NULL)
+        return NULL;
+
+    if (nft_rule_cache_dump(h, rc, NULL, NULL) < 0) {
+        nft_rule_cache_free(rc);
+        return NULL;
+    }
+
+    rc->complete = true;
+    h->rule_cache = rc;
+    return rc;
+}
+
+/*
+ * Returns the cached rules of @chain, only asking the kernel for that chain
+ * if it is not cached yet.
+ */
+static struct nft_cache_chain *
+nft_rule_cache_get_chain(struct nft_handle *h, const char *table,
+                         const char *chain) {
+    struct nft_cache_chain *c;
+
+    if (h->rule_cache == NULL) {
+        h->rule_cache = nft_rule_cache_alloc();
+        if (h->rule_cache == NULL)
+            return NULL;
+    }
+
+    c = nft_rule_cache_chain(h->rule_cache, table, chain);
+    if (c != NULL)
+        return c;
+
+    if (!h->rule_cache->complete &&
+        nft_rule_cache_dump(h, h->rule_cache, table, chain) < 0) {
+        flush_rule_cache(h);
+        return NULL;
+    }
+
+    /* also cache that the chain is empty */
+    return nft_rule_cache_chain_add(h->rule_cache, table, chain);
+}
+
+/*
+ * Address sets: long -s/-d lists become a single rule looking the address up
+ * in an anonymous interval set, instead of one rule per address.
+ */
+
+/* nft datatypes, informational for the kernel but used by nft to list it */
+#define NFT_TYPE_IPADDR 7
+#define NFT_TYPE_IP6ADDR 8
+
+/* Keep element messages within the batch page slack */
+#define NFT_SET_ELEM_MSG_SIZE 2048
+#define NFT_SET_ELEM_ROOM 64
+
+struct nft_addr_range {
+    uint8_t lo[16];
+    uint8_t hi[16];
+};
+
+static int nft_addr_range_cmp(const void *a, const void *b) {
+    return memcmp(a, b, sizeof(((struct nft_addr_range *)0)->lo));
+}
+
+/* Returns false if the key wrapped around */
+static bool nft_addr_key_inc(uint8_t *key, size_t len) {
+    while (len-- > 0) {
+        if (++key[len] != 0)
+            return true;
+    }
+    return false;
+}
+
+/* Sorts the ranges and merges overlapping and adjacent ones */
+static unsigned int nft_addr_ranges_merge(struct nft_addr_range *r,
+                                          unsigned int num, size_t len) {
+    uint8_t next[16];
+    unsigned int i, j = 0;
+
+    qsort(r, num, sizeof(*r), nft_addr_range_cmp);
+
+    for (i = 1; i < num; i++) {
+        memcpy(next, r[j].hi, len);
+        if (!nft_addr_key_inc(next, len) || memcmp(r[i].lo, next, len) <= 0) {
+            if (memcmp(r[i].hi, r[j].hi, len) > 0)
+                memcpy(r[j].hi, r[i].hi, len);
+            continue;
+        }
+        r[++j] = r[i];
+    }
+    return num > 0 ? j + 1 : 0;
+}
+
+struct nft_set_elem_msg {
+    struct nft_handle *h;
+    const char *table;
+    const struct xt_addr_set *set;
+    char buf[NFT_SET_ELEM_MSG_SIZE];
+    struct nlmsghdr *nlh;
+    struct nlattr *elems;
+};
+
+static void nft_set_elem_msg_start(struct nft_set_elem_msg *m) {
+    m->nlh = mnl_nlmsg_put_header(m->buf);
+    mnl_attr_put_strz(m->nlh, NFTA_SET_ELEM_LIST_TABLE, m->table);
+    mnl_attr_put_strz(m->nlh, NFTA_SET_ELEM_LIST_SET, m->set->name);
+    mnl_attr_put_u32(m->nlh, NFTA_SET_ELEM_LIST_SET_ID, htonl(m->set->id));
+    m->elems = mnl_attr_nest_start(m->nlh, NFTA_SET_ELEM_LIST_ELEMENTS);
+}
+
+static int nft_set_elem_msg_stage(struct nft_set_elem_msg *m) {
+    uint32_t len;
+    void *nla;
+
+    mnl_attr_nest_end(m->nlh, m->elems);
+    len = m->nlh->nlmsg_len - MNL_NLMSG_HDRLEN;
+    nla = obj_arena_alloc(m->h, len);
+    if (nla == NULL)
+        return -1;
+
+    memcpy(nla, mnl_nlmsg_get_payload(m->nlh), len);
+    return batch_nla_add(m->h, NFT_COMPAT_SET_ELEM_ADD, nla, len);
+}
+
+static int nft_set_elem_msg_add(struct nft_set_elem_msg *m, const void *key,
+                                size_t len, uint32_t flags) {
+    struct nlattr *elem, *data;
+
+    if (m->nlh->nlmsg_len + NFT_SET_ELEM_ROOM > sizeof(m->buf)) {
+        if (nft_set_elem_msg_stage(m) < 0)
+            return -1;
+        nft_set_elem_msg_start(m);
+    }
+
+    elem = mnl_attr_nest_start(m->nlh, NFTA_LIST_ELEM);
+    data = mnl_attr_nest_start(m->nlh, NFTA_SET_ELEM_KEY);
+    mnl_attr_put(m->nlh, NFTA_DATA_VALUE, len, key);
+    mnl_attr_nest_end(m->nlh, data);
+    if (flags != 0)
+        mnl_attr_put_u32(m->nlh, NFTA_SET_ELEM_FLAGS, htonl(flags));
+    mnl_attr_nest_end(m->nlh, elem);
+    return 0;
+}
+
+static int nft_addr_set_stage(struct nft_handle *h, const char *table,
+                              const struct xt_addr_set *set,
+                              const struct nft_addr_range *r, unsigned int num,
+                              size_t len) {
+    static const uint8_t zero[16];
+    struct nft_set_elem_msg *m;
+    char buf[512];
     struct nlmsghdr *nlh;
-    struct nftnl_rule_list *list;
+    uint8_t end[16];
+    unsigned int i;
+    uint32_t nla_len;
+    void *nla;
+    int ret = -1;
+
+    nlh = mnl_nlmsg_put_header(buf);
+    mnl_attr_put_strz(nlh, NFTA_SET_TABLE, table);
+    mnl_attr_put_strz(nlh, NFTA_SET_NAME, set->name);
+    mnl_attr_put_u32(nlh, NFTA_SET_FLAGS,
+                     htonl(NFT_SET_ANONYMOUS | NFT_SET_CONSTANT |
+                           NFT_SET_INTERVAL));
+    mnl_attr_put_u32(nlh, NFTA_SET_KEY_TYPE,
+                     htonl(len == 4 ? NFT_TYPE_IPADDR : NFT_TYPE_IP6ADDR));
+    mnl_attr_put_u32(nlh, NFTA_SET_KEY_LEN, htonl(len));
+    mnl_attr_put_u32(nlh, NFTA_SET_ID, htonl(set->id));
+
+    nla_len = nlh->nlmsg_len - MNL_NLMSG_HDRLEN;
+    nla = obj_arena_alloc(h, nla_len);
+    if (nla == NULL)
+        return -1;
+    memcpy(nla, mnl_nlmsg_get_payload(nlh), nla_len);
+    if (batch_nla_add(h, NFT_COMPAT_SET_ADD, nla, nla_len) < 0)
+        return -1;
+
+    m = malloc(sizeof(*m));
+    if (m == NULL)
+        return -1;
+    m->h = h;
+    m->table = table;
+    m->set = set;
+    nft_set_elem_msg_start(m);
+
+    /*
+     * Each range is an element opening it and one closing it right after
+     * its end. Anything below the first range is closed explicitly.
+     */
+    if (memcmp(r[0].lo, zero, len) != 0 &&
+        nft_set_elem_msg_add(m, zero, len, NFT_SET_ELEM_INTERVAL_END) < 0)
+        goto out;
+
+    for (i = 0; i < num; i++) {
+        if (nft_set_elem_msg_add(m, r[i].lo, len, 0) < 0)
+            goto out;
+
+        memcpy(end, r[i].hi, len);
+        if (nft_addr_key_inc(end, len) &&
+            nft_set_elem_msg_add(m, end, len, NFT_SET_ELEM_INTERVAL_END) < 0)
+            goto out;
+    }
+
+    ret = nft_set_elem_msg_stage(m);
+out:
+    free(m);
+    return ret;
+}
+
+/* Ranges covered by the addresses of @am, sorted and merged */
+static struct nft_addr_range *nft_addr_ranges_get(const struct addr_mask *am,
+                                                  size_t len,
+                                                  unsigned int *num) {
+    struct nft_addr_range *r;
+    unsigned int i;
+
+    if (am->naddrs == 0)
+        return NULL;
+
+    r = calloc(am->naddrs, sizeof(*r));
+    if (r == NULL)
+        return NULL;
+
+    for (i = 0; i < am->naddrs; i++) {
+        const uint8_t *addr, *mask;
+        size_t j;
+
+        if (len == 4) {
+            addr = (const uint8_t *)&am->addr.v4[i];
+            mask = (const uint8_t *)&am->mask.v4[i];
+        } else {
+            addr = am->addr.v6[i].s6_addr;
+            mask = am->mask.v6[i].s6_addr;
+        }
+        for (j = 0; j < len; j++) {
+            r[i].lo[j] = addr[j] & mask[j];
+            r[i].hi[j] = addr[j] | ~mask[j];
+        }
+    }
+    *num = nft_addr_ranges_merge(r, am->naddrs, len);
+
+    return r;
+}
+
+int nft_addr_set_add(struct nft_handle *h, const char *table,
+                     const struct addr_mask *am, struct xt_addr_set *set) {
+    size_t len = h->family == AF_INET6 ? 16 : 4;
+    struct nft_addr_range *r;
+    unsigned int num;
     int ret;
 
-    if (h->rule_cache)
-        return h->rule_cache;
+    /* the set goes into the table, which may not exist yet */
+    if (nft_xtables_config_load(h, XTABLES_CONFIG_DEFAULT, 0) < 0)
+        nft_xt_builtin_init(h, table);
+
+    r = nft_addr_ranges_get(am, len, &num);
+    if (r == NULL)
+        return 0;
+
+    snprintf(set->name, sizeof(set->name), "__set%%d");
+    set->id = ++h->set_id;
+    set->list = NULL;
+
+    ret = nft_addr_set_stage(h, table, set, r, num, len);
+    free(r);
+
+    return ret == 0 ? 1 : 0;
+}
+
+static int nft_addr_set_elem_cb(const struct nlmsghdr *nlh, void *data) {
+    struct nftnl_set *s = data;
+
+    if (nftnl_set_elems_nlmsg_parse(nlh, s) < 0)
+        return MNL_CB_ERROR;
+
+    return MNL_CB_OK;
+}
+
+struct nft_addr_key {
+    uint8_t key[16];
+    uint32_t flags;
+};
+
+static int nft_addr_key_cmp(const void *a, const void *b) {
+    return memcmp(a, b, sizeof(((struct nft_addr_key *)0)->key));
+}
+
+/* Appends @lo/@prefix to the comma separated list in @buf */
+static bool nft_addr_list_add(char **buf, size_t *size, size_t *used,
+                              const uint8_t *lo, size_t len,
+                              unsigned int prefix) {
+    char addr[INET6_ADDRSTRLEN];
+    int n;
+
+    inet_ntop(len == 4 ? AF_INET : AF_INET6, lo, addr, sizeof(addr));
+
+    if (*used + sizeof(addr) + 6 > *size) {
+        size_t nsize = *size ? *size * 2 : 1024;
+        char *tmp = realloc(*buf, nsize);
+
+        if (tmp == NULL)
+            return false;
+        *buf = tmp;
+        *size = nsize;
+    }
+
+    n = snprintf(*buf + *used, *size - *used, "%s%s/%u", *used ? "," : "",
+                 addr, prefix);
+    *used += n;
+    return true;
+}
+
+/* Splits [@lo, @hi] into the fewest prefixes */
+static bool nft_addr_range_to_list(char **buf, size_t *size, size_t *used,
+                                   uint8_t *lo, const uint8_t *hi,
+                                   size_t len) {
+    unsigned int bits = len * 8;
+    uint8_t end[16];
+
+    for (;;) {
+        unsigned int host = 0, b;
+
+        /* grow the block while lo stays aligned and it ends within hi */
+        while (host < bits) {
+            b = bits - 1 - host;
+            if (lo[b / 8] & (0x80 >> (b % 8)))
+                break;
+
+            memcpy(end, lo, len);
+            for (b = bits - 1 - host; b < bits; b++)
+                end[b / 8] |= 0x80 >> (b % 8);
+            if (memcmp(end, hi, len) > 0)
+                break;
+            host++;
+        }
+
+        if (!nft_addr_list_add(buf, size, used, lo, len, bits - host))
+            return false;
+
+        for (b = bits - host; b < bits; b++)
+            lo[b / 8] |= 0x80 >> (b % 8);
+        if (memcmp(lo, hi, len) >= 0 || !nft_addr_key_inc(lo, len))
+            return true;
+    }
+}
+
+/* Comma separated list of the fewest prefixes covering the @num ranges */
+static char *nft_addr_ranges_list(struct nft_addr_range *r, unsigned int num,
+                                  size_t len) {
+    size_t size = 0, used = 0;
+    char *list = NULL;
+    unsigned int i;
+
+    for (i = 0; i < num; i++) {
+        if (!nft_addr_range_to_list(&list, &size, &used, r[i].lo, r[i].hi,
+                                    len)) {
+            free(list);
+            return NULL;
+        }
+    }
+    return list;
+}
+
+/*
+ * Gets the elements of an address set as a comma separated list, in the
+ * same form nft_addr_set_spec() gives. Returns -1 if the set can't be read
+ * in full.
+ */
+static int nft_addr_set_list(struct nft_handle *h, const char *table,
+                             const char *name, char **list) {
+    char buf[MNL_SOCKET_BUFFER_SIZE];
+    struct nftnl_set_elems_iter *iter;
+    struct nftnl_set_elem *e;
+    struct nft_addr_key *keys = NULL;
+    struct nft_addr_range *r = NULL;
+    struct nlmsghdr *nlh;
+    struct nftnl_set *s;
+    unsigned int num = 0, size = 0, num_ranges = 0, i;
+    uint32_t len = 0;
+    int ret = -1;
+
+    *list = NULL;
+
+    s = nftnl_set_alloc();
+    if (s == NULL)
+        return -1;
+
+    nftnl_set_set_str(s, NFTNL_SET_TABLE, table);
+    nftnl_set_set_str(s, NFTNL_SET_NAME, name);
+
+    nlh = nftnl_set_nlmsg_build_hdr(buf, NFT_MSG_GETSETELEM, h->family,
+                                    NLM_F_DUMP, h->seq);
+    nftnl_set_elems_nlmsg_build_payload(nlh, s);
+
+    if (mnl_talk(h, nlh, nft_addr_set_elem_cb, s) < 0)
+        goto out;
+
+    iter = nftnl_set_elems_iter_create(s);
+    if (iter == NULL)
+        goto out;
+
+    while ((e = nftnl_set_elems_iter_next(iter)) != NULL) {
+        const void *key = nftnl_set_elem_get(e, NFTNL_SET_ELEM_KEY, &len);
+
+        if (key == NULL || (len != 4 && len != 16))
+            continue;
+
+        if (num == size) {
+            struct nft_addr_key *tmp;
+
+            size = size ? size * 2 : 64;
+            tmp = realloc(keys, size * sizeof(*keys));
+            if (tmp == NULL) {
+                nftnl_set_elems_iter_destroy(iter);
+                goto out;
+            }
+            keys = tmp;
+        }
+        memset(&keys[num], 0, sizeof(keys[num]));
+        memcpy(keys[num].key, key, len);
+        keys[num].flags = 0;
+        if (nftnl_set_elem_get(e, NFTNL_SET_ELEM_FLAGS, NULL) != NULL)
+            keys[num].flags = nftnl_set_elem_get_u32(e, NFTNL_SET_ELEM_FLAGS);
+        num++;
+    }
+    nftnl_set_elems_iter_destroy(iter);
+
+    r = calloc(num ? num : 1, sizeof(*r));
+    if (r == NULL)
+        goto out;
+
+    /* the kernel may dump interval sets in either order */
+    qsort(keys, num, sizeof(*keys), nft_addr_key_cmp);
+
+    for (i = 0; i < num; i++) {
+        uint8_t *hi = r[num_ranges].hi;
+
+        if (keys[i].flags & NFT_SET_ELEM_INTERVAL_END)
+            continue;
+
+        memcpy(r[num_ranges].lo, keys[i].key, len);
+        if (i + 1 < num) {
+            /* one below the next element, which closes this range */
+            int j;
+
+            memcpy(hi, keys[i + 1].key, len);
+            for (j = len - 1; j >= 0 && hi[j]-- == 0; j--)
+                ;
+        } else {
+            memset(hi, 0xff, len);
+        }
+        num_ranges++;
+    }
+
+    /* the set of a rule is never empty, see nft_addr_set_add() */
+    if (num_ranges == 0) {
+        errno = ENOENT;
+        goto out;
+    }
+
+    *list = nft_addr_ranges_list(r, num_ranges, len);
+    if (*list != NULL)
+        ret = 0;
+out:
+    free(r);
+    free(keys);
+    nftnl_set_free(s);
+    return ret;
+}
+
+/*
+ * Describes the set nft_addr_set_add() would create for @am by its elements,
+ * since the set itself already has a name given by the kernel. That is how
+ * -D and -C find the rule, see nft_rule_find().
+ */
+int nft_addr_set_spec(struct nft_handle *h, const struct addr_mask *am,
+                      struct xt_addr_set *set) {
+    size_t len = h->family == AF_INET6 ? 16 : 4;
+    struct nft_addr_range *r;
+    unsigned int num;
 
-    list = nftnl_rule_list_alloc();
-    if (list == NULL)
+    r = nft_addr_ranges_get(am, len, &num);
+    if (r == NULL)
         return 0;
 
-    nlh = nftnl_rule_nlmsg_build_hdr(buf, NFT_MSG_GETRULE, h->family,
-                                     NLM_F_DUMP, h->seq);
+    snprintf(set->name, sizeof(set->name), "__set%%d");
+    set->id = 0;
+    set->list = nft_addr_ranges_list(r, num, len);
+    free(r);
 
-    ret = mnl_talk(h, nlh, nftnl_rule_list_cb, list);
-    if (ret < 0) {
-        nftnl_rule_list_free(list);
-        return NULL;
-    }
+    return set->list != NULL ? 1 : 0;
+}
 
-    h->rule_cache = list;
-    return list;
+/* Like nft_rule_print_save(), with the address sets expanded back */
+static int nft_rule_save_sets(struct nft_handle *h,
+                              struct iptables_command_state *cs,
+                              struct nftnl_rule *r, unsigned int format) {
+    const char *table = nftnl_rule_get_str(r, NFTNL_RULE_TABLE);
+    int ret = -1;
+
+    if (cs->src_set.name[0] != '\0' &&
+        nft_addr_set_list(h, table, cs->src_set.name, &cs->src_set.list) < 0)
+        goto out;
+    if (cs->dst_set.name[0] != '\0' &&
+        nft_addr_set_list(h, table, cs->dst_set.name, &cs->dst_set.list) < 0)
+        goto out;
+
+    nft_rule_print_save(cs, r, NFT_RULE_APPEND, format);
+    ret = 0;
+out:
+    free(cs->src_set.list);
+    free(cs->dst_set.list);
+    cs->src_set.list = cs->dst_set.list = NULL;
+    return ret;
 }
 
 int nft_rule_save(struct nft_handle *h, const char *table, bool counters) {
-    struct nftnl_rule_list *list;
-    struct nftnl_rule_list_iter *iter;
-    struct nftnl_rule *r;
-
-    list = nft_rule_list_get(h);
-    if (list == NULL)
-        return 0;
+    struct nft_rule_cache *rc;
+    struct nft_cache_table *t;
+    struct nft_cache_chain *c;
+    unsigned int i;
 
-    iter = nftnl_rule_list_iter_create(list);
-    if (iter == NULL)
+    rc = nft_rule_cache_get(h);
+    if (rc == NULL)
         return 0;
 
-    r = nftnl_rule_list_iter_next(iter);
-    while (r != NULL) {
-        const char *rule_table = nftnl_rule_get_str(r, NFTNL_RULE_TABLE);
-        struct iptables_command_state cs = {};
-
-        if (strcmp(table, rule_table) != 0)
-            goto next;
+    t = nft_cache_table_find(rc, table);
+    if (t == NULL)
+        return 1;
 
-        nft_rule_to_iptables_command_state(r, &cs);
+    list_for_each_entry(c, &t->chains, head) {
+        for (i = 0; i < c->num_rules; i++) {
+            struct iptables_command_state cs = {};
 
-        nft_rule_print_save(&cs, r, NFT_RULE_APPEND,
-                            counters ? 0 : FMT_NOCOUNTS);
+            nft_rule_to_iptables_command_state(c->rules[i], &cs);
 
-    next:
-        r = nftnl_rule_list_iter_next(iter);
+            /* a rule missing its addresses must not be restored */
+            if (nft_rule_save_sets(h, &cs, c->rules[i],
+                                   counters ? 0 : FMT_NOCOUNTS) < 0)
+                return 0;
+        }
     }
 
-    nftnl_rule_list_iter_destroy(iter);
-
     /* the core expects 1 for success and 0 for error */
     return 1;
 }
@@ -1349,7 +2606,7 @@ int nft_rule_flush(struct nft_handle *h, const char *chain, const char *table) {
     nftnl_chain_list_iter_destroy(iter);
     flush_rule_cache(h);
 err:
-    nftnl_chain_list_free(list);
+    nft_chain_list_free(list);
 
     /* the core expects 1 for success and 0 for error */
     return ret == 0 ? 1 : 0;
@@ -1451,7 +2708,7 @@ int nft_chain_user_del(struct nft_handle *h, const char *chain,
     nftnl_chain_list_iter_destroy(iter);
 err:
     if (!h->batch_support)
-        nftnl_chain_list_free(list);
+        nft_chain_list_free(list);
 
     /* chain not found */
     if (deleted_ctr == 0) {
@@ -1463,8 +2720,115 @@ err:
     return ret == 0 ? 1 : 0;
 }
 
-struct nftnl_chain *nft_chain_list_find(struct nftnl_chain_list *list,
-                                        const char *table, const char *chain) {
+/*
+ * Chain lists are opaque to us, so lookups by name go through a hash index
+ * kept aside. It is built on the first lookup in a list, follows the chains
+ * removed with nft_chain_list_del() and is dropped by nft_chain_list_free().
+ */
+struct nft_chain_index_entry {
+    struct hlist_node hnode;
+    struct nftnl_chain *c;
+};
+
+struct nft_chain_index {
+    struct list_head head;
+    struct nftnl_chain_list *list;
+    struct hlist_head *buckets;
+    unsigned int size; /* power of two */
+    struct nft_chain_index_entry *entries;
+};
+
+static LIST_HEAD(chain_index_list);
+
+static unsigned int nft_chain_hash(const char *table, const char *chain) {
+    unsigned int hash = 5381;
+
+    while (*table)
+        hash = hash * 33 + (unsigned char)*table++;
+    hash = hash * 33;
+    while (*chain)
+        hash = hash * 33 + (unsigned char)*chain++;
+    return hash;
+}
+
+static struct nft_chain_index *
+nft_chain_index_find(struct nftnl_chain_list *list) {
+    struct nft_chain_index *idx;
+
+    list_for_each_entry(idx, &chain_index_list, head) {
+        if (idx->list == list)
+            return idx;
+    }
+    return NULL;
+}
+
+static struct nft_chain_index *
+nft_chain_index_build(struct nftnl_chain_list *list) {
+    struct nftnl_chain_list_iter *iter;
+    struct nft_chain_index *idx;
+    struct nftnl_chain *c;
+    unsigned int num = 0, i = 0;
+
+    iter = nftnl_chain_list_iter_create(list);
+    if (iter == NULL)
+        return NULL;
+    while (nftnl_chain_list_iter_next(iter) != NULL)
+        num++;
+    nftnl_chain_list_iter_destroy(iter);
+
+    idx = calloc(1, sizeof(*idx));
+    if (idx == NULL)
+        return NULL;
+
+    for (idx->size = 16; idx->size < num; idx->size <<= 1)
+        ;
+    idx->buckets = calloc(idx->size, sizeof(*idx->buckets));
+    idx->entries = calloc(num ? num : 1, sizeof(*idx->entries));
+    iter = nftnl_chain_list_iter_create(list);
+    if (idx->buckets == NULL || idx->entries == NULL || iter == NULL)
+        goto err;
+
+    while ((c = nftnl_chain_list_iter_next(iter)) != NULL && i < num) {
+        struct nft_chain_index_entry *e = &idx->entries[i++];
+        unsigned int hash =
+            nft_chain_hash(nftnl_chain_get_str(c, NFTNL_CHAIN_TABLE),
+                           nftnl_chain_get_str(c, NFTNL_CHAIN_NAME));
+
+        e->c = c;
+        hlist_add_head(&e->hnode, &idx->buckets[hash & (idx->size - 1)]);
+    }
+    nftnl_chain_list_iter_destroy(iter);
+
+    idx->list = list;
+    list_add(&idx->head, &chain_index_list);
+    return idx;
+err:
+    if (iter != NULL)
+        nftnl_chain_list_iter_destroy(iter);
+    free(idx->entries);
+    free(idx->buckets);
+    free(idx);
+    return NULL;
+}
+
+static struct nft_chain_index_entry *
+nft_chain_index_lookup(struct nft_chain_index *idx, const char *table,
+                       const char *chain) {
+    struct nft_chain_index_entry *e;
+    struct hlist_node *n;
+    unsigned int hash = nft_chain_hash(table, chain);
+
+    hlist_for_each_entry(e, n, &idx->buckets[hash & (idx->size - 1)], hnode) {
+        if (strcmp(chain, nftnl_chain_get_str(e->c, NFTNL_CHAIN_NAME)) == 0 &&
+            strcmp(table, nftnl_chain_get_str(e->c, NFTNL_CHAIN_TABLE)) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+static struct nftnl_chain *
+nft_chain_list_find_slow(struct nftnl_chain_list *list, const char *table,
+                         const char *chain) {
     struct nftnl_chain_list_iter *iter;
     struct nftnl_chain *c;
 
@@ -1492,6 +2856,51 @@ struct nftnl_chain *nft_chain_list_find(struct nftnl_chain_list *list,
     return NULL;
 }
 
+struct nftnl_chain *nft_chain_list_find(struct nftnl_chain_list *list,
+                                        const char *table, const char *chain) {
+    struct nft_chain_index *idx;
+    struct nft_chain_index_entry *e;
+
+    idx = nft_chain_index_find(list);
+    if (idx == NULL)
+        idx = nft_chain_index_build(list);
+    if (idx == NULL)
+        return nft_chain_list_find_slow(list, table, chain);
+
+    e = nft_chain_index_lookup(idx, table, chain);
+    return e ? e->c : NULL;
+}
+
+void nft_chain_list_del(struct nftnl_chain_list *list, struct nftnl_chain *c) {
+    struct nft_chain_index *idx;
+    struct nft_chain_index_entry *e;
+
+    idx = nft_chain_index_find(list);
+    if (idx != NULL) {
+        e = nft_chain_index_lookup(idx,
+                                   nftnl_chain_get_str(c, NFTNL_CHAIN_TABLE),
+                                   nftnl_chain_get_str(c, NFTNL_CHAIN_NAME));
+        if (e != NULL && e->c == c)
+            hlist_del(&e->hnode);
+    }
+
+    nftnl_chain_list_del(c);
+}
+
+void nft_chain_list_free(struct nftnl_chain_list *list) {
+    struct nft_chain_index *idx;
+
+    idx = nft_chain_index_find(list);
+    if (idx != NULL) {
+        list_del(&idx->head);
+        free(idx->entries);
+        free(idx->buckets);
+        free(idx);
+    }
+
+    nftnl_chain_list_free(list);
+}
+
 static struct nftnl_chain *
 nft_chain_find(struct nft_handle *h, const char *table, const char *chain) {
     struct nftnl_chain_list *list;
@@ -1500,7 +2909,8 @@ nft_chain_find(struct nft_handle *h, const char *table, const char *chain) {
     if (list == NULL)
         return NULL;
 
-    return nft_chain_list_find(list, table, chain);
+    /* one lookup in a fresh list, not worth indexing it */
+    return nft_chain_list_find_slow(list, table, chain);
 }
 
 int nft_chain_user_rename(struct nft_handle *h, const char *chain,
@@ -1686,11 +3096,12 @@ int nft_table_purge_chains(struct nft_handle *h, const char *this_table,
     return 0;
 }
 
-static int __nft_rule_del(struct nft_handle *h, struct nftnl_rule_list *list,
-                          struct nftnl_rule *r) {
+static int __nft_rule_del(struct nft_handle *h, struct nft_cache_chain *c,
+                          int pos) {
+    struct nftnl_rule *r;
     int ret;
 
-    nftnl_rule_list_del(r);
+    r = nft_cache_chain_del(c, pos);
 
     ret = batch_rule_add(h, NFT_COMPAT_RULE_DELETE, r);
     if (ret < 0) {
@@ -1700,62 +3111,134 @@ static int __nft_rule_del(struct nft_handle *h, struct nftnl_rule_list *list,
     return 1;
 }
 
-static struct nftnl_rule *nft_rule_find(struct nft_handle *h,
-                                        struct nftnl_rule_list *list,
-                                        const char *chain, const char *table,
-                                        void *data, int rulenum) {
+/* Builds the rule for @data only to take its fingerprint */
+static bool nft_rule_fp_spec(struct nft_handle *h, void *data, uint32_t *fp) {
     struct nftnl_rule *r;
-    struct nftnl_rule_list_iter *iter;
-    int rule_ctr = 0;
-    bool found = false;
 
-    iter = nftnl_rule_list_iter_create(list);
-    if (iter == NULL)
-        return 0;
+    r = nftnl_rule_alloc();
+    if (r == NULL)
+        return false;
 
-    r = nftnl_rule_list_iter_next(iter);
-    while (r != NULL) {
-        const char *rule_table = nftnl_rule_get_str(r, NFTNL_RULE_TABLE);
-        const char *rule_chain = nftnl_rule_get_str(r, NFTNL_RULE_CHAIN);
+    if (h->ops->add(r, data) < 0) {
+        nftnl_rule_free(r);
+        return false;
+    }
 
-        if (strcmp(table, rule_table) != 0 || strcmp(chain, rule_chain) != 0) {
-            DEBUGP("different chain / table\n");
-            goto next;
-        }
+    *fp = nft_rule_fp(r);
+    nftnl_rule_free(r);
+    return true;
+}
 
-        if (rulenum >= 0) {
-            /* Delete by rule number case */
-            if (rule_ctr == rulenum) {
-                found = true;
-                break;
-            }
-        } else {
-            found = h->ops->rule_find(h->ops, r, data);
-            if (found)
-                break;
+/* Takes the name of set @name if it has the elements @set stands for */
+static bool nft_rule_set_resolve(struct nft_handle *h, const char *table,
+                                 struct xt_addr_set *set, const char *name) {
+    char *list;
+    bool same;
+
+    if (set->list == NULL)
+        return true;
+    if (name == NULL || nft_addr_set_list(h, table, name, &list) < 0)
+        return false;
+
+    same = strcmp(list, set->list) == 0;
+    free(list);
+    if (same)
+        snprintf(set->name, sizeof(set->name), "%s", name);
+
+    return same;
+}
+
+/*
+ * Rules given with a long address list name their sets by the elements, see
+ * nft_addr_set_spec(). @r can only be the rule if its sets have the same
+ * elements, @data then gets their names for ops->rule_find() to compare.
+ */
+static bool nft_rule_sets_resolve(struct nft_handle *h, struct nftnl_rule *r,
+                                  void *data) {
+    struct iptables_command_state *cs = data;
+    const char *src = NULL, *dst = NULL, *table;
+    struct nftnl_expr_iter *iter;
+    struct nftnl_expr *e;
+    uint32_t src_off, dst_off, off = 0;
+
+    if (h->family != AF_INET && h->family != AF_INET6)
+        return true;
+    if (cs->src_set.list == NULL && cs->dst_set.list == NULL)
+        return true;
+
+    if (h->family == AF_INET) {
+        src_off = offsetof(struct iphdr, saddr);
+        dst_off = offsetof(struct iphdr, daddr);
+    } else {
+        src_off = offsetof(struct ip6_hdr, ip6_src);
+        dst_off = offsetof(struct ip6_hdr, ip6_dst);
+    }
+
+    iter = nftnl_expr_iter_create(r);
+    if (iter == NULL)
+        return false;
+
+    /* an address lookup is a payload load followed by the lookup */
+    while ((e = nftnl_expr_iter_next(iter)) != NULL) {
+        const char *name = nftnl_expr_get_str(e, NFTNL_EXPR_NAME);
+
+        if (strcmp(name, "payload") == 0) {
+            off = nftnl_expr_get_u32(e, NFTNL_EXPR_PAYLOAD_OFFSET);
+        } else if (strcmp(name, "lookup") == 0) {
+            if (off == src_off)
+                src = nftnl_expr_get_str(e, NFTNL_EXPR_LOOKUP_SET);
+            else if (off == dst_off)
+                dst = nftnl_expr_get_str(e, NFTNL_EXPR_LOOKUP_SET);
         }
-        rule_ctr++;
-    next:
-        r = nftnl_rule_list_iter_next(iter);
+    }
+    nftnl_expr_iter_destroy(iter);
+
+    table = nftnl_rule_get_str(r, NFTNL_RULE_TABLE);
+    return nft_rule_set_resolve(h, table, &cs->src_set, src) &&
+           nft_rule_set_resolve(h, table, &cs->dst_set, dst);
+}
+
+/* Returns the position of the rule in @c, or -1 if there is no such rule */
+static int nft_rule_find(struct nft_handle *h, struct nft_cache_chain *c,
+                         void *data, int rulenum) {
+    unsigned int i;
+    bool use_fp;
+    uint32_t fp;
+
+    if (c == NULL)
+        return -1;
+
+    if (rulenum >= 0) {
+        /* Delete by rule number case */
+        return (unsigned int)rulenum < c->num_rules ? rulenum : -1;
     }
 
-    nftnl_rule_list_iter_destroy(iter);
+    /* only decode and compare the rules that may be the one asked for */
+    use_fp = nft_cache_chain_fps(c) && nft_rule_fp_spec(h, data, &fp);
 
-    return found ? r : NULL;
+    for (i = 0; i < c->num_rules; i++) {
+        if (use_fp && c->fps[i] != fp)
+            continue;
+        if (!nft_rule_sets_resolve(h, c->rules[i], data))
+            continue;
+        if (h->ops->rule_find(h->ops, c->rules[i], data))
+            return i;
+    }
+    return -1;
 }
 
 int nft_rule_check(struct nft_handle *h, const char *chain, const char *table,
                    void *data, bool verbose) {
-    struct nftnl_rule_list *list;
+    struct nft_cache_chain *c;
     int ret;
 
     nft_fn = nft_rule_check;
 
-    list = nft_rule_list_get(h);
-    if (list == NULL)
+    c = nft_rule_cache_get_chain(h, table, chain);
+    if (c == NULL)
         return 0;
 
-    ret = nft_rule_find(h, list, chain, table, data, -1) ? 1 : 0;
+    ret = nft_rule_find(h, c, data, -1) >= 0 ? 1 : 0;
     if (ret == 0)
         errno = ENOENT;
 
@@ -1764,19 +3247,18 @@ int nft_rule_check(struct nft_handle *h, const char *chain, const char *table,
 
 int nft_rule_delete(struct nft_handle *h, const char *chain, const char *table,
                     void *data, bool verbose) {
-    int ret = 0;
-    struct nftnl_rule *r;
-    struct nftnl_rule_list *list;
+    int ret = 0, pos;
+    struct nft_cache_chain *c;
 
     nft_fn = nft_rule_delete;
 
-    list = nft_rule_list_get(h);
-    if (list == NULL)
+    c = nft_rule_cache_get_chain(h, table, chain);
+    if (c == NULL)
         return 0;
 
-    r = nft_rule_find(h, list, chain, table, data, -1);
-    if (r != NULL) {
-        ret = __nft_rule_del(h, list, r);
+    pos = nft_rule_find(h, c, data, -1);
+    if (pos >= 0) {
+        ret = __nft_rule_del(h, c, pos);
         if (ret < 0)
             errno = ENOMEM;
     } else
@@ -1787,10 +3269,63 @@ int nft_rule_delete(struct nft_handle *h, const char *chain, const char *table,
     return ret;
 }
 
+/*
+ * Deletes the rule with kernel handle @handle. Handles stay the same for the
+ * lifetime of a rule, so the chain does not need to be dumped first, the
+ * kernel reports a rule that does not exist (anymore) when committing.
+ */
+int nft_rule_delete_handle(struct nft_handle *h, const char *chain,
+                           const char *table, uint64_t handle, bool verbose) {
+    struct nftnl_rule *r;
+
+    nft_fn = nft_rule_delete_handle;
+
+    r = nftnl_rule_alloc();
+    if (r == NULL) {
+        errno = ENOMEM;
+        return 0;
+    }
+
+    nftnl_rule_set(r, NFTNL_RULE_TABLE, (char *)table);
+    nftnl_rule_set(r, NFTNL_RULE_CHAIN, (char *)chain);
+    nftnl_rule_set_u64(r, NFTNL_RULE_HANDLE, handle);
+
+    DEBUGP("deleting rule with handle=%" PRIu64 "\n", handle);
+    if (batch_rule_add(h, NFT_COMPAT_RULE_DELETE, r) < 0) {
+        nftnl_rule_free(r);
+        errno = ENOMEM;
+        return 0;
+    }
+
+    flush_rule_cache(h);
+    return 1;
+}
+
+/* Replaces the rule with kernel handle @handle, see nft_rule_delete_handle */
+int nft_rule_replace_handle(struct nft_handle *h, const char *chain,
+                            const char *table, void *data, uint64_t handle,
+                            bool verbose) {
+    nft_fn = nft_rule_replace_handle;
+
+    DEBUGP("replacing rule with handle=%" PRIu64 "\n", handle);
+    return nft_rule_append(h, chain, table, data, handle, verbose);
+}
+
 static int nft_rule_add(struct nft_handle *h, const char *chain,
                         const char *table, struct iptables_command_state *cs,
                         uint64_t handle, bool verbose) {
     struct nftnl_rule *r;
+    uint32_t len;
+    void *nla;
+
+    nla = nft_rule_encode(h, chain, table, cs, 0, handle, &len);
+    if (nla != NULL) {
+        if (batch_nla_add(h, NFT_COMPAT_RULE_INSERT, nla, len) < 0)
+            return 0;
+
+        flush_rule_cache(h);
+        return 1;
+    }
 
     r = nft_rule_new(h, chain, table, cs);
     if (r == NULL)
@@ -1810,9 +3345,9 @@ static int nft_rule_add(struct nft_handle *h, const char *chain,
 
 int nft_rule_insert(struct nft_handle *h, const char *chain, const char *table,
                     void *data, int rulenum, bool verbose) {
-    struct nftnl_rule_list *list;
-    struct nftnl_rule *r;
+    struct nft_cache_chain *c;
     uint64_t handle = 0;
+    int pos;
 
     /* If built-in chains don't exist for this table, create them */
     if (nft_xtables_config_load(h, XTABLES_CONFIG_DEFAULT, 0) < 0)
@@ -1821,17 +3356,16 @@ int nft_rule_insert(struct nft_handle *h, const char *chain, const char *table,
     nft_fn = nft_rule_insert;
 
     if (rulenum > 0) {
-        list = nft_rule_list_get(h);
-        if (list == NULL)
+        c = nft_rule_cache_get_chain(h, table, chain);
+        if (c == NULL)
             goto err;
 
-        r = nft_rule_find(h, list, chain, table, data, rulenum);
-        if (r == NULL) {
+        pos = nft_rule_find(h, c, data, rulenum);
+        if (pos < 0) {
             /* special case: iptables allows to insert into
              * rule_count + 1 position.
              */
-            r = nft_rule_find(h, list, chain, table, data, rulenum - 1);
-            if (r != NULL) {
+            if (nft_rule_find(h, c, data, rulenum - 1) >= 0) {
                 flush_rule_cache(h);
                 return nft_rule_append(h, chain, table, data, 0, verbose);
             }
@@ -1840,7 +3374,7 @@ int nft_rule_insert(struct nft_handle *h, const char *chain, const char *table,
             goto err;
         }
 
-        handle = nftnl_rule_get_u64(r, NFTNL_RULE_HANDLE);
+        handle = nftnl_rule_get_u64(c->rules[pos], NFTNL_RULE_HANDLE);
         DEBUGP("adding after rule handle %" PRIu64 "\n", handle);
 
         flush_rule_cache(h);
@@ -1854,22 +3388,21 @@ err:
 
 int nft_rule_delete_num(struct nft_handle *h, const char *chain,
                         const char *table, int rulenum, bool verbose) {
-    int ret = 0;
-    struct nftnl_rule *r;
-    struct nftnl_rule_list *list;
+    int ret = 0, pos;
+    struct nft_cache_chain *c;
 
     nft_fn = nft_rule_delete_num;
 
-    list = nft_rule_list_get(h);
-    if (list == NULL)
+    c = nft_rule_cache_get_chain(h, table, chain);
+    if (c == NULL)
         return 0;
 
-    r = nft_rule_find(h, list, chain, table, NULL, rulenum);
-    if (r != NULL) {
+    pos = nft_rule_find(h, c, NULL, rulenum);
+    if (pos >= 0) {
         ret = 1;
 
         DEBUGP("deleting rule by number %d\n", rulenum);
-        ret = __nft_rule_del(h, list, r);
+        ret = __nft_rule_del(h, c, pos);
         if (ret < 0)
             errno = ENOMEM;
     } else
@@ -1882,18 +3415,19 @@ int nft_rule_delete_num(struct nft_handle *h, const char *chain,
 
 int nft_rule_replace(struct nft_handle *h, const char *chain, const char *table,
                      void *data, int rulenum, bool verbose) {
-    int ret = 0;
+    int ret = 0, pos;
     struct nftnl_rule *r;
-    struct nftnl_rule_list *list;
+    struct nft_cache_chain *c;
 
     nft_fn = nft_rule_replace;
 
-    list = nft_rule_list_get(h);
-    if (list == NULL)
+    c = nft_rule_cache_get_chain(h, table, chain);
+    if (c == NULL)
         return 0;
 
-    r = nft_rule_find(h, list, chain, table, data, rulenum);
-    if (r != NULL) {
+    pos = nft_rule_find(h, c, data, rulenum);
+    if (pos >= 0) {
+        r = c->rules[pos];
         DEBUGP("replacing rule with handle=%llu\n",
                (unsigned long long)nftnl_rule_get_u64(r, NFTNL_RULE_HANDLE));
 
@@ -1908,49 +3442,44 @@ int nft_rule_replace(struct nft_handle *h, const char *chain, const char *table,
     return ret;
 }
 
+static void list_print(struct nft_handle *h, struct nftnl_rule *r,
+                       unsigned int num, unsigned int format) {
+    struct nft_family_ops *ops = nft_family_ops_lookup(h->family);
+
+    if (!(format & FMT_HANDLES)) {
+        ops->print_firewall(r, num, format);
+        return;
+    }
+
+    ops->print_firewall(r, num, format | FMT_NONEWLINE);
+    printf(" /* handle %" PRIu64 " */\n",
+           nftnl_rule_get_u64(r, NFTNL_RULE_HANDLE));
+}
+
 static int __nft_rule_list(struct nft_handle *h, const char *chain,
                            const char *table, int rulenum, unsigned int format,
-                           void (*cb)(struct nftnl_rule *r, unsigned int num,
+                           void (*cb)(struct nft_handle *h,
+                                      struct nftnl_rule *r, unsigned int num,
                                       unsigned int format)) {
-    struct nftnl_rule_list *list;
-    struct nftnl_rule_list_iter *iter;
-    struct nftnl_rule *r;
-    int rule_ctr = 0, ret = 0;
+    struct nft_cache_chain *c;
+    unsigned int i;
+    int ret = 0;
 
-    list = nft_rule_list_get(h);
-    if (list == NULL)
+    c = nft_rule_cache_get_chain(h, table, chain);
+    if (c == NULL)
         return 0;
 
-    iter = nftnl_rule_list_iter_create(list);
-    if (iter == NULL)
-        goto err;
-
-    r = nftnl_rule_list_iter_next(iter);
-    while (r != NULL) {
-        const char *rule_table = nftnl_rule_get_str(r, NFTNL_RULE_TABLE);
-        const char *rule_chain = nftnl_rule_get_str(r, NFTNL_RULE_CHAIN);
-
-        if (strcmp(table, rule_table) != 0 || strcmp(chain, rule_chain) != 0)
-            goto next;
-
-        rule_ctr++;
-
-        if (rulenum > 0 && rule_ctr != rulenum) {
-            /* List by rule number case */
-            goto next;
-        }
-
-        cb(r, rule_ctr, format);
-        if (rulenum > 0 && rule_ctr == rulenum) {
+    if (rulenum > 0) {
+        /* List by rule number case */
+        if ((unsigned int)rulenum <= c->num_rules) {
+            cb(h, c->rules[rulenum - 1], rulenum, format);
             ret = 1;
-            break;
         }
-
-    next:
-        r = nftnl_rule_list_iter_next(iter);
+        goto err;
     }
 
-    nftnl_rule_list_iter_destroy(iter);
+    for (i = 0; i < c->num_rules; i++)
+        cb(h, c->rules[i], i + 1, format);
 err:
     if (ret == 0)
         errno = ENOENT;
@@ -1979,10 +3508,14 @@ int nft_rule_list(struct nft_handle *h, const char *chain, const char *table,
     ops = nft_family_ops_lookup(h->family);
 
     if (chain && rulenum) {
-        __nft_rule_list(h, chain, table, rulenum, format, ops->print_firewall);
+        __nft_rule_list(h, chain, table, rulenum, format, list_print);
         return 1;
     }
 
+    /* listing every chain, fetch all rules in one go */
+    if (chain == NULL)
+        nft_rule_cache_get(h);
+
     list = nft_chain_dump(h);
 
     iter = nftnl_chain_list_iter_create(list);
@@ -2018,8 +3551,7 @@ int nft_rule_list(struct nft_handle *h, const char *chain, const char *table,
         ops->print_header(format, chain_name, policy_name[policy], &ctrs,
                           basechain, refs);
 
-        __nft_rule_list(h, chain_name, table, rulenum, format,
-                        ops->print_firewall);
+        __nft_rule_list(h, chain_name, table, rulenum, format, list_print);
 
         /* we printed the chain we wanted, stop processing. */
         if (chain)
@@ -2033,18 +3565,20 @@ int nft_rule_list(struct nft_handle *h, const char *chain, const char *table,
 
     nftnl_chain_list_iter_destroy(iter);
 err:
-    nftnl_chain_list_free(list);
+    nft_chain_list_free(list);
 
     return 1;
 }
 
-static void list_save(struct nftnl_rule *r, unsigned int num,
-                      unsigned int format) {
+static void list_save(struct nft_handle *h, struct nftnl_rule *r,
+                      unsigned int num, unsigned int format) {
     struct iptables_command_state cs = {};
 
     nft_rule_to_iptables_command_state(r, &cs);
 
-    nft_rule_print_save(&cs, r, NFT_RULE_APPEND, !(format & FMT_NOCOUNTS));
+    /* listing still shows the rule, with the set names, see save_addr_set() */
+    if (nft_rule_save_sets(h, &cs, r, !(format & FMT_NOCOUNTS)) < 0)
+        nft_rule_print_save(&cs, r, NFT_RULE_APPEND, !(format & FMT_NOCOUNTS));
 }
 
 static int nftnl_rule_list_chain_save(struct nft_handle *h, const char *chain,
@@ -2097,6 +3631,10 @@ int nft_rule_list_save(struct nft_handle *h, const char *chain,
     struct nftnl_chain *c;
     int ret = 1;
 
+    /* saving every chain, fetch all rules in one go */
+    if (chain == NULL)
+        nft_rule_cache_get(h);
+
     list = nft_chain_dump(h);
 
     /* Dump policies and custom chains first */
@@ -2130,7 +3668,7 @@ int nft_rule_list_save(struct nft_handle *h, const char *chain,
 
     nftnl_chain_list_iter_destroy(iter);
 err:
-    nftnl_chain_list_free(list);
+    nft_chain_list_free(list);
 
     return ret;
 }
@@ -2138,22 +3676,23 @@ err:
 int nft_rule_zero_counters(struct nft_handle *h, const char *chain,
                            const char *table, int rulenum) {
     struct iptables_command_state cs = {};
-    struct nftnl_rule_list *list;
+    struct nft_cache_chain *c;
     struct nftnl_rule *r;
-    int ret = 0;
+    int ret = 0, pos;
 
     nft_fn = nft_rule_delete;
 
-    list = nft_rule_list_get(h);
-    if (list == NULL)
+    c = nft_rule_cache_get_chain(h, table, chain);
+    if (c == NULL)
         return 0;
 
-    r = nft_rule_find(h, list, chain, table, NULL, rulenum);
-    if (r == NULL) {
+    pos = nft_rule_find(h, c, NULL, rulenum);
+    if (pos < 0) {
         errno = ENOENT;
         ret = 1;
         goto error;
     }
+    r = c->rules[pos];
 
     nft_rule_to_iptables_command_state(r, &cs);
 
@@ -2191,26 +3730,68 @@ static void nft_compat_chain_batch_add(struct nft_handle *h, uint16_t type,
     nftnl_chain_free(chain);
 }
 
+/*
+ * libmnl only notices a message overran the page once it is written, which
+ * the page slack covers for small messages only. Encoded attributes have a
+ * known length, so they start a new page right away if they don't fit.
+ */
+static void nft_batch_room(struct nft_handle *h, uint32_t len) {
+    len += MNL_NLMSG_HDRLEN + MNL_ALIGN(sizeof(struct nfgenmsg));
+    if (!mnl_nlmsg_batch_is_empty(h->batch) &&
+        mnl_nlmsg_batch_size(h->batch) + len > BATCH_PAGE_SIZE)
+        h->batch = mnl_nftnl_batch_page_add(h->batch);
+}
+
 static void nft_compat_rule_batch_add(struct nft_handle *h, uint16_t type,
                                       uint16_t flags, uint32_t seq,
-                                      struct nftnl_rule *rule) {
+                                      struct obj_update *n) {
     struct nlmsghdr *nlh;
 
+    if (n->len > 0)
+        nft_batch_room(h, n->len);
+
     nlh = nftnl_rule_nlmsg_build_hdr(mnl_nlmsg_batch_current(h->batch), type,
                                      h->family, flags, seq);
-    nftnl_rule_nlmsg_build_payload(nlh, rule);
-    nft_rule_print_debug(rule, nlh);
-    nftnl_rule_free(rule);
+    if (n->len > 0) {
+        memcpy(mnl_nlmsg_get_payload_tail(nlh), n->ptr, n->len);
+        nlh->nlmsg_len += n->len;
+        return;
+    }
+
+    nftnl_rule_nlmsg_build_payload(nlh, n->rule);
+    nft_rule_print_debug(n->rule, nlh);
+    nftnl_rule_free(n->rule);
+}
+
+/* Sets are only ever staged as encoded attributes, see nft_addr_set_add() */
+static void nft_compat_set_batch_add(struct nft_handle *h, uint16_t type,
+                                     uint16_t flags, uint32_t seq,
+                                     struct obj_update *n) {
+    struct nlmsghdr *nlh;
+
+    nft_batch_room(h, n->len);
+    nlh = nftnl_set_nlmsg_build_hdr(mnl_nlmsg_batch_current(h->batch), type,
+                                    h->family, flags, seq);
+    memcpy(mnl_nlmsg_get_payload_tail(nlh), n->ptr, n->len);
+    nlh->nlmsg_len += n->len;
 }
 
 static int nft_action(struct nft_handle *h, int action) {
     struct obj_update *n, *tmp;
-    uint32_t seq = 1;
+    uint32_t seq = 1, err_seq = 0;
+    uint32_t *lines;
     int ret = 0;
 
+    /* input line of each message, by sequence number */
+    lines = calloc(h->obj_list_num + 3, sizeof(*lines));
+    h->err_line = 0;
+
     mnl_nftnl_batch_begin(h->batch, seq++);
 
     list_for_each_entry_safe(n, tmp, &h->obj_list, head) {
+        if (lines != NULL)
+            lines[seq] = n->line;
+
         switch (n->type) {
         case NFT_COMPAT_TABLE_ADD:
             nft_compat_table_batch_add(h, NFT_MSG_NEWTABLE, NLM_F_CREATE, seq++,
@@ -2237,27 +3818,32 @@ static int nft_action(struct nft_handle *h, int action) {
             break;
         case NFT_COMPAT_RULE_APPEND:
             nft_compat_rule_batch_add(h, NFT_MSG_NEWRULE,
-                                      NLM_F_CREATE | NLM_F_APPEND, seq++,
-                                      n->rule);
+                                      NLM_F_CREATE | NLM_F_APPEND, seq++, n);
             break;
         case NFT_COMPAT_RULE_INSERT:
             nft_compat_rule_batch_add(h, NFT_MSG_NEWRULE, NLM_F_CREATE, seq++,
-                                      n->rule);
+                                      n);
             break;
         case NFT_COMPAT_RULE_REPLACE:
             nft_compat_rule_batch_add(h, NFT_MSG_NEWRULE,
-                                      NLM_F_CREATE | NLM_F_REPLACE, seq++,
-                                      n->rule);
+                                      NLM_F_CREATE | NLM_F_REPLACE, seq++, n);
             break;
         case NFT_COMPAT_RULE_DELETE:
         case NFT_COMPAT_RULE_FLUSH:
-            nft_compat_rule_batch_add(h, NFT_MSG_DELRULE, 0, seq++, n->rule);
+            nft_compat_rule_batch_add(h, NFT_MSG_DELRULE, 0, seq++, n);
+            break;
+        case NFT_COMPAT_SET_ADD:
+            nft_compat_set_batch_add(h, NFT_MSG_NEWSET, NLM_F_CREATE, seq++,
+                                     n);
+            break;
+        case NFT_COMPAT_SET_ELEM_ADD:
+            nft_compat_set_batch_add(h, NFT_MSG_NEWSETELEM, NLM_F_CREATE,
+                                     seq++, n);
             break;
         }
 
         h->obj_list_num--;
         list_del(&n->head);
-        free(n);
 
         if (!mnl_nlmsg_batch_next(h->batch))
             h->batch = mnl_nftnl_batch_page_add(h->batch);
@@ -2274,10 +3860,20 @@ static int nft_action(struct nft_handle *h, int action) {
     if (!mnl_nlmsg_batch_is_empty(h->batch))
         h->batch = mnl_nftnl_batch_page_add(h->batch);
 
-    ret = mnl_nftnl_batch_talk(h);
+    obj_arena_release(h, false);
+
+    ret = mnl_nftnl_batch_talk(h, seq, &err_seq);
+    if (ret < 0 && lines != NULL && err_seq > 0 && err_seq < seq)
+        h->err_line = lines[err_seq];
+    free(lines);
 
     mnl_nlmsg_batch_reset(h->batch);
 
+    /* a dropped batch took the built-in tables and chains with it */
+    if (ret < 0 || action == NFT_COMPAT_ABORT)
+        nft_table_builtin_reset(h);
+    flush_rule_cache(h);
+
     return ret == 0 ? 1 : 0;
 }
 
@@ -2359,6 +3955,8 @@ const char *nft_strerror(int err) {
          "Bad rule (does a matching rule exist in that chain?)"},
         {nft_rule_replace, ENOENT, "Index of replacement too big"},
         {nft_rule_delete_num, E2BIG, "Index of deletion too big"},
+        {nft_rule_delete_handle, ENOENT, "No rule with that handle in chain"},
+        {nft_rule_replace_handle, ENOENT, "No rule with that handle in chain"},
         /*	    { TC_READ_COUNTER, E2BIG, "Index of counter too big" },
                     { TC_ZERO_COUNTER, E2BIG, "Index of counter too big" }, */
         {nft_rule_add, ELOOP, "Loop found in table"},
@@ -2485,13 +4083,13 @@ int nft_xtables_config_load(struct nft_handle *h, const char *filename,
             (char *)nftnl_chain_get(chain, NFTNL_CHAIN_TABLE));
     }
     nftnl_chain_list_iter_destroy(citer);
-    nftnl_chain_list_free(chain_list);
+    nft_chain_list_free(chain_list);
 
     return 0;
 
 err:
     nftnl_table_list_free(table_list);
-    nftnl_chain_list_free(chain_list);
+    nft_chain_list_free(chain_list);
 
     if (titer != NULL)
         nftnl_table_list_iter_destroy(titer);
@@ -2551,7 +4149,7 @@ int nft_chain_zero_counters(struct nft_handle *h, const char *chain,
     }
 
     if (!h->batch_support)
-        nftnl_chain_list_free(list);
+        nft_chain_list_free(list);
 
     nftnl_chain_list_iter_destroy(iter);
 
@@ -2567,11 +4165,11 @@ uint32_t nft_invflags2cmp(uint32_t invflags, uint32_t flag) {
     return NFT_CMP_EQ;
 }
 
-#define NFT_COMPAT_EXPR_MAX 8
+#define NFT_COMPAT_EXPR_MAX 9
 
 static const char *supported_exprs[NFT_COMPAT_EXPR_MAX] = {
-    "match", "target",  "payload", "meta",
-    "cmp",   "bitwise", "counter", "immediate"};
+    "match",   "target",  "payload",   "meta",  "cmp",
+    "bitwise", "counter", "immediate", "lookup"};
 
 static int nft_is_expr_compatible(const char *name) {
     int i;
@@ -2663,7 +4261,7 @@ static int nft_are_chains_compatible(struct nft_handle *h) {
     }
 
     nftnl_chain_list_iter_destroy(iter);
-    nftnl_chain_list_free(list);
+    nft_chain_list_free(list);
     return ret;
 }
 
@@ -2712,9 +4310,10 @@ static int nft_are_tables_compatible(struct nft_handle *h) {
 
 int nft_is_ruleset_compatible(struct nft_handle *h) {
 
-    struct nftnl_rule_list *list;
-    struct nftnl_rule_list_iter *iter;
-    struct nftnl_rule *rule;
+    struct nft_rule_cache *rc;
+    struct nft_cache_table *t;
+    struct nft_cache_chain *c;
+    unsigned int i;
     int ret = 0;
 
     ret = nft_are_tables_compatible(h);
@@ -2725,23 +4324,18 @@ int nft_is_ruleset_compatible(struct nft_handle *h) {
     if (ret != 0)
         return ret;
 
-    list = nft_rule_list_get(h);
-    if (list == NULL)
-        return -1;
-
-    iter = nftnl_rule_list_iter_create(list);
-    if (iter == NULL)
+    rc = nft_rule_cache_get(h);
+    if (rc == NULL)
         return -1;
 
-    rule = nftnl_rule_list_iter_next(iter);
-    while (rule != NULL) {
-        ret = nft_is_rule_compatible(rule);
-        if (ret != 0)
-            break;
-
-        rule = nftnl_rule_list_iter_next(iter);
+    list_for_each_entry(t, &rc->tables, head) {
+        list_for_each_entry(c, &t->chains, head) {
+            for (i = 0; i < c->num_rules; i++) {
+                ret = nft_is_rule_compatible(c->rules[i]);
+                if (ret != 0)
+                    return ret;
+            }
+        }
     }
-
-    nftnl_rule_list_iter_destroy(iter);
     return ret;
 }
@@ -32,12 +32,16 @@ struct nft_handle {
 	uint32_t		seq;
 	struct list_head	obj_list;
 	int			obj_list_num;
+	struct list_head	obj_blocks;	/* backs obj_list entries */
 	struct mnl_nlmsg_batch	*batch;
 	struct nft_family_ops	*ops;
 	struct builtin_table	*tables;
-	struct nftnl_rule_list	*rule_cache;
+	struct nft_rule_cache	*rule_cache;
 	bool			restore;
 	bool			batch_support;
+	uint32_t		line;		/* input line being staged */
+	uint32_t		err_line;	/* input line the kernel rejected */
+	uint32_t		set_id;		/* last set staged */
 };
 
 extern struct builtin_table xtables_ipv4[TABLES_MAX];
@@ -70,6 +74,8 @@ int nft_chain_add(struct nft_handle *h, struct nftnl_chain *c, uint16_t flags);
 int nft_chain_set(struct nft_handle *h, const char *table, const char *chain, const char *policy, const struct xt_counters *counters);
 struct nftnl_chain_list *nft_chain_dump(struct nft_handle *h);
 struct nftnl_chain *nft_chain_list_find(struct nftnl_chain_list *list, const char *table, const char *chain);
+void nft_chain_list_del(struct nftnl_chain_list *list, struct nftnl_chain *c);
+void nft_chain_list_free(struct nftnl_chain_list *list);
 int nft_chain_save(struct nft_handle *h, struct nftnl_chain_list *list, const char *table);
 int nft_chain_user_add(struct nft_handle *h, const char *chain, const char *table);
 int nft_chain_user_del(struct nft_handle *h, const char *chain, const char *table);
@@ -87,12 +93,22 @@ int nft_rule_check(struct nft_handle *h, const char *chain, const char *table, v
 int nft_rule_delete(struct nft_handle *h, const char *chain, const char *table, void *data, bool verbose);
 int nft_rule_delete_num(struct nft_handle *h, const char *chain, const char *table, int rulenum, bool verbose);
 int nft_rule_replace(struct nft_handle *h, const char *chain, const char *table, void *data, int rulenum, bool verbose);
+int nft_rule_delete_handle(struct nft_handle *h, const char *chain, const char *table, uint64_t handle, bool verbose);
+int nft_rule_replace_handle(struct nft_handle *h, const char *chain, const char *table, void *data, uint64_t handle, bool verbose);
 int nft_rule_list(struct nft_handle *h, const char *chain, const char *table, int rulenum, unsigned int format);
 int nft_rule_list_save(struct nft_handle *h, const char *chain, const char *table, int rulenum, int counters);
 int nft_rule_save(struct nft_handle *h, const char *table, bool counters);
 int nft_rule_flush(struct nft_handle *h, const char *chain, const char *table);
 int nft_rule_zero_counters(struct nft_handle *h, const char *chain, const char *table, int rulenum);
 
+/*
+ * Address sets, used for -s/-d lists of at least NFT_ADDR_SET_MIN entries
+ */
+#define NFT_ADDR_SET_MIN	8
+
+int nft_addr_set_add(struct nft_handle *h, const char *table, const struct addr_mask *am, struct xt_addr_set *set);
+int nft_addr_set_spec(struct nft_handle *h, const struct addr_mask *am, struct xt_addr_set *set);
+
 /*
  * Operations used in userspace tools
  */
@@ -105,6 +121,15 @@ int add_action(struct nftnl_rule *r, struct iptables_command_state *cs, bool got
 int add_comment(struct nftnl_rule *r, const char *comment);
 char *get_comment(const void *data, uint32_t data_len);
 
+/*
+ * Direct netlink encoding of the above, see struct nft_rule_enc
+ */
+void enc_counters(struct nft_rule_enc *e, uint64_t packets, uint64_t bytes);
+void enc_match(struct nft_rule_enc *e, struct xt_entry_match *m);
+void enc_target(struct nft_rule_enc *e, struct xt_entry_target *t);
+void enc_action(struct nft_rule_enc *e, struct iptables_command_state *cs, bool goto_set);
+void enc_comment(struct nft_rule_enc *e, const char *comment);
+
 enum nft_rule_print {
 	NFT_RULE_APPEND,
 	NFT_RULE_DEL,
@@ -121,6 +146,8 @@ uint32_t nft_invflags2cmp(uint32_t invflags, uint32_t flag);
  */
 int nft_commit(struct nft_handle *h);
 int nft_abort(struct nft_handle *h);
+void nft_batch_drop(struct nft_handle *h, unsigned int num);
+void flush_rule_cache(struct nft_handle *h);
 
 /*
  * revision compatibility.
@@ -134,6 +161,7 @@ const char *nft_strerror(int err);
 
 /* For xtables.c */
 int do_commandx(struct nft_handle *h, int argc, char *argv[], char **table, bool restore);
+int xtables_daemon(struct nft_handle *h, int argc, char *argv[]);
 /* For xtables-arptables.c */
 int do_commandarp(struct nft_handle *h, int argc, char *argv[], char **table);
 /* For xtables-eb.c */
@@ -6,6 +6,7 @@
 #include <libgen.h>
 #include <math.h>
 #include <netdb.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -15,6 +16,7 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <xtables.h>
 
@@ -318,3 +320,83 @@ void parse_wait_interval(int argc, char *argv[],
 inline bool xs_has_arg(int argc, char *argv[]) {
     return optind < argc && argv[optind][0] != '-' && argv[optind][0] != '!';
 }
+
+static FILE *xs_tmpfile(void) {
+    FILE *f = tmpfile();
+
+    if (f == NULL)
+        xtables_error(RESOURCE_PROBLEM, "can't create temporary file: %s",
+                      strerror(errno));
+    return f;
+}
+
+static void xs_replay(FILE *from, FILE *to) {
+    char buf[4096];
+    size_t n;
+
+    rewind(from);
+    while ((n = fread(buf, 1, sizeof(buf), from)) > 0)
+        fwrite(buf, 1, n, to);
+    fflush(to);
+}
+
+void xs_restore_jobs(unsigned int jobs, unsigned int nlines,
+                     void (*parse)(unsigned int first, unsigned int last,
+                                   FILE *out),
+                     void (*merge)(FILE *in)) {
+    struct {
+        pid_t pid;
+        FILE *data, *out, *err;
+    } *job;
+    unsigned int i, j, first = 0;
+    int status;
+
+    job = xtables_calloc(jobs, sizeof(*job));
+
+    /* don't let children write out what is still buffered */
+    fflush(stdout);
+    fflush(stderr);
+
+    for (i = 0; i < jobs; i++) {
+        unsigned int last = (unsigned long long)nlines * (i + 1) / jobs;
+
+        job[i].data = xs_tmpfile();
+        job[i].out = xs_tmpfile();
+        job[i].err = xs_tmpfile();
+
+        job[i].pid = fork();
+        if (job[i].pid < 0)
+            xtables_error(RESOURCE_PROBLEM, "fork: %s", strerror(errno));
+        if (job[i].pid == 0) {
+            dup2(fileno(job[i].out), STDOUT_FILENO);
+            dup2(fileno(job[i].err), STDERR_FILENO);
+            parse(first, last, job[i].data);
+            fflush(NULL);
+            _exit(0);
+        }
+        first = last;
+    }
+
+    for (i = 0; i < jobs; i++) {
+        if (waitpid(job[i].pid, &status, 0) < 0)
+            xtables_error(OTHER_PROBLEM, "waitpid: %s", strerror(errno));
+
+        xs_replay(job[i].out, stdout);
+        xs_replay(job[i].err, stderr);
+
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            /* later runs don't matter anymore */
+            for (j = i + 1; j < jobs; j++)
+                kill(job[j].pid, SIGKILL);
+            exit(WIFEXITED(status) ? WEXITSTATUS(status) : OTHER_PROBLEM);
+        }
+
+        rewind(job[i].data);
+        merge(job[i].data);
+
+        fclose(job[i].data);
+        fclose(job[i].out);
+        fclose(job[i].err);
+    }
+    free(job);
+}
@@ -4,6 +4,7 @@
 #include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <netinet/in.h>
 #include <net/if.h>
 #include <linux/netfilter_ipv4/ip_tables.h>
@@ -48,6 +49,18 @@ struct xtables_afinfo {
 	int so_rev_target;
 };
 
+/*
+ * nft: -s/-d address list kept in a set rather than one rule per address.
+ * @name:	set name, "__set%d" until the kernel assigns one
+ * @id:		identifies the set in the transaction that adds it
+ * @list:	comma separated prefixes, only filled in to save the rule
+ */
+struct xt_addr_set {
+	char name[32];
+	uint32_t id;
+	char *list;
+};
+
 struct iptables_command_state {
 	union {
 		struct ipt_entry fw;
@@ -64,6 +77,7 @@ struct iptables_command_state {
 	const char *jumpto;
 	char **argv;
 	bool restore;
+	struct xt_addr_set src_set, dst_set;
 };
 
 typedef int (*mainfunc_t)(int, char **);
@@ -113,6 +127,23 @@ int parse_wait_time(int argc, char *argv[]);
 void parse_wait_interval(int argc, char *argv[], struct timeval *wait_interval);
 bool xs_has_arg(int argc, char *argv[]);
 
+/**
+ * xs_restore_jobs - parse restore input in child processes
+ * @jobs:	number of child processes
+ * @nlines:	number of lines, split into @jobs runs of consecutive lines
+ * @parse:	called in the child for lines [@first, @last), writes its
+ *		result to @out
+ * @merge:	called in the parent for the result of each run, in order
+ *
+ * Extensions keep their parsing state in globals, so lines can't be
+ * parsed by threads sharing them.  Output and exit status of the children
+ * are replayed in input order: the first failing run ends the program
+ * just like a serial run would.
+ */
+extern void xs_restore_jobs(unsigned int jobs, unsigned int nlines,
+	void (*parse)(unsigned int first, unsigned int last, FILE *out),
+	void (*merge)(FILE *in));
+
 extern const struct xtables_afinfo *afinfo;
 
 #endif /* IPTABLES_XSHARED_H */
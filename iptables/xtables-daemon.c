@@ -0,0 +1,419 @@
+/* Command stream mode: one process serving many iptables commands.
+ *
+ * This code is distributed under the terms of GNU GPL v2
+ */
+
+#include "nft-shared.h"
+#include "nft.h"
+#include "xtables-multi.h"
+#include "xtables.h"
+#include <errno.h>
+#include <getopt.h>
+#include <iptables.h>
+#include <poll.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Every line read from stdin is one command, written as on the command line
+ * without the program name, for instance "-A INPUT -s 10.0.0.1 -j DROP".
+ * Each command gets one reply line on stdout, "OK" or "ERR <message>", in
+ * the order the commands came in. Output of the command itself, say of -L,
+ * comes before its reply.
+ *
+ * Commands are staged in the batch of the one nft handle, which is
+ * committed once the window since the first staged command has passed, or
+ * the batch is full. Their replies wait for that commit. If the
+ * kernel rejects the batch, the command it names fails alone and the other
+ * ones are staged and committed again. A command that fails before that
+ * takes back whatever it staged.
+ *
+ * Only -A, -I without a rule number, -N and -P are staged behind others.
+ * Everything else looks up rules or chains in the ruleset as the kernel has
+ * it, which would miss what is staged, so whatever is staged is committed
+ * before they run.
+ */
+#define DAEMON_WINDOW_MS 10
+#define DAEMON_BATCH_MAX 256
+#define DAEMON_LINE_MAX 10240
+
+struct daemon_cmd {
+    char *text;
+    char *err; /* reply message if the command failed */
+    bool staged;
+};
+
+static struct daemon_cmd daemon_cmds[DAEMON_BATCH_MAX];
+static unsigned int daemon_num_cmds, daemon_num_staged;
+
+static jmp_buf daemon_jmp;
+static char daemon_err[1024];
+
+/* parse state of the running command, freed even if it bails out */
+static struct iptables_command_state daemon_cs;
+static struct xtables_args daemon_args;
+
+static const struct option daemon_opts[] = {
+    {.name = "daemon", .has_arg = false, .val = 'D'},
+    {.name = "window", .has_arg = true, .val = 'w'},
+    {.name = "batch", .has_arg = true, .val = 'b'},
+    {NULL},
+};
+
+/* Replaces xtables_exit_error(), a bad command must not end the daemon */
+static void __attribute__((noreturn))
+daemon_exit_error(enum xtables_exittype status, const char *msg, ...) {
+    va_list args;
+    size_t len;
+
+    va_start(args, msg);
+    vsnprintf(daemon_err, sizeof(daemon_err), msg, args);
+    va_end(args);
+
+    len = strlen(daemon_err);
+    while (len > 0 && daemon_err[len - 1] == '\n')
+        daemon_err[--len] = '\0';
+
+    longjmp(daemon_jmp, status);
+}
+
+/* Tells whether -I or --insert at @i is given a rule number */
+static bool daemon_insert_num(int argc, char *argv[], int i, bool glued) {
+    i += glued ? 1 : 2;
+    return i < argc && argv[i][0] != '-' && argv[i][0] != '!';
+}
+
+/* Notes what option @opt at @i does, see daemon_cmd_reads() */
+static void daemon_opt(int argc, char *argv[], int i, int opt, bool glued,
+                       bool *reads, bool *exits) {
+    if (strchr("LSCDRFZXE", opt))
+        *reads = true;
+    else if (opt == 'I')
+        *reads |= daemon_insert_num(argc, argv, i, glued);
+    else if (opt == 'h' || opt == 'V')
+        *exits = true;
+}
+
+/*
+ * Same for the long option at @i. Like getopt_long(), it takes any prefix
+ * of the name; if that is not unique, getopt_long() rejects it later, and
+ * until then it counts as each option it may stand for.
+ */
+static void daemon_long_opt(int argc, char *argv[], int i, bool *reads,
+                            bool *exits) {
+    const struct option *o = xtables_globals.orig_opts;
+    const char *name = argv[i] + 2;
+    size_t len = strcspn(name, "=");
+    bool glued = name[len] == '=';
+
+    for (; o->name != NULL; o++) {
+        if (strncmp(o->name, name, len) == 0 && o->name[len] == '\0') {
+            daemon_opt(argc, argv, i, o->val, glued, reads, exits);
+            return;
+        }
+    }
+    for (o = xtables_globals.orig_opts; o->name != NULL; o++) {
+        if (strncmp(o->name, name, len) == 0)
+            daemon_opt(argc, argv, i, o->val, glued, reads, exits);
+    }
+}
+
+/*
+ * Scans the options of a command for those that must not be batched: all
+ * commands but -A, -I without a rule number, -N and -P resolve against the
+ * ruleset, -h and -V would exit. Arguments of short options may be glued to
+ * them, as in -jLOG, so scanning a cluster stops at the first option that
+ * takes one.
+ */
+static bool daemon_cmd_reads(int argc, char *argv[], bool *exits) {
+    bool reads = false;
+    const char *c;
+    int i;
+
+    *exits = false;
+    for (i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--", 2) == 0) {
+            bool r = false, x = false;
+
+            daemon_long_opt(argc, argv, i, &r, &x);
+            reads |= r;
+            *exits |= x;
+            continue;
+        }
+        if (argv[i][0] != '-')
+            continue;
+
+        for (c = argv[i] + 1; *c; c++) {
+            daemon_opt(argc, argv, i, *c, c[1] != '\0', &reads, exits);
+            if (strchr("ACDRIMNEPopsdjiwWtmcgLSFZXh", *c))
+                break;
+        }
+    }
+    return reads;
+}
+
+enum daemon_result {
+    DAEMON_DONE,
+    DAEMON_STAGED,
+    DAEMON_WAIT, /* resolves against the ruleset, commit first */
+};
+
+static enum daemon_result daemon_run(struct nft_handle *h, const char *prog,
+                                     struct daemon_cmd *cmd, char *buffer) {
+    int argc, num = h->obj_list_num;
+    char *table = "filter";
+    char **argv;
+    bool exits;
+
+    if (setjmp(daemon_jmp) != 0) {
+        do_commandx_free(h, &daemon_cs, &daemon_args);
+        nft_batch_drop(h, num);
+        cmd->err = strdup(daemon_err);
+        return DAEMON_DONE;
+    }
+
+    argv = xtables_restore_split(prog, buffer, &argc);
+    if (daemon_cmd_reads(argc, argv, &exits) && daemon_num_staged > 0)
+        return DAEMON_WAIT;
+    if (exits) {
+        cmd->err = strdup("option not available in daemon mode");
+        return DAEMON_DONE;
+    }
+
+    /* others may have changed the ruleset since it was last dumped */
+    flush_rule_cache(h);
+
+    memset(&daemon_cs, 0, sizeof(daemon_cs));
+    memset(&daemon_args, 0, sizeof(daemon_args));
+    if (!do_commandx_state(h, argc, argv, &table, false, &daemon_cs,
+                           &daemon_args)) {
+        cmd->err = strdup(nft_strerror(errno));
+        nft_batch_drop(h, num);
+    }
+    fflush(stdout);
+
+    return h->obj_list_num > num ? DAEMON_STAGED : DAEMON_DONE;
+}
+
+static enum daemon_result daemon_stage(struct nft_handle *h, const char *prog,
+                                       unsigned int i) {
+    struct daemon_cmd *cmd = &daemon_cmds[i];
+    char buffer[DAEMON_LINE_MAX + 2];
+    enum daemon_result ret;
+
+    /* staged objects remember the command by its slot, see nft_action() */
+    h->line = i + 1;
+    /* the splitter ends an argument at whitespace, not at the end */
+    snprintf(buffer, sizeof(buffer), "%s\n", cmd->text);
+    ret = daemon_run(h, prog, cmd, buffer);
+    if (ret == DAEMON_STAGED) {
+        cmd->staged = true;
+        daemon_num_staged++;
+    }
+    return ret;
+}
+
+static void daemon_reply(struct daemon_cmd *cmd) {
+    if (cmd->err)
+        printf("ERR %s\n", cmd->err);
+    else
+        printf("OK\n");
+
+    free(cmd->err);
+    free(cmd->text);
+    cmd->err = cmd->text = NULL;
+    cmd->staged = false;
+}
+
+/* Commits the staged commands, then replies to all pending ones */
+static void daemon_flush(struct nft_handle *h, const char *prog) {
+    unsigned int i;
+    uint32_t line;
+
+    while (daemon_num_staged > 0) {
+        if (nft_commit(h))
+            break;
+
+        line = h->err_line;
+        if (line == 0 || line > daemon_num_cmds ||
+            !daemon_cmds[line - 1].staged) {
+            /* no way to tell which one it was, all of them failed */
+            for (i = 0; i < daemon_num_cmds; i++) {
+                if (daemon_cmds[i].staged && daemon_cmds[i].err == NULL)
+                    daemon_cmds[i].err = strdup(nft_strerror(errno));
+            }
+            break;
+        }
+
+        if (daemon_cmds[line - 1].err == NULL)
+            daemon_cmds[line - 1].err = strdup(nft_strerror(errno));
+        daemon_cmds[line - 1].staged = false;
+
+        /* the batch was dropped as a whole, stage the other ones again */
+        daemon_num_staged = 0;
+        for (i = 0; i < daemon_num_cmds; i++) {
+            if (!daemon_cmds[i].staged)
+                continue;
+            daemon_cmds[i].staged = false;
+            daemon_stage(h, prog, i);
+        }
+    }
+
+    for (i = 0; i < daemon_num_cmds; i++)
+        daemon_reply(&daemon_cmds[i]);
+    fflush(stdout);
+
+    daemon_num_cmds = daemon_num_staged = 0;
+}
+
+/* Takes a slot for a command that fails before it is run */
+static void daemon_fail(const char *msg) {
+    struct daemon_cmd *cmd = &daemon_cmds[daemon_num_cmds++];
+
+    cmd->text = NULL;
+    cmd->err = strdup(msg);
+    cmd->staged = false;
+}
+
+static void daemon_command(struct nft_handle *h, const char *prog,
+                           const char *text) {
+    struct daemon_cmd *cmd = &daemon_cmds[daemon_num_cmds];
+
+    cmd->err = NULL;
+    cmd->staged = false;
+    cmd->text = strdup(text);
+    if (cmd->text == NULL) {
+        daemon_fail(strerror(errno));
+        return;
+    }
+
+    if (daemon_stage(h, prog, daemon_num_cmds) == DAEMON_WAIT) {
+        struct daemon_cmd wait = *cmd;
+
+        daemon_flush(h, prog);
+        daemon_cmds[0] = wait;
+        daemon_stage(h, prog, 0);
+    }
+    daemon_num_cmds++;
+}
+
+static long daemon_elapsed_ms(const struct timespec *since) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 +
+           (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+static void __attribute__((noreturn)) daemon_usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s --daemon [--window ms] [--batch commands]\n"
+            "	   [ --window ]	commit ms after the first staged command "
+            "(default %d)\n"
+            "	   [ --batch ]	commit after this many commands "
+            "(default %d)\n",
+            prog, DAEMON_WINDOW_MS, DAEMON_BATCH_MAX);
+    exit(1);
+}
+
+/**
+ * xtables_daemon - serve commands read from stdin on one nft handle
+ *
+ * Returns the exit code once stdin is closed, everything staged by then
+ * is committed and replied to.
+ */
+int xtables_daemon(struct nft_handle *h, int argc, char *argv[]) {
+    void (*exit_err)(enum xtables_exittype status, const char *msg, ...)
+        __attribute__((noreturn, format(printf, 2, 3)));
+    const char *prog = xtables_globals.program_name;
+    unsigned int batch = DAEMON_BATCH_MAX;
+    char buf[DAEMON_LINE_MAX + 1], *nl;
+    struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN};
+    struct timespec first;
+    int window = DAEMON_WINDOW_MS;
+    bool discard = false;
+    size_t len = 0;
+    ssize_t n;
+    int c;
+
+    optind = 0;
+    while ((c = getopt_long(argc, argv, "", daemon_opts, NULL)) != -1) {
+        switch (c) {
+        case 'D':
+            break;
+        case 'w':
+            window = atoi(optarg);
+            if (window < 0)
+                daemon_usage(prog);
+            break;
+        case 'b':
+            batch = atoi(optarg);
+            if (batch == 0 || batch > DAEMON_BATCH_MAX)
+                daemon_usage(prog);
+            break;
+        default:
+            daemon_usage(prog);
+        }
+    }
+    if (optind < argc)
+        daemon_usage(prog);
+
+    exit_err = xtables_globals.exit_err;
+    xtables_globals.exit_err = daemon_exit_error;
+
+    for (;;) {
+        nl = memchr(buf, '\n', len);
+        if (nl != NULL) {
+            *nl = '\0';
+            if (discard)
+                discard = false;
+            else if (buf[0] != '\0' && buf[0] != '#') {
+                if (daemon_num_staged == 0)
+                    clock_gettime(CLOCK_MONOTONIC, &first);
+                daemon_command(h, prog, buf);
+            }
+            len -= nl + 1 - buf;
+            memmove(buf, nl + 1, len);
+        } else if (len == sizeof(buf) - 1) {
+            /* fail the line now, skip the rest of it as it comes in */
+            if (!discard)
+                daemon_fail("line too long");
+            discard = true;
+            len = 0;
+        }
+
+        if (daemon_num_cmds > 0 &&
+            (daemon_num_staged == 0 || daemon_num_cmds >= batch))
+            daemon_flush(h, prog);
+        if (nl != NULL)
+            continue;
+
+        if (daemon_num_staged > 0) {
+            long left = window - daemon_elapsed_ms(&first);
+
+            if (left <= 0 || poll(&pfd, 1, left) == 0) {
+                daemon_flush(h, prog);
+                continue;
+            }
+        }
+
+        n = read(STDIN_FILENO, buf + len, sizeof(buf) - 1 - len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        len += n;
+    }
+
+    daemon_flush(h, prog);
+    xtables_restore_split_free();
+    xtables_globals.exit_err = exit_err;
+
+    return 0;
+}
@@ -94,7 +94,7 @@ static void free_argv(void) {
         free(newargv[i]);
 }
 
-static void add_param_to_argv(char *parsestart) {
+static void add_param_to_argv(char *parsestart, bool table_allowed) {
     int quote_open = 0, escaped = 0, param_len = 0;
     char param_buffer[1024], *curchar;
 
@@ -134,8 +134,8 @@ static void add_param_to_argv(char *parsestart) {
             param_buffer[param_len] = '\0';
 
             /* check if table name specified */
-            if (!strncmp(param_buffer, "-t", 2) ||
-                !strncmp(param_buffer, "--table", 8)) {
+            if (!table_allowed && (!strncmp(param_buffer, "-t", 2) ||
+                                   !strncmp(param_buffer, "--table", 8))) {
                 xtables_error(PARAMETER_PROBLEM,
                               "The -t option (seen in line %u) cannot be "
                               "used in xtables-restore.\n",
@@ -155,6 +155,31 @@ static void add_param_to_argv(char *parsestart) {
     }
 }
 
+/**
+ * xtables_restore_split - split a command line the way restore does
+ * @prog:	program name, becomes argv[0]
+ * @buffer:	the line, modified in place, has to end in whitespace
+ * @argc:	set to the number of arguments
+ *
+ * Used by the daemon mode, which also allows -t. The returned vector
+ * stays valid until the next call, or xtables_restore_split_free().
+ */
+char **xtables_restore_split(const char *prog, char *buffer, int *argc) {
+    free_argv();
+    newargc = 0;
+
+    add_argv((char *)prog);
+    add_param_to_argv(buffer, true);
+
+    *argc = newargc;
+    return newargv;
+}
+
+void xtables_restore_split_free(void) {
+    free_argv();
+    newargc = 0;
+}
+
 static struct nftnl_chain_list *get_chain_list(struct nft_handle *h) {
     struct nftnl_chain_list *chain_list;
 
@@ -174,7 +199,7 @@ static void chain_delete(struct nftnl_chain_list *clist, const char *curtable,
      * on, unvisited chains will be purged out.
      */
     if (chain_obj != NULL)
-        nftnl_chain_list_del(chain_obj);
+        nft_chain_list_del(clist, chain_obj);
 }
 
 struct nft_xt_restore_cb restore_cb = {
@@ -212,6 +237,7 @@ void xtables_restore_parse(struct nft_handle *h, struct nft_xt_restore_parse *p,
         int ret = 0;
 
         line++;
+        h->line = line;
         if (buffer[0] == '\n')
             continue;
         else if (buffer[0] == '#') {
@@ -378,7 +404,7 @@ void xtables_restore_parse(struct nft_handle *h, struct nft_xt_restore_parse *p,
                 add_argv((char *)bcnt);
             }
 
-            add_param_to_argv(parsestart);
+            add_param_to_argv(parsestart, false);
 
             DEBUGP("calling do_command4(%u, argv, &%s, handle):\n", newargc,
                    curtable);
@@ -406,8 +432,9 @@ void xtables_restore_parse(struct nft_handle *h, struct nft_xt_restore_parse *p,
         if (p->tablename && (strcmp(p->tablename, curtable) != 0))
             continue;
         if (!ret) {
+            /* a failed commit names the line the kernel rejected */
             fprintf(stderr, "%s: line %u failed\n", xt_params->program_name,
-                    line);
+                    h->err_line ? h->err_line : line);
             exit(1);
         }
     }
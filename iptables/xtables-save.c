@@ -60,7 +60,12 @@ static int do_output(struct nft_handle *h, const char *tablename,
     /* Dump out chain names first,
      * thereby preventing dependency conflicts */
     nft_chain_save(h, chain_list, tablename);
-    nft_rule_save(h, tablename, counters);
+    if (!nft_rule_save(h, tablename, counters)) {
+        /* no COMMIT, the output must not restore as a complete table */
+        fprintf(stderr, "%s: cannot save table `%s': %s\n",
+                xtables_globals.program_name, tablename, strerror(errno));
+        return 0;
+    }
 
     now = time(NULL);
     printf("COMMIT\n");
@@ -48,6 +48,7 @@ static int xtables_main(int family, const char *progname, int argc,
     };
 
     xtables_globals.program_name = progname;
+    xtables_trace_args(&argc, argv);
     ret = xtables_init_all(&xtables_globals, family);
     if (ret < 0) {
         fprintf(stderr, "%s/%s Failed to initialize xtables\n",
@@ -55,11 +56,16 @@ static int xtables_main(int family, const char *progname, int argc,
         exit(1);
     }
 #if defined(ALL_INCLUSIVE) || defined(NO_SHARED_LIBS)
+    xtables_trace_begin("init_extensions");
     init_extensions();
     init_extensions4();
+    xtables_trace_end();
 #endif
 
-    if (nft_init(&h, xtables_ipv4) < 0) {
+    xtables_trace_begin("nft_init");
+    ret = nft_init(&h, xtables_ipv4);
+    xtables_trace_end();
+    if (ret < 0) {
         fprintf(stderr, "%s/%s Failed to initialize nft: %s\n",
                 xtables_globals.program_name, xtables_globals.program_version,
                 strerror(errno));
@@ -67,9 +73,20 @@ static int xtables_main(int family, const char *progname, int argc,
         exit(EXIT_FAILURE);
     }
 
+    if (argc > 1 && strcmp(argv[1], "--daemon") == 0) {
+        ret = xtables_daemon(&h, argc, argv);
+        nft_fini(&h);
+        exit(ret);
+    }
+
+    xtables_trace_begin("do_command");
     ret = do_commandx(&h, argc, argv, &table, false);
-    if (ret)
+    xtables_trace_end();
+    if (ret) {
+        xtables_trace_begin("commit");
         ret = nft_commit(&h);
+        xtables_trace_end();
+    }
 
     nft_fini(&h);
 
@@ -92,6 +92,8 @@ static struct option original_opts[] = {
     {.name = "version", .has_arg = 0, .val = 'V'},
     {.name = "help", .has_arg = 2, .val = 'h'},
     {.name = "line-numbers", .has_arg = 0, .val = '0'},
+    {.name = "handle", .has_arg = 1, .val = 'H'},
+    {.name = "show-handles", .has_arg = 0, .val = 'a'},
     {.name = "modprobe", .has_arg = 1, .val = 'M'},
     {.name = "set-counters", .has_arg = 1, .val = 'c'},
     {.name = "goto", .has_arg = 1, .val = 'g'},
@@ -187,9 +189,12 @@ static void exit_printhelp(const struct xtables_rule_match *matches) {
            "	%s -[NX] chain\n"
            "	%s -E old-chain-name new-chain-name\n"
            "	%s -P chain target [options]\n"
-           "	%s -h (print this help information)\n\n",
+           "	%s -h (print this help information)\n"
+           "	%s --daemon [--window ms] [--batch commands]\n"
+           "		(read commands from stdin, one per line)\n\n",
            prog_name, prog_vers, prog_name, prog_name, prog_name, prog_name,
-           prog_name, prog_name, prog_name, prog_name, prog_name, prog_name);
+           prog_name, prog_name, prog_name, prog_name, prog_name, prog_name,
+           prog_name);
 
     printf(
         "Commands:\n"
@@ -206,6 +211,10 @@ static void exit_printhelp(const struct xtables_rule_match *matches) {
         "  --replace -R chain rulenum\n"
         "				Replace rule rulenum (1 = first) in "
         "chain\n"
+        "  --delete  -D chain --handle handle\n"
+        "  --replace -R chain --handle handle\n"
+        "				Delete or replace the rule with that "
+        "handle\n"
         "  --list    -L [chain [rulenum]]\n"
         "				List the rules in a chain or all "
         "chains\n"
@@ -262,6 +271,7 @@ static void exit_printhelp(const struct xtables_rule_match *matches) {
         "lock\n"
         "				default is 1 second\n"
         "  --line-numbers		print line numbers when listing\n"
+        "  --show-handles		print rule handles when listing\n"
         "  --exact	-x		expand numbers (display exact values)\n"
         "[!] --fragment	-f		match second or further "
         "fragments only\n"
@@ -409,13 +419,81 @@ static void set_option(unsigned int *options, unsigned int option,
     }
 }
 
+/* Leaves the address as "any", a set lookup stands for the list */
+static void entry_set_any(int family, struct addr_mask *am) {
+    static struct in_addr any4;
+    static struct in6_addr any6;
+
+    if (family == AF_INET) {
+        am->addr.v4 = am->mask.v4 = &any4;
+    } else {
+        am->addr.v6 = am->mask.v6 = &any6;
+    }
+    am->naddrs = 1;
+}
+
+/*
+ * Tells whether @am goes into a set: a long list does, and so does a list
+ * of several addresses if @other goes into one. An anonymous set is bound
+ * by a single rule, so the rule must not be expanded any more.
+ */
+static bool entry_set_wanted(const struct addr_mask *am,
+                             const struct addr_mask *other) {
+    return am->naddrs >= NFT_ADDR_SET_MIN ||
+           (am->naddrs > 1 && other->naddrs >= NFT_ADDR_SET_MIN);
+}
+
+/*
+ * Moves an address list into a set. The rule is then added once, with the
+ * address left as "any" and a lookup in the set instead.
+ */
+static int add_entry_set(struct nft_handle *h, const char *table, int family,
+                         struct addr_mask *am, struct xt_addr_set *set,
+                         bool wanted) {
+    if (!wanted)
+        return 1;
+
+    if (!nft_addr_set_add(h, table, am, set))
+        return 0;
+
+    entry_set_any(family, am);
+    return 1;
+}
+
+/* Same for -D and -C, the rule is found by the elements of its set */
+static int spec_entry_set(struct nft_handle *h, int family,
+                          struct addr_mask *am, struct xt_addr_set *set,
+                          bool wanted) {
+    if (!wanted)
+        return 1;
+
+    if (!nft_addr_set_spec(h, am, set))
+        return 0;
+
+    entry_set_any(family, am);
+    return 1;
+}
+
+static void spec_entry_set_free(struct iptables_command_state *cs) {
+    free(cs->src_set.list);
+    free(cs->dst_set.list);
+    cs->src_set.list = cs->dst_set.list = NULL;
+}
+
 static int add_entry(const char *chain, const char *table,
                      struct iptables_command_state *cs, int rulenum, int family,
-                     const struct addr_mask s, const struct addr_mask d,
-                     bool verbose, struct nft_handle *h, bool append) {
+                     struct addr_mask s, struct addr_mask d, bool verbose,
+                     struct nft_handle *h, bool append) {
+    bool src_set = entry_set_wanted(&s, &d), dst_set = entry_set_wanted(&d, &s);
     unsigned int i, j;
     int ret = 1;
 
+    if (family == AF_INET || family == AF_INET6) {
+        if (!add_entry_set(h, table, family, &s, &cs->src_set, src_set) ||
+            !add_entry_set(h, table, family, &d, &cs->dst_set, dst_set))
+            return 0;
+    }
+
     for (i = 0; i < s.naddrs; i++) {
         if (family == AF_INET) {
             cs->fw.ip.src.s_addr = s.addr.v4[i].s_addr;
@@ -454,7 +532,7 @@ static int add_entry(const char *chain, const char *table,
 
 static int replace_entry(const char *chain, const char *table,
                          struct iptables_command_state *cs,
-                         unsigned int rulenum, int family,
+                         unsigned int rulenum, uint64_t handle, int family,
                          const struct addr_mask s, const struct addr_mask d,
                          bool verbose, struct nft_handle *h) {
     if (family == AF_INET) {
@@ -470,16 +548,28 @@ static int replace_entry(const char *chain, const char *table,
     } else
         return 1;
 
+    if (handle > 0)
+        return nft_rule_replace_handle(h, chain, table, cs, handle, verbose);
+
     return nft_rule_replace(h, chain, table, cs, rulenum, verbose);
 }
 
 static int delete_entry(const char *chain, const char *table,
                         struct iptables_command_state *cs, int family,
-                        const struct addr_mask s, const struct addr_mask d,
+                        struct addr_mask s, struct addr_mask d,
                         bool verbose, struct nft_handle *h) {
+    bool src_set = entry_set_wanted(&s, &d), dst_set = entry_set_wanted(&d, &s);
     unsigned int i, j;
     int ret = 1;
 
+    if (family == AF_INET || family == AF_INET6) {
+        if (!spec_entry_set(h, family, &s, &cs->src_set, src_set) ||
+            !spec_entry_set(h, family, &d, &cs->dst_set, dst_set)) {
+            spec_entry_set_free(cs);
+            return 0;
+        }
+    }
+
     for (i = 0; i < s.naddrs; i++) {
         if (family == AF_INET) {
             cs->fw.ip.src.s_addr = s.addr.v4[i].s_addr;
@@ -502,16 +592,26 @@ static int delete_entry(const char *chain, const char *table,
         }
     }
 
+    spec_entry_set_free(cs);
     return ret;
 }
 
 static int check_entry(const char *chain, const char *table,
                        struct iptables_command_state *cs, int family,
-                       const struct addr_mask s, const struct addr_mask d,
+                       struct addr_mask s, struct addr_mask d,
                        bool verbose, struct nft_handle *h) {
+    bool src_set = entry_set_wanted(&s, &d), dst_set = entry_set_wanted(&d, &s);
     unsigned int i, j;
     int ret = 1;
 
+    if (family == AF_INET || family == AF_INET6) {
+        if (!spec_entry_set(h, family, &s, &cs->src_set, src_set) ||
+            !spec_entry_set(h, family, &d, &cs->dst_set, dst_set)) {
+            spec_entry_set_free(cs);
+            return 0;
+        }
+    }
+
     for (i = 0; i < s.naddrs; i++) {
         if (family == AF_INET) {
             cs->fw.ip.src.s_addr = s.addr.v4[i].s_addr;
@@ -534,12 +634,14 @@ static int check_entry(const char *chain, const char *table,
         }
     }
 
+    spec_entry_set_free(cs);
     return ret;
 }
 
 static int list_entries(struct nft_handle *h, const char *chain,
                         const char *table, int rulenum, int verbose,
-                        int numeric, int expanded, int linenumbers) {
+                        int numeric, int expanded, int linenumbers,
+                        bool handles) {
     unsigned int format;
 
     format = FMT_OPTIONS;
@@ -557,6 +659,9 @@ static int list_entries(struct nft_handle *h, const char *chain,
     if (linenumbers)
         format |= FMT_LINENUMBERS;
 
+    if (handles)
+        format |= FMT_HANDLES;
+
     return nft_rule_list(h, chain, table, rulenum, format);
 }
 
@@ -715,11 +820,9 @@ void do_parse(struct nft_handle *h, int argc, char *argv[],
         case 'R':
             add_command(&p->command, CMD_REPLACE, CMD_NONE, cs->invert);
             p->chain = optarg;
+            /* without a rule number, --handle has to follow */
             if (xs_has_arg(argc, argv))
                 p->rulenum = parse_rulenumber(argv[optind++]);
-            else
-                xtables_error(PARAMETER_PROBLEM, "-%c requires a rule number",
-                              cmd2char(CMD_REPLACE));
             break;
 
         case 'I':
@@ -960,6 +1063,20 @@ void do_parse(struct nft_handle *h, int argc, char *argv[],
                        cs->invert);
             break;
 
+        case 'H': {
+            uintmax_t handle;
+
+            if (!xtables_strtoul(optarg, NULL, &handle, 1, UINT64_MAX))
+                xtables_error(PARAMETER_PROBLEM, "Invalid rule handle `%s'",
+                              optarg);
+            p->handle = handle;
+            break;
+        }
+
+        case 'a':
+            p->show_handles = true;
+            break;
+
         case 'M':
             xtables_modprobe_program = optarg;
             break;
@@ -1062,6 +1179,28 @@ void do_parse(struct nft_handle *h, int argc, char *argv[],
         xtables_error(PARAMETER_PROBLEM, "Replacement rule does not "
                                          "specify a unique address");
 
+    if (p->handle > 0) {
+        if (p->command != CMD_DELETE && p->command != CMD_REPLACE)
+            xtables_error(PARAMETER_PROBLEM,
+                          "--handle only works with -%c and -%c",
+                          cmd2char(CMD_DELETE), cmd2char(CMD_REPLACE));
+        if (p->rulenum > 0)
+            xtables_error(PARAMETER_PROBLEM,
+                          "Cannot use both a rule number and --handle");
+        /* the rule is not matched, so it takes no rule specification */
+        if (p->command == CMD_DELETE)
+            p->command = CMD_DELETE_NUM;
+    } else if (p->command == CMD_REPLACE && p->rulenum == 0) {
+        xtables_error(PARAMETER_PROBLEM,
+                      "-%c requires a rule number or --handle",
+                      cmd2char(CMD_REPLACE));
+    }
+
+    if (p->show_handles && !(p->command & CMD_LIST))
+        xtables_error(PARAMETER_PROBLEM,
+                      "--show-handles only works with -%c",
+                      cmd2char(CMD_LIST));
+
     generic_opt_check(p->command, cs->options);
 
     if (p->chain != NULL && strlen(p->chain) >= XT_EXTENSION_MAXNAMELEN)
@@ -1096,43 +1235,75 @@ void do_parse(struct nft_handle *h, int argc, char *argv[],
     }
 }
 
-int do_commandx(struct nft_handle *h, int argc, char *argv[], char **table,
-                bool restore) {
+/* Releases what do_parse() allocated, also after it bailed out halfway */
+void do_commandx_free(struct nft_handle *h, struct iptables_command_state *cs,
+                      struct xtables_args *args) {
+    xtables_rule_matches_free(&cs->matches);
+    if (cs->target != NULL) {
+        free(cs->target->t);
+        cs->target->t = NULL;
+    }
+
+    if (h->family == AF_INET) {
+        free(args->s.addr.v4);
+        free(args->s.mask.v4);
+        free(args->d.addr.v4);
+        free(args->d.mask.v4);
+    } else if (h->family == AF_INET6) {
+        free(args->s.addr.v6);
+        free(args->s.mask.v6);
+        free(args->d.addr.v6);
+        free(args->d.mask.v6);
+    }
+    xtables_free_opts(1);
+}
+
+/*
+ * do_commandx() with the parse state kept by the caller, so that it can
+ * release it with do_commandx_free() if the command never returns. Both
+ * have to be zeroed before.
+ */
+int do_commandx_state(struct nft_handle *h, int argc, char *argv[],
+                      char **table, bool restore,
+                      struct iptables_command_state *cs,
+                      struct xtables_args *args) {
     int ret = 1;
     struct nft_xt_cmd_parse p = {
         .table = *table, .restore = restore,
     };
-    struct iptables_command_state cs;
-    struct xtables_args args = {
-        .family = h->family,
-    };
 
-    do_parse(h, argc, argv, &p, &cs, &args);
+    args->family = h->family;
+    do_parse(h, argc, argv, &p, cs, args);
 
     switch (p.command) {
     case CMD_APPEND:
-        ret = add_entry(p.chain, p.table, &cs, 0, h->family, args.s, args.d,
-                        cs.options & OPT_VERBOSE, h, true);
+        ret = add_entry(p.chain, p.table, cs, 0, h->family, args->s, args->d,
+                        cs->options & OPT_VERBOSE, h, true);
         break;
     case CMD_DELETE:
-        ret = delete_entry(p.chain, p.table, &cs, h->family, args.s, args.d,
-                           cs.options & OPT_VERBOSE, h);
+        ret = delete_entry(p.chain, p.table, cs, h->family, args->s, args->d,
+                           cs->options & OPT_VERBOSE, h);
         break;
     case CMD_DELETE_NUM:
-        ret =
-            nft_rule_delete_num(h, p.chain, p.table, p.rulenum - 1, p.verbose);
+        if (p.handle > 0)
+            ret = nft_rule_delete_handle(h, p.chain, p.table, p.handle,
+                                         p.verbose);
+        else
+            ret = nft_rule_delete_num(h, p.chain, p.table, p.rulenum - 1,
+                                      p.verbose);
         break;
     case CMD_CHECK:
-        ret = check_entry(p.chain, p.table, &cs, h->family, args.s, args.d,
-                          cs.options & OPT_VERBOSE, h);
+        ret = check_entry(p.chain, p.table, cs, h->family, args->s, args->d,
+                          cs->options & OPT_VERBOSE, h);
         break;
     case CMD_REPLACE:
-        ret = replace_entry(p.chain, p.table, &cs, p.rulenum - 1, h->family,
-                            args.s, args.d, cs.options & OPT_VERBOSE, h);
+        ret = replace_entry(p.chain, p.table, cs, p.rulenum - 1, p.handle,
+                            h->family, args->s, args->d,
+                            cs->options & OPT_VERBOSE, h);
         break;
     case CMD_INSERT:
-        ret = add_entry(p.chain, p.table, &cs, p.rulenum - 1, h->family, args.s,
-                        args.d, cs.options & OPT_VERBOSE, h, false);
+        ret = add_entry(p.chain, p.table, cs, p.rulenum - 1, h->family, args->s,
+                        args->d, cs->options & OPT_VERBOSE, h, false);
         break;
     case CMD_FLUSH:
         ret = nft_rule_flush(h, p.chain, p.table);
@@ -1153,9 +1324,9 @@ int do_commandx(struct nft_handle *h, int argc, char *argv[], char **table,
         }
 
         ret = list_entries(h, p.chain, p.table, p.rulenum,
-                           cs.options & OPT_VERBOSE, cs.options & OPT_NUMERIC,
-                           cs.options & OPT_EXPANDED,
-                           cs.options & OPT_LINENUMBERS);
+                           cs->options & OPT_VERBOSE, cs->options & OPT_NUMERIC,
+                           cs->options & OPT_EXPANDED,
+                           cs->options & OPT_LINENUMBERS, p.show_handles);
         if (ret && (p.command & CMD_ZERO)) {
             ret = nft_chain_zero_counters(h, p.chain, p.table);
         }
@@ -1167,7 +1338,7 @@ int do_commandx(struct nft_handle *h, int argc, char *argv[], char **table,
     case CMD_LIST_RULES | CMD_ZERO:
     case CMD_LIST_RULES | CMD_ZERO_NUM:
         ret = list_rules(h, p.chain, p.table, p.rulenum,
-                         cs.options & OPT_VERBOSE);
+                         cs->options & OPT_VERBOSE);
         if (ret && (p.command & CMD_ZERO)) {
             ret = nft_chain_zero_counters(h, p.chain, p.table);
         }
@@ -1196,20 +1367,15 @@ int do_commandx(struct nft_handle *h, int argc, char *argv[], char **table,
 
     *table = p.table;
 
-    xtables_rule_matches_free(&cs.matches);
-
-    if (h->family == AF_INET) {
-        free(args.s.addr.v4);
-        free(args.s.mask.v4);
-        free(args.d.addr.v4);
-        free(args.d.mask.v4);
-    } else if (h->family == AF_INET6) {
-        free(args.s.addr.v6);
-        free(args.s.mask.v6);
-        free(args.d.addr.v6);
-        free(args.d.mask.v6);
-    }
-    xtables_free_opts(1);
+    do_commandx_free(h, cs, args);
 
     return ret;
 }
+
+int do_commandx(struct nft_handle *h, int argc, char *argv[], char **table,
+                bool restore) {
+    struct iptables_command_state cs = {};
+    struct xtables_args args = {};
+
+    return do_commandx_state(h, argc, argv, table, restore, &cs, &args);
+}
@@ -85,7 +85,10 @@ typedef unsigned int socklen_t;
 #define TC_SET_POLICY iptc_set_policy
 #define TC_GET_RAW_SOCKET iptc_get_raw_socket
 #define TC_INIT iptc_init
+#define TC_INIT_RO iptc_init_readonly
+#define TC_INIT_FLUSHED iptc_init_flushed
 #define TC_FREE iptc_free
+#define TC_REFRESH iptc_refresh
 #define TC_COMMIT iptc_commit
 #define TC_STRERROR iptc_strerror
 #define TC_NUM_RULES iptc_num_rules
@@ -205,6 +208,42 @@ static unsigned char *is_same(const STRUCT_ENTRY *a, const STRUCT_ENTRY *b,
     return mptr;
 }
 
+static inline int fingerprint_match(const STRUCT_ENTRY_MATCH *m,
+                                    unsigned int *hash) {
+    *hash = iptcc_hash_mix(*hash, m->u.user.name, strlen(m->u.user.name));
+    return 0;
+}
+
+/* hash of what is_same() compares regardless of the mask */
+static unsigned int fingerprint(const STRUCT_ENTRY *e) {
+    unsigned int hash = 5381;
+    unsigned int i;
+
+    hash = iptcc_hash_mix(hash, &e->ip.src, sizeof(e->ip.src));
+    hash = iptcc_hash_mix(hash, &e->ip.dst, sizeof(e->ip.dst));
+    hash = iptcc_hash_mix(hash, &e->ip.smsk, sizeof(e->ip.smsk));
+    hash = iptcc_hash_mix(hash, &e->ip.dmsk, sizeof(e->ip.dmsk));
+    hash = iptcc_hash_mix(hash, &e->ip.proto, sizeof(e->ip.proto));
+    hash = iptcc_hash_mix(hash, &e->ip.flags, sizeof(e->ip.flags));
+    hash = iptcc_hash_mix(hash, &e->ip.invflags, sizeof(e->ip.invflags));
+
+    for (i = 0; i < IFNAMSIZ; i++) {
+        unsigned char iface[4] = {
+            e->ip.iniface[i] & e->ip.iniface_mask[i],
+            e->ip.iniface_mask[i],
+            e->ip.outiface[i] & e->ip.outiface_mask[i],
+            e->ip.outiface_mask[i],
+        };
+        hash = iptcc_hash_mix(hash, iface, sizeof(iface));
+    }
+
+    hash = iptcc_hash_mix(hash, &e->target_offset, sizeof(e->target_offset));
+    hash = iptcc_hash_mix(hash, &e->next_offset, sizeof(e->next_offset));
+    IPT_MATCH_ITERATE(e, fingerprint_match, &hash);
+
+    return hash;
+}
+
 #if 0
 /***************************** DEBUGGING ********************************/
 static inline int
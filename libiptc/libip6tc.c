@@ -83,7 +83,10 @@ typedef unsigned int socklen_t;
 #define TC_SET_POLICY ip6tc_set_policy
 #define TC_GET_RAW_SOCKET ip6tc_get_raw_socket
 #define TC_INIT ip6tc_init
+#define TC_INIT_RO ip6tc_init_readonly
+#define TC_INIT_FLUSHED ip6tc_init_flushed
 #define TC_FREE ip6tc_free
+#define TC_REFRESH ip6tc_refresh
 #define TC_COMMIT ip6tc_commit
 #define TC_STRERROR ip6tc_strerror
 #define TC_NUM_RULES ip6tc_num_rules
@@ -237,6 +240,43 @@ static unsigned char *is_same(const STRUCT_ENTRY *a, const STRUCT_ENTRY *b,
     return mptr;
 }
 
+static inline int fingerprint_match(const STRUCT_ENTRY_MATCH *m,
+                                    unsigned int *hash) {
+    *hash = iptcc_hash_mix(*hash, m->u.user.name, strlen(m->u.user.name));
+    return 0;
+}
+
+/* hash of what is_same() compares regardless of the mask */
+static unsigned int fingerprint(const STRUCT_ENTRY *e) {
+    unsigned int hash = 5381;
+    unsigned int i;
+
+    hash = iptcc_hash_mix(hash, &e->ipv6.src, sizeof(e->ipv6.src));
+    hash = iptcc_hash_mix(hash, &e->ipv6.dst, sizeof(e->ipv6.dst));
+    hash = iptcc_hash_mix(hash, &e->ipv6.smsk, sizeof(e->ipv6.smsk));
+    hash = iptcc_hash_mix(hash, &e->ipv6.dmsk, sizeof(e->ipv6.dmsk));
+    hash = iptcc_hash_mix(hash, &e->ipv6.proto, sizeof(e->ipv6.proto));
+    hash = iptcc_hash_mix(hash, &e->ipv6.tos, sizeof(e->ipv6.tos));
+    hash = iptcc_hash_mix(hash, &e->ipv6.flags, sizeof(e->ipv6.flags));
+    hash = iptcc_hash_mix(hash, &e->ipv6.invflags, sizeof(e->ipv6.invflags));
+
+    for (i = 0; i < IFNAMSIZ; i++) {
+        unsigned char iface[4] = {
+            e->ipv6.iniface[i] & e->ipv6.iniface_mask[i],
+            e->ipv6.iniface_mask[i],
+            e->ipv6.outiface[i] & e->ipv6.outiface_mask[i],
+            e->ipv6.outiface_mask[i],
+        };
+        hash = iptcc_hash_mix(hash, iface, sizeof(iface));
+    }
+
+    hash = iptcc_hash_mix(hash, &e->target_offset, sizeof(e->target_offset));
+    hash = iptcc_hash_mix(hash, &e->next_offset, sizeof(e->next_offset));
+    IP6T_MATCH_ITERATE(e, fingerprint_match, &hash);
+
+    return hash;
+}
+
 /* All zeroes == unconditional rule. */
 static inline int unconditional(const struct ip6t_ip6 *ipv6) {
     unsigned int i;
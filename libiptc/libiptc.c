@@ -95,12 +95,17 @@ struct rule_head {
     enum iptcc_rule_type type;
     struct chain_head *jump; /* jump target, if IPTCC_R_JUMP */
 
+    struct iptcc_rule_chunk *chunk; /* rule index chunk, if indexed */
+    struct hlist_node hnode;        /* entry in the chain's rule hash */
+    unsigned int fingerprint;       /* see iptcc_rule_fingerprint() */
+
     unsigned int size; /* size of entry data */
     STRUCT_ENTRY entry[0];
 };
 
 struct chain_head {
     struct list_head list;
+    struct hlist_node hnode; /* entry in the chain name hash */
     char name[TABLE_MAXNAMELEN];
     unsigned int hooknum;    /* hook number+1 if builtin */
     unsigned int references; /* how many jumps reference us */
@@ -112,31 +117,66 @@ struct chain_head {
     unsigned int num_rules; /* number of rules in list */
     struct list_head rules; /* list of rules */
 
+    struct iptcc_rule_chunk **rule_chunks; /* rule index, NULL if unused */
+    unsigned int num_rule_chunks;
+    unsigned int rule_chunks_sz; /* allocated size of rule_chunks */
+
+    struct hlist_head *rule_hash; /* rule fingerprint hash, or NULL */
+    unsigned int rule_hash_sz;    /* number of buckets, power of two */
+
     unsigned int index;       /* index (needed for jump resolval) */
     unsigned int head_offset; /* offset in rule blob */
     unsigned int foot_index;  /* index (needed for counter_map) */
     unsigned int foot_offset; /* offset in rule blob */
+
+    /* A chain is clean as long as its rules are unchanged since the
+     * table was read from the kernel.  The rules of a clean chain keep
+     * their offset and index in handle->entries, so TC_COMMIT can copy
+     * them from there in one go. */
+    unsigned int dirty;            /* rules changed since parse */
+    unsigned int blob_head_offset; /* head_offset in handle->entries */
+    unsigned int blob_foot_index;  /* foot_index in handle->entries */
+    unsigned int num_jumps;        /* jump and fallthrough rules */
+    unsigned int max_jump;         /* highest jump verdict in the blob */
 };
 
+#define IPTCC_ARENA_FREE_BUCKETS 64 /* free lists, by object size */
+
 struct xtc_handle {
     int sockfd;
     int changed; /* Have changes been made? */
+    int counters_changed; /* Have counters been zeroed or set? */
+    int reuse;   /* Keep the cache in sync on commit, see TC_REFRESH */
+    int readonly; /* Rules are not cached, see TC_INIT_RO */
+    unsigned int unknown_policies; /* hook mask, see TC_INIT_FLUSHED */
 
     struct list_head chains;
 
     struct chain_head *chain_iterator_cur;
     struct rule_head *rule_iterator_cur;
+    struct chain_head *rule_iterator_chain; /* read-only handles */
 
     unsigned int num_chains; /* number of user defined chains */
 
     struct chain_head **chain_index; /* array for fast chain list access*/
     unsigned int chain_index_sz;     /* size of chain index array */
 
+    struct hlist_head *chain_hash; /* chain name -> chain_head */
+    unsigned int chain_hash_sz;    /* number of buckets, power of two */
+
     int sorted_offsets; /* if chains are received sorted from kernel,
                          * then the offsets are also sorted. Says if its
                          * possible to bsearch offsets using chain_index.
                          */
 
+    unsigned int dirty_offset; /* first blob offset changed by commit */
+
+    struct iptcc_arena_block *arena; /* chain_head and rule_head storage */
+    struct iptcc_arena_block *arena_spare; /* blocks kept for reuse */
+    struct iptcc_arena_obj *arena_free[IPTCC_ARENA_FREE_BUCKETS];
+    size_t arena_used;               /* bytes handed out by the arena */
+    size_t arena_freed;              /* ... and given back since */
+
     STRUCT_GETINFO info;
     STRUCT_GET_ENTRIES *entries;
 };
@@ -146,10 +186,128 @@ enum bsearch_type {
     BSEARCH_OFFSET, /* Binary search based on offset */
 };
 
+/**********************************************************************
+ * Arena
+ *
+ * Chain and rule heads of a handle are carved out of large blocks, so
+ * reading a table doesn't cost one malloc() per rule and releasing the
+ * cache only frees the blocks.  Deleted objects go on free lists hashed
+ * by size and are handed out again for an object of the same size, as
+ * when a rule is replaced.  Whatever is not reused that way is only
+ * given back when the cache is rebuilt.  TC_REFRESH does so once most
+ * of the arena is unused, keeping the blocks (and the pages they are
+ * backed by) for the new cache.
+ **********************************************************************/
+
+#define IPTCC_ARENA_BLOCK_SIZE (256 * 1024)
+
+/* a deleted object, waiting for reuse */
+struct iptcc_arena_obj {
+    struct iptcc_arena_obj *next;
+    size_t size;
+};
+
+struct iptcc_arena_block {
+    struct iptcc_arena_block *next;
+    size_t size; /* usable bytes after the (aligned) header */
+    size_t used;
+};
+
+#define IPTCC_ARENA_HDR_SIZE ALIGN(sizeof(struct iptcc_arena_block))
+
+static inline struct iptcc_arena_obj **
+iptcc_arena_free_list(struct xtc_handle *h, size_t size) {
+    return &h->arena_free[size / ALIGN(1) % IPTCC_ARENA_FREE_BUCKETS];
+}
+
+static void *iptcc_arena_alloc(struct xtc_handle *h, size_t size) {
+    struct iptcc_arena_block *b = h->arena;
+    struct iptcc_arena_obj **o;
+    void *p;
+
+    size = ALIGN(size);
+    for (o = iptcc_arena_free_list(h, size); *o; o = &(*o)->next) {
+        if ((*o)->size == size) {
+            p = *o;
+            *o = (*o)->next;
+            h->arena_freed -= size;
+            return p;
+        }
+    }
+
+    if (!b || b->size - b->used < size) {
+        size_t bsize =
+            size > IPTCC_ARENA_BLOCK_SIZE ? size : IPTCC_ARENA_BLOCK_SIZE;
+
+        if (h->arena_spare && h->arena_spare->size >= size) {
+            b = h->arena_spare;
+            h->arena_spare = b->next;
+        } else {
+            b = malloc(IPTCC_ARENA_HDR_SIZE + bsize);
+            if (!b)
+                return NULL;
+            b->size = bsize;
+        }
+        b->used = 0;
+        b->next = h->arena;
+        h->arena = b;
+    }
+
+    p = (char *)b + IPTCC_ARENA_HDR_SIZE + b->used;
+    b->used += size;
+    h->arena_used += size;
+
+    return p;
+}
+
+/* put an object that is no longer used on its free list */
+static void iptcc_arena_free(struct xtc_handle *h, void *p, size_t size) {
+    struct iptcc_arena_obj **o, *obj = p;
+
+    size = ALIGN(size);
+    o = iptcc_arena_free_list(h, size);
+    obj->size = size;
+    obj->next = *o;
+    *o = obj;
+    h->arena_freed += size;
+}
+
+/* most of the arena is taken by deleted objects not reused */
+static inline int iptcc_arena_fragmented(struct xtc_handle *h) {
+    return h->arena_freed > h->arena_used / 2;
+}
+
+/* forget about all objects, but keep the blocks for reuse */
+static void iptcc_arena_reset(struct xtc_handle *h) {
+    struct iptcc_arena_block *b, *next;
+
+    for (b = h->arena; b; b = next) {
+        next = b->next;
+        b->next = h->arena_spare;
+        h->arena_spare = b;
+    }
+    h->arena = NULL;
+    h->arena_used = 0;
+    h->arena_freed = 0;
+    memset(h->arena_free, 0, sizeof(h->arena_free));
+}
+
+static void iptcc_arena_release(struct xtc_handle *h) {
+    struct iptcc_arena_block *b, *next;
+
+    iptcc_arena_reset(h);
+    for (b = h->arena_spare; b; b = next) {
+        next = b->next;
+        free(b);
+    }
+    h->arena_spare = NULL;
+}
+
 /* allocate a new chain head for the cache */
-static struct chain_head *iptcc_alloc_chain_head(const char *name,
+static struct chain_head *iptcc_alloc_chain_head(struct xtc_handle *h,
+                                                 const char *name,
                                                  int hooknum) {
-    struct chain_head *c = malloc(sizeof(*c));
+    struct chain_head *c = iptcc_arena_alloc(h, sizeof(*c));
     if (!c)
         return NULL;
     memset(c, 0, sizeof(*c));
@@ -161,10 +319,22 @@ static struct chain_head *iptcc_alloc_chain_head(const char *name,
     return c;
 }
 
-/* allocate and initialize a new rule for the cache */
-static struct rule_head *iptcc_alloc_rule(struct chain_head *c,
+static inline void iptcc_free_chain_head(struct xtc_handle *h,
+                                         struct chain_head *c) {
+    iptcc_arena_free(h, c, sizeof(*c));
+}
+
+/* allocate and initialize a new rule for the cache.  Without a handle,
+ * the rule is only used temporarily and must be free()d by the caller. */
+static struct rule_head *iptcc_alloc_rule(struct xtc_handle *h,
+                                          struct chain_head *c,
                                           unsigned int size) {
-    struct rule_head *r = malloc(sizeof(*r) + size);
+    struct rule_head *r;
+
+    if (h)
+        r = iptcc_arena_alloc(h, sizeof(*r) + size);
+    else
+        r = malloc(sizeof(*r) + size);
     if (!r)
         return NULL;
     memset(r, 0, sizeof(*r));
@@ -175,9 +345,36 @@ static struct rule_head *iptcc_alloc_rule(struct chain_head *c,
     return r;
 }
 
+static inline void iptcc_free_rule(struct xtc_handle *h, struct rule_head *r) {
+    iptcc_arena_free(h, r, sizeof(*r) + r->size);
+}
+
 /* notify us that the ruleset has been modified by the user */
 static inline void set_changed(struct xtc_handle *h) { h->changed = 1; }
 
+/* notify us that the rules of a chain have been modified by the user */
+static inline void set_chain_changed(struct xtc_handle *h,
+                                     struct chain_head *c) {
+    c->dirty = 1;
+    h->changed = 1;
+}
+
+/* notify us that only counters of a chain have been changed by the user */
+static inline void set_counters_changed(struct xtc_handle *h,
+                                        struct chain_head *c) {
+    c->dirty = 1;
+    h->counters_changed = 1;
+}
+
+/* read-only handles can't be modified, see TC_INIT_RO */
+static inline int iptcc_writable(struct xtc_handle *h) {
+    if (h->readonly) {
+        errno = EROFS;
+        return 0;
+    }
+    return 1;
+}
+
 #ifdef IPTC_DEBUG
 static void do_check(struct xtc_handle *h, unsigned int line);
 #define CHECK(h)                                                               \
@@ -482,6 +679,7 @@ static int iptcc_chain_index_alloc(struct xtc_handle *h) {
 static void iptcc_chain_index_free(struct xtc_handle *h) {
     h->chain_index_sz = 0;
     free(h->chain_index);
+    h->chain_index = NULL;
 }
 
 #ifdef DEBUG
@@ -597,6 +795,84 @@ static int iptcc_chain_index_delete_chain(struct chain_head *c,
     return 0;
 }
 
+/**********************************************************************
+ * Chain hash (cache utility) functions
+ **********************************************************************
+ * The chain index above only gives a starting point for a list walk,
+ * which still degrades with the number of chains.  Name lookups are
+ * therefore served by a hash table holding every chain (builtin and
+ * user defined), while the chain index is kept for finding the sorted
+ * insert position.
+ *
+ * The table is doubled when the number of user defined chains exceeds
+ * the number of buckets, keeping the average bucket length below one.
+ */
+#ifndef CHAIN_HASH_MIN_SIZE
+#define CHAIN_HASH_MIN_SIZE 64
+#endif
+
+static inline unsigned int iptcc_chain_hash_name(const char *name) {
+    unsigned int hash = 5381;
+
+    while (*name)
+        hash = hash * 33 + (unsigned char)*name++;
+    return hash;
+}
+
+static inline struct hlist_head *iptcc_chain_hash_bucket(struct xtc_handle *h,
+                                                         const char *name) {
+    return &h->chain_hash[iptcc_chain_hash_name(name) & (h->chain_hash_sz - 1)];
+}
+
+static int iptcc_chain_hash_alloc(struct xtc_handle *h, unsigned int size) {
+    struct hlist_head *hash;
+    struct hlist_node *pos, *n;
+    unsigned int i;
+
+    hash = calloc(size, sizeof(*hash));
+    if (hash == NULL)
+        return -ENOMEM;
+
+    /* Move chains over from the old table, if any */
+    for (i = 0; i < h->chain_hash_sz; i++) {
+        hlist_for_each_safe(pos, n, &h->chain_hash[i]) {
+            struct chain_head *c = hlist_entry(pos, struct chain_head, hnode);
+            hlist_add_head(&c->hnode,
+                           &hash[iptcc_chain_hash_name(c->name) & (size - 1)]);
+        }
+    }
+    free(h->chain_hash);
+
+    debug("Chain hash resized from %u to %u buckets\n", h->chain_hash_sz, size);
+    h->chain_hash = hash;
+    h->chain_hash_sz = size;
+
+    return 1;
+}
+
+static void iptcc_chain_hash_free(struct xtc_handle *h) {
+    h->chain_hash_sz = 0;
+    free(h->chain_hash);
+    h->chain_hash = NULL;
+}
+
+/* Add chain to the name hash, growing the hash if needed */
+static int iptcc_chain_hash_add(struct xtc_handle *h, struct chain_head *c) {
+    if (h->chain_hash_sz == 0 || h->num_chains > h->chain_hash_sz) {
+        unsigned int size = h->chain_hash_sz ? h->chain_hash_sz * 2
+                                             : CHAIN_HASH_MIN_SIZE;
+        if (iptcc_chain_hash_alloc(h, size) < 0)
+            return -ENOMEM;
+    }
+
+    hlist_add_head(&c->hnode, iptcc_chain_hash_bucket(h, c->name));
+    return 1;
+}
+
+static inline void iptcc_chain_hash_del(struct chain_head *c) {
+    hlist_del(&c->hnode);
+}
+
 /**********************************************************************
  * iptc cache utility functions (iptcc_*)
  **********************************************************************/
@@ -606,27 +882,331 @@ static inline unsigned int iptcc_is_builtin(struct chain_head *c) {
     return (c->hooknum ? 1 : 0);
 }
 
-/* Get a specific rule within a chain */
-static struct rule_head *iptcc_get_rule_num(struct chain_head *c,
-                                            unsigned int rulenum) {
+/**********************************************************************
+ * Rule index
+ *
+ * Chains with many rules get an index for positional access: the rules
+ * in list order, split into chunks of at most IPTCC_RULE_CHUNK_MAX
+ * pointers.  Finding rule N only has to walk the chunk array, and
+ * inserting or removing a rule moves at most one chunk's worth of
+ * pointers.  The list stays authoritative; the index is built the first
+ * time a rule is looked up by number and kept up to date by the
+ * functions changing the list.
+ **********************************************************************/
+
+#define IPTCC_RULE_INDEX_MIN 64   /* chains shorter than this are walked */
+#define IPTCC_RULE_CHUNK_MAX 256
+
+struct iptcc_rule_chunk {
+    unsigned int num;
+    struct rule_head *rules[IPTCC_RULE_CHUNK_MAX];
+};
+
+static void iptcc_rule_index_free(struct chain_head *c) {
+    unsigned int i;
+
+    for (i = 0; i < c->num_rule_chunks; i++)
+        free(c->rule_chunks[i]);
+    free(c->rule_chunks);
+    c->rule_chunks = NULL;
+    c->num_rule_chunks = 0;
+    c->rule_chunks_sz = 0;
+}
+
+/* insert an empty chunk at position `pos' of the chunk array */
+static struct iptcc_rule_chunk *iptcc_rule_chunk_add(struct chain_head *c,
+                                                     unsigned int pos) {
+    struct iptcc_rule_chunk *k;
+
+    if (c->num_rule_chunks == c->rule_chunks_sz) {
+        unsigned int sz = c->rule_chunks_sz ? c->rule_chunks_sz * 2 : 8;
+        struct iptcc_rule_chunk **n;
+
+        n = realloc(c->rule_chunks, sz * sizeof(*n));
+        if (!n)
+            return NULL;
+        c->rule_chunks = n;
+        c->rule_chunks_sz = sz;
+    }
+
+    k = malloc(sizeof(*k));
+    if (!k)
+        return NULL;
+    k->num = 0;
+
+    memmove(&c->rule_chunks[pos + 1], &c->rule_chunks[pos],
+            (c->num_rule_chunks - pos) * sizeof(*c->rule_chunks));
+    c->rule_chunks[pos] = k;
+    c->num_rule_chunks++;
+
+    return k;
+}
+
+static int iptcc_rule_index_build(struct chain_head *c) {
+    struct iptcc_rule_chunk *k = NULL;
     struct rule_head *r;
-    unsigned int num = 0;
 
     list_for_each_entry(r, &c->rules, list) {
-        num++;
-        if (num == rulenum)
-            return r;
+        /* leave room for inserts */
+        if (!k || k->num == IPTCC_RULE_CHUNK_MAX / 2) {
+            k = iptcc_rule_chunk_add(c, c->num_rule_chunks);
+            if (!k) {
+                iptcc_rule_index_free(c);
+                return -1;
+            }
+        }
+        k->rules[k->num++] = r;
+        r->chunk = k;
     }
-    return NULL;
+    return 0;
+}
+
+/* Find the chunk holding rule `*pos' (0-based), and make `*pos' relative
+ * to the chunk.  `*pos' may be the number of rules, the chunk returned
+ * then is the last one. */
+static unsigned int iptcc_rule_chunk_find(struct chain_head *c,
+                                          unsigned int *pos) {
+    unsigned int i, base;
+
+    if (*pos < c->num_rules / 2) {
+        for (i = 0, base = 0; i < c->num_rule_chunks - 1; i++) {
+            if (*pos < base + c->rule_chunks[i]->num)
+                break;
+            base += c->rule_chunks[i]->num;
+        }
+    } else {
+        base = c->num_rules;
+        for (i = c->num_rule_chunks - 1; i > 0; i--) {
+            base -= c->rule_chunks[i]->num;
+            if (*pos >= base)
+                break;
+        }
+        if (i == 0)
+            base = 0;
+    }
+    *pos -= base;
+    return i;
+}
+
+/* Rule `r' was inserted at position `pos' (0-based) of the list.  As for
+ * iptcc_rule_index_remove(), c->num_rules is not updated yet. */
+static void iptcc_rule_index_insert(struct chain_head *c, unsigned int pos,
+                                    struct rule_head *r) {
+    struct iptcc_rule_chunk *k, *n;
+    unsigned int i;
+
+    if (!c->rule_chunks)
+        return;
+
+    if (!c->num_rule_chunks && !iptcc_rule_chunk_add(c, 0))
+        goto fail;
+
+    i = iptcc_rule_chunk_find(c, &pos);
+    k = c->rule_chunks[i];
+
+    if (k->num == IPTCC_RULE_CHUNK_MAX) {
+        unsigned int j;
+
+        n = iptcc_rule_chunk_add(c, i + 1);
+        if (!n)
+            goto fail;
+        n->num = k->num / 2;
+        k->num -= n->num;
+        memcpy(n->rules, &k->rules[k->num], n->num * sizeof(*n->rules));
+        for (j = 0; j < n->num; j++)
+            n->rules[j]->chunk = n;
+        if (pos > k->num) {
+            pos -= k->num;
+            k = n;
+        }
+    }
+
+    memmove(&k->rules[pos + 1], &k->rules[pos],
+            (k->num - pos) * sizeof(*k->rules));
+    k->rules[pos] = r;
+    k->num++;
+    r->chunk = k;
+    return;
+
+fail:
+    /* out of memory, fall back to walking the list */
+    iptcc_rule_index_free(c);
+}
+
+/* rule at position `pos' (0-based) was removed from the list */
+static void iptcc_rule_index_remove(struct chain_head *c, unsigned int pos) {
+    struct iptcc_rule_chunk *k;
+    unsigned int i;
+
+    if (!c->rule_chunks)
+        return;
+
+    i = iptcc_rule_chunk_find(c, &pos);
+    k = c->rule_chunks[i];
+
+    k->num--;
+    memmove(&k->rules[pos], &k->rules[pos + 1],
+            (k->num - pos) * sizeof(*k->rules));
+
+    if (!k->num) {
+        free(k);
+        c->num_rule_chunks--;
+        memmove(&c->rule_chunks[i], &c->rule_chunks[i + 1],
+                (c->num_rule_chunks - i) * sizeof(*c->rule_chunks));
+    }
+}
+
+/* rule at position `pos' (0-based) was replaced by `r' */
+static void iptcc_rule_index_replace(struct chain_head *c, unsigned int pos,
+                                     struct rule_head *r) {
+    unsigned int i;
+
+    if (!c->rule_chunks)
+        return;
+
+    i = iptcc_rule_chunk_find(c, &pos);
+    c->rule_chunks[i]->rules[pos] = r;
+    r->chunk = c->rule_chunks[i];
+}
+
+/* position (0-based) of an indexed rule */
+static unsigned int iptcc_rule_index_pos(struct chain_head *c,
+                                         struct rule_head *r) {
+    struct iptcc_rule_chunk *k = r->chunk;
+    unsigned int i, pos = 0;
+
+    for (i = 0; c->rule_chunks[i] != k; i++)
+        pos += c->rule_chunks[i]->num;
+    for (i = 0; k->rules[i] != r; i++)
+        ;
+    return pos + i;
+}
+
+/**********************************************************************
+ * Rule hash
+ *
+ * To find a rule by its contents, long chains hash their rules by the
+ * parts is_same() and target_same() compare regardless of the mask:
+ * the IP header, the match names and the verdict or target name.  Like
+ * the rule index, the hash is built on first use.
+ **********************************************************************/
+
+static inline unsigned int iptcc_hash_mix(unsigned int hash, const void *data,
+                                          size_t len) {
+    const unsigned char *p = data;
+
+    while (len--)
+        hash = hash * 33 + *p++;
+    return hash;
+}
+
+/* per family hash of the entry, in libip4tc.c and libip6tc.c */
+static unsigned int fingerprint(const STRUCT_ENTRY *e);
+
+static unsigned int iptcc_rule_fingerprint(struct rule_head *r) {
+    STRUCT_ENTRY_TARGET *t = GET_TARGET(r->entry);
+    unsigned int hash = fingerprint(r->entry);
+
+    hash = iptcc_hash_mix(hash, &r->type, sizeof(r->type));
+    switch (r->type) {
+    case IPTCC_R_STANDARD:
+        hash = iptcc_hash_mix(hash, t->data, sizeof(int));
+        break;
+    case IPTCC_R_JUMP:
+        hash = iptcc_hash_mix(hash, &r->jump, sizeof(r->jump));
+        break;
+    case IPTCC_R_MODULE:
+        hash = iptcc_hash_mix(hash, t->u.user.name, strlen(t->u.user.name));
+        break;
+    case IPTCC_R_FALLTHROUGH:
+        break;
+    }
+
+    /* spread the bits for the bucket mask */
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    return hash;
+}
+
+static void iptcc_rule_hash_free(struct chain_head *c) {
+    free(c->rule_hash);
+    c->rule_hash = NULL;
+    c->rule_hash_sz = 0;
+}
+
+static inline struct hlist_head *iptcc_rule_hash_bucket(struct chain_head *c,
+                                                        unsigned int hash) {
+    return &c->rule_hash[hash & (c->rule_hash_sz - 1)];
+}
+
+/* (re)build the hash with one bucket per rule */
+static int iptcc_rule_hash_build(struct chain_head *c) {
+    unsigned int size = IPTCC_RULE_INDEX_MIN;
+    struct rule_head *r;
+
+    while (size < c->num_rules)
+        size <<= 1;
+
+    free(c->rule_hash);
+    c->rule_hash = calloc(size, sizeof(*c->rule_hash));
+    if (!c->rule_hash) {
+        c->rule_hash_sz = 0;
+        return -1;
+    }
+    c->rule_hash_sz = size;
+
+    list_for_each_entry(r, &c->rules, list) {
+        r->fingerprint = iptcc_rule_fingerprint(r);
+        hlist_add_head(&r->hnode, iptcc_rule_hash_bucket(c, r->fingerprint));
+    }
+    return 0;
+}
+
+/* rule `r' was added to the list of a chain */
+static void iptcc_rule_hash_add(struct chain_head *c, struct rule_head *r) {
+    if (!c->rule_hash)
+        return;
+
+    if (c->num_rules >= 2 * c->rule_hash_sz) {
+        if (iptcc_rule_hash_build(c) < 0)
+            iptcc_rule_hash_free(c);
+        return;
+    }
+
+    r->fingerprint = iptcc_rule_fingerprint(r);
+    hlist_add_head(&r->hnode, iptcc_rule_hash_bucket(c, r->fingerprint));
 }
 
-/* Get a specific rule within a chain backwards */
-static struct rule_head *iptcc_get_rule_num_reverse(struct chain_head *c,
-                                                    unsigned int rulenum) {
+/* Get a specific rule within a chain */
+static struct rule_head *iptcc_get_rule_num(struct chain_head *c,
+                                            unsigned int rulenum) {
     struct rule_head *r;
     unsigned int num = 0;
 
-    list_for_each_entry_reverse(r, &c->rules, list) {
+    if (rulenum == 0 || rulenum > c->num_rules)
+        return NULL;
+
+    if (!c->rule_chunks && c->num_rules >= IPTCC_RULE_INDEX_MIN)
+        iptcc_rule_index_build(c);
+
+    if (c->rule_chunks) {
+        unsigned int i;
+
+        num = rulenum - 1;
+        i = iptcc_rule_chunk_find(c, &num);
+        return c->rule_chunks[i]->rules[num];
+    }
+
+    if (rulenum > c->num_rules / 2) {
+        list_for_each_entry_reverse(r, &c->rules, list) {
+            if (c->num_rules - num++ == rulenum)
+                return r;
+        }
+        return NULL;
+    }
+
+    list_for_each_entry(r, &c->rules, list) {
         num++;
         if (num == rulenum)
             return r;
@@ -668,88 +1248,33 @@ static struct chain_head *iptcc_find_chain_by_offset(struct xtc_handle *handle,
 /* Returns chain head if found, otherwise NULL. */
 static struct chain_head *iptcc_find_label(const char *name,
                                            struct xtc_handle *handle) {
-    struct list_head *pos;
-    struct list_head *list_start_pos;
-    unsigned int i = 0;
-    int res;
+    struct hlist_node *pos;
 
-    if (list_empty(&handle->chains))
+    if (handle->chain_hash_sz == 0)
         return NULL;
 
-    /* First look at builtin chains */
-    list_for_each(pos, &handle->chains) {
-        struct chain_head *c = list_entry(pos, struct chain_head, list);
-        if (!iptcc_is_builtin(c))
-            break;
+    hlist_for_each(pos, iptcc_chain_hash_bucket(handle, name)) {
+        struct chain_head *c = hlist_entry(pos, struct chain_head, hnode);
         if (!strcmp(c->name, name))
             return c;
     }
 
-    /* Find a smart place to start the search via chain index */
-    // list_start_pos = iptcc_linearly_search_chain_index(name, handle);
-    list_start_pos = iptcc_bsearch_chain_index(name, &i, handle);
-
-    /* Handel if bsearch bails out early */
-    if (list_start_pos == &handle->chains) {
-        list_start_pos = pos;
-    }
-#ifdef DEBUG
-    else {
-        /* Verify result of bsearch against linearly index search */
-        struct list_head *test_pos;
-        struct chain_head *test_c, *tmp_c;
-        test_pos = iptcc_linearly_search_chain_index(name, handle);
-        if (list_start_pos != test_pos) {
-            debug("BUG in chain_index search\n");
-            test_c = list_entry(test_pos, struct chain_head, list);
-            tmp_c = list_entry(list_start_pos, struct chain_head, list);
-            debug("Verify search found:\n");
-            debug(" Chain:%s\n", test_c->name);
-            debug("BSearch found:\n");
-            debug(" Chain:%s\n", tmp_c->name);
-            exit(42);
-        }
-    }
-#endif
-
-    /* Initial/special case, no user defined chains */
-    if (handle->num_chains == 0)
-        return NULL;
-
-    /* Start searching through the chain list */
-    list_for_each(pos, list_start_pos->prev) {
-        struct chain_head *c = list_entry(pos, struct chain_head, list);
-        res = strcmp(c->name, name);
-        debug("List search name:%s == %s res:%d\n", name, c->name, res);
-        if (res == 0)
-            return c;
-
-        /* We can stop earlier as we know list is sorted */
-        if (res > 0 && !iptcc_is_builtin(c)) { /* Walked too far*/
-            debug(" Not in list, walked too far, sorted list\n");
-            return NULL;
-        }
-
-        /* Stop on wrap around, if list head is reached */
-        if (pos == &handle->chains) {
-            debug("Stop, list head reached\n");
-            return NULL;
-        }
-    }
-
-    debug("List search NOT found name:%s\n", name);
+    debug("Hash search NOT found name:%s\n", name);
     return NULL;
 }
 
 /* called when rule is to be removed from cache */
-static void iptcc_delete_rule(struct rule_head *r) {
+static void iptcc_delete_rule(struct xtc_handle *h, struct rule_head *r) {
     DEBUGP("deleting rule %p (offset %u)\n", r, r->offset);
     /* clean up reference count of called chain */
     if (r->type == IPTCC_R_JUMP && r->jump)
         r->jump->references--;
 
+    if (r->chain->rule_hash)
+        hlist_del(&r->hnode);
+
     list_del(&r->list);
-    free(r);
+    iptcc_free_rule(h, r);
 }
 
 /**********************************************************************
@@ -780,10 +1305,11 @@ static int __iptcc_p_del_policy(struct xtc_handle *h, unsigned int num) {
 
         /* foot_offset points to verdict rule */
         h->chain_iterator_cur->foot_index = num;
+        h->chain_iterator_cur->blob_foot_index = num;
         h->chain_iterator_cur->foot_offset = pr->offset;
 
         /* delete rule from cache */
-        iptcc_delete_rule(pr);
+        iptcc_delete_rule(h, pr);
         h->chain_iterator_cur->num_rules--;
 
         return 1;
@@ -797,9 +1323,28 @@ static void iptc_insert_chain(struct xtc_handle *h, struct chain_head *c) {
     struct list_head *list_start_pos;
     unsigned int i = 1;
 
+    /* Names arriving in sorted order (e.g. from iptables-save
+     * output) belong at the tail, no need to search for them */
+    if (!c->hooknum && !list_empty(&h->chains)) {
+        tmp = list_entry(h->chains.prev, struct chain_head, list);
+        if (!iptcc_is_builtin(tmp) && strcmp(c->name, tmp->name) > 0) {
+            list_add_tail(&c->list, &h->chains);
+            return;
+        }
+    }
+
     /* Find a smart place to start the insert search */
     list_start_pos = iptcc_bsearch_chain_index(c->name, &i, h);
 
+#ifdef DEBUG
+    /* Verify result of bsearch against linearly index search */
+    if (list_start_pos != &h->chains &&
+        list_start_pos != iptcc_linearly_search_chain_index(c->name, h)) {
+        debug("BUG in chain_index search for chain:%s\n", c->name);
+        exit(42);
+    }
+#endif
+
     /* Handle the case, where chain.name is smaller than index[0] */
     if (i == 0 && strcmp(c->name, h->chain_index[0]->name) <= 0) {
         h->chain_index[0] = c; /* Update chain index head */
@@ -834,14 +1379,16 @@ static void iptc_insert_chain(struct xtc_handle *h, struct chain_head *c) {
 
 /* Another ugly helper function split out of cache_add_entry to make it less
  * spaghetti code */
-static void __iptcc_p_add_chain(struct xtc_handle *h, struct chain_head *c,
-                                unsigned int offset, unsigned int *num) {
+static int __iptcc_p_add_chain(struct xtc_handle *h, struct chain_head *c,
+                               unsigned int offset, unsigned int *num) {
     struct list_head *tail = h->chains.prev;
     struct chain_head *ctail;
 
-    __iptcc_p_del_policy(h, *num);
+    if (iptcc_chain_hash_add(h, c) < 0)
+        return -1;
 
     c->head_offset = offset;
+    c->blob_head_offset = offset;
     c->index = *num;
 
     /* Chains from kernel are already sorted, as they are inserted
@@ -871,6 +1418,7 @@ static void __iptcc_p_add_chain(struct xtc_handle *h, struct chain_head *c,
     }
 
     h->chain_iterator_cur = c;
+    return 0;
 }
 
 /* main parser function: add an entry from the blob to the cache */
@@ -897,7 +1445,7 @@ static int cache_add_entry(STRUCT_ENTRY *e, struct xtc_handle *h,
 
     if (strcmp(GET_TARGET(e)->u.user.name, ERROR_TARGET) == 0) {
         struct chain_head *c =
-            iptcc_alloc_chain_head((const char *)GET_TARGET(e)->data, 0);
+            iptcc_alloc_chain_head(h, (const char *)GET_TARGET(e)->data, 0);
         DEBUGP_C("%u:%u:new userdefined chain %s: %p\n", *num, offset,
                  (char *)c->name, c);
         if (!c) {
@@ -906,11 +1454,16 @@ static int cache_add_entry(STRUCT_ENTRY *e, struct xtc_handle *h,
         }
         h->num_chains++; /* New user defined chain */
 
-        __iptcc_p_add_chain(h, c, offset, num);
+        __iptcc_p_del_policy(h, *num);
+        if (__iptcc_p_add_chain(h, c, offset, num) < 0) {
+            iptcc_free_chain_head(h, c);
+            errno = ENOMEM;
+            return -1;
+        }
 
     } else if ((builtin = iptcb_ent_is_hook_entry(e, h)) != 0) {
         struct chain_head *c =
-            iptcc_alloc_chain_head((char *)hooknames[builtin - 1], builtin);
+            iptcc_alloc_chain_head(h, (char *)hooknames[builtin - 1], builtin);
         DEBUGP_C("%u:%u new builtin chain: %p (rules=%p)\n", *num, offset, c,
                  &c->rules);
         if (!c) {
@@ -920,7 +1473,12 @@ static int cache_add_entry(STRUCT_ENTRY *e, struct xtc_handle *h,
 
         c->hooknum = builtin;
 
-        __iptcc_p_add_chain(h, c, offset, num);
+        __iptcc_p_del_policy(h, *num);
+        if (__iptcc_p_add_chain(h, c, offset, num) < 0) {
+            iptcc_free_chain_head(h, c);
+            errno = ENOMEM;
+            return -1;
+        }
 
         /* FIXME: this is ugly. */
         goto new_rule;
@@ -929,7 +1487,7 @@ static int cache_add_entry(STRUCT_ENTRY *e, struct xtc_handle *h,
         struct rule_head *r;
     new_rule:
 
-        if (!(r = iptcc_alloc_rule(h->chain_iterator_cur, e->next_offset))) {
+        if (!(r = iptcc_alloc_rule(h, h->chain_iterator_cur, e->next_offset))) {
             errno = ENOMEM;
             return -1;
         }
@@ -949,7 +1507,7 @@ static int cache_add_entry(STRUCT_ENTRY *e, struct xtc_handle *h,
             if (t->target.u.target_size !=
                 ALIGN(sizeof(STRUCT_STANDARD_TARGET))) {
                 errno = EINVAL;
-                free(r);
+                iptcc_free_rule(h, r);
                 return -1;
             }
 
@@ -959,9 +1517,13 @@ static int cache_add_entry(STRUCT_ENTRY *e, struct xtc_handle *h,
             } else if (t->verdict == r->offset + e->next_offset) {
                 DEBUGP_C("fallthrough\n");
                 r->type = IPTCC_R_FALLTHROUGH;
+                h->chain_iterator_cur->num_jumps++;
             } else {
                 DEBUGP_C("jump, target=%u\n", t->verdict);
                 r->type = IPTCC_R_JUMP;
+                h->chain_iterator_cur->num_jumps++;
+                if ((unsigned int)t->verdict > h->chain_iterator_cur->max_jump)
+                    h->chain_iterator_cur->max_jump = t->verdict;
                 /* Jump target fixup has to be deferred
                  * until second pass, since we migh not
                  * yet have parsed the target */
@@ -979,9 +1541,107 @@ out_inc:
     return 0;
 }
 
+/* Read-only handles don't copy the rules, a chain only records where its
+ * rules are in the blob: they start right after the chain head (or at it,
+ * for builtin chains) and end at the policy/return entry at foot_offset.
+ */
+static inline unsigned int iptcc_ro_rules_offset(struct xtc_handle *h,
+                                                 struct chain_head *c) {
+    if (iptcc_is_builtin(c))
+        return c->head_offset;
+    return c->head_offset + iptcb_get_entry(h, c->head_offset)->next_offset;
+}
+
+/* Counterpart of __iptcc_p_del_policy for read-only handles: the previous
+ * entry is the policy rule of the current chain. */
+static void __iptcc_p_ro_end_chain(struct xtc_handle *h, STRUCT_ENTRY *foot,
+                                   unsigned int num) {
+    struct chain_head *c = h->chain_iterator_cur;
+
+    if (!c)
+        return;
+
+    c->verdict = *(const int *)GET_TARGET(foot)->data;
+    c->counter_map.maptype = COUNTER_MAP_ZEROED;
+    c->counter_map.mappos = num - 1;
+    memcpy(&c->counters, &foot->counters, sizeof(c->counters));
+
+    c->foot_index = num - 1;
+    c->blob_foot_index = num - 1;
+    c->foot_offset = iptcb_entry2offset(h, foot);
+    c->num_rules = c->foot_index - c->index - (iptcc_is_builtin(c) ? 0 : 1);
+}
+
+/* read-only parser function: only chains are added to the cache */
+static int cache_add_entry_ro(STRUCT_ENTRY *e, struct xtc_handle *h,
+                              STRUCT_ENTRY **prev, unsigned int *num) {
+    unsigned int builtin;
+    unsigned int offset = iptcb_entry2offset(h, e);
+    struct chain_head *c;
+
+    if (offset + e->next_offset == h->entries->size) {
+        /* This is the ERROR node at the end of the table */
+        __iptcc_p_ro_end_chain(h, *prev, *num);
+        h->chain_iterator_cur = NULL;
+        goto out_inc;
+    }
+
+    if (strcmp(GET_TARGET(e)->u.user.name, ERROR_TARGET) == 0) {
+        c = iptcc_alloc_chain_head(h, (const char *)GET_TARGET(e)->data, 0);
+        if (!c) {
+            errno = ENOMEM;
+            return -1;
+        }
+        h->num_chains++; /* New user defined chain */
+    } else if ((builtin = iptcb_ent_is_hook_entry(e, h)) != 0) {
+        c = iptcc_alloc_chain_head(h, (char *)hooknames[builtin - 1], builtin);
+        if (!c) {
+            errno = ENOMEM;
+            return -1;
+        }
+    } else {
+        goto out_inc;
+    }
+
+    DEBUGP_C("%u:%u: new chain %s\n", *num, offset, c->name);
+    __iptcc_p_ro_end_chain(h, *prev, *num);
+    if (__iptcc_p_add_chain(h, c, offset, num) < 0) {
+        iptcc_free_chain_head(h, c);
+        errno = ENOMEM;
+        return -1;
+    }
+
+out_inc:
+    *prev = e;
+    (*num)++;
+    return 0;
+}
+
+/* count the references of read-only chains, as parse_table does by
+ * resolving the jumps */
+static int iptcc_ro_count_references(struct xtc_handle *h,
+                                     struct chain_head *c) {
+    unsigned int offset = iptcc_ro_rules_offset(h, c);
+
+    while (offset < c->foot_offset) {
+        STRUCT_ENTRY *e = iptcb_get_entry(h, offset);
+        STRUCT_STANDARD_TARGET *t = (STRUCT_STANDARD_TARGET *)GET_TARGET(e);
+
+        if (strcmp(t->target.u.user.name, STANDARD_TARGET) == 0 &&
+            t->verdict >= 0 && t->verdict != offset + e->next_offset) {
+            struct chain_head *lc = iptcc_find_chain_by_offset(h, t->verdict);
+            if (!lc)
+                return -1;
+            lc->references++;
+        }
+        offset += e->next_offset;
+    }
+    return 0;
+}
+
 /* parse an iptables blob into it's pieces */
 static int parse_table(struct xtc_handle *h) {
-    STRUCT_ENTRY *prev;
+    STRUCT_ENTRY *prev = NULL;
     unsigned int num = 0;
     struct chain_head *c;
 
@@ -990,8 +1650,12 @@ static int parse_table(struct xtc_handle *h) {
     h->sorted_offsets = 1;
 
     /* First pass: over ruleset blob */
-    ENTRY_ITERATE(h->entries->entrytable, h->entries->size, cache_add_entry, h,
-                  &prev, &num);
+    if (h->readonly)
+        ENTRY_ITERATE(h->entries->entrytable, h->entries->size,
+                      cache_add_entry_ro, h, &prev, &num);
+    else
+        ENTRY_ITERATE(h->entries->entrytable, h->entries->size,
+                      cache_add_entry, h, &prev, &num);
 
     /* Build the chain index, used for chain list search speedup */
     if ((iptcc_chain_index_alloc(h)) < 0)
@@ -1001,6 +1665,13 @@ static int parse_table(struct xtc_handle *h) {
     /* Second pass: fixup parsed data from first pass */
     list_for_each_entry(c, &h->chains, list) {
         struct rule_head *r;
+
+        if (h->readonly) {
+            if (iptcc_ro_count_references(h, c) < 0)
+                return -1;
+            continue;
+        }
+
         list_for_each_entry(r, &c->rules, list) {
             struct chain_head *lc;
             STRUCT_STANDARD_TARGET *t;
@@ -1071,6 +1742,47 @@ static inline int iptcc_compile_rule(struct xtc_handle *h, STRUCT_REPLACE *repl,
     return 1;
 }
 
+/* copy the rules of a clean chain from the blob we got from the kernel,
+ * only fixing up the verdicts that depend on offsets */
+static void iptcc_compile_clean_rules(struct xtc_handle *h,
+                                      STRUCT_REPLACE *repl,
+                                      struct chain_head *c) {
+    struct rule_head *first, *last, *r;
+    unsigned int start, delta;
+
+    first = list_entry(c->rules.next, struct rule_head, list);
+    last = list_entry(c->rules.prev, struct rule_head, list);
+
+    /* rules end where the chain foot starts */
+    start = c->foot_offset - (last->offset + last->size - first->offset);
+    memcpy((char *)repl->entries + start, iptcb_get_entry(h, first->offset),
+           last->offset + last->size - first->offset);
+
+    /* Offsets before the first change are the same as in the blob, as
+     * long as neither this chain nor its jump targets moved there is
+     * nothing left to do. */
+    if (c->num_jumps == 0 || (c->head_offset == c->blob_head_offset &&
+                              c->max_jump < h->dirty_offset))
+        return;
+
+    DEBUGP("%s: fixing up %u jumps\n", c->name, c->num_jumps);
+    delta = start - first->offset;
+    list_for_each_entry(r, &c->rules, list) {
+        STRUCT_STANDARD_TARGET *t;
+        unsigned int offset = r->offset + delta;
+
+        if (r->type != IPTCC_R_JUMP && r->type != IPTCC_R_FALLTHROUGH)
+            continue;
+
+        t = (STRUCT_STANDARD_TARGET *)GET_TARGET(
+            (STRUCT_ENTRY *)((char *)repl->entries + offset));
+        if (r->type == IPTCC_R_JUMP)
+            t->verdict = r->jump->head_offset + IPTCB_CHAIN_START_SIZE;
+        else
+            t->verdict = offset + r->size;
+    }
+}
+
 /* compile chain from cache into blob */
 static int iptcc_compile_chain(struct xtc_handle *h, STRUCT_REPLACE *repl,
                                struct chain_head *c) {
@@ -1094,10 +1806,15 @@ static int iptcc_compile_chain(struct xtc_handle *h, STRUCT_REPLACE *repl,
     }
 
     /* iterate over rules */
-    list_for_each_entry(r, &c->rules, list) {
-        ret = iptcc_compile_rule(h, repl, r);
-        if (ret < 0)
-            return ret;
+    if (!c->dirty) {
+        if (c->num_rules)
+            iptcc_compile_clean_rules(h, repl, c);
+    } else {
+        list_for_each_entry(r, &c->rules, list) {
+            ret = iptcc_compile_rule(h, repl, r);
+            if (ret < 0)
+                return ret;
+        }
     }
 
     /* put chain footer in place */
@@ -1133,12 +1850,25 @@ static int iptcc_compile_chain_offsets(struct xtc_handle *h,
         (*num)++;
     }
 
-    list_for_each_entry(r, &c->rules, list) {
-        DEBUGP("rule %u, offset=%u, index=%u\n", *num, *offset, *num);
-        r->offset = *offset;
-        r->index = *num;
-        *offset += r->size;
-        (*num)++;
+    if (!c->dirty) {
+        /* Rules of clean chains keep their blob offsets, only the
+         * space they occupy is needed */
+        if (c->num_rules) {
+            struct rule_head *first, *last;
+
+            first = list_entry(c->rules.next, struct rule_head, list);
+            last = list_entry(c->rules.prev, struct rule_head, list);
+            *offset += last->offset + last->size - first->offset;
+            *num += c->num_rules;
+        }
+    } else {
+        list_for_each_entry(r, &c->rules, list) {
+            DEBUGP("rule %u, offset=%u, index=%u\n", *num, *offset, *num);
+            r->offset = *offset;
+            r->index = *num;
+            *offset += r->size;
+            (*num)++;
+        }
     }
 
     DEBUGP("%s; chain_foot %u, offset=%u, index=%u\n", c->name, *num, *offset,
@@ -1157,11 +1887,20 @@ static int iptcc_compile_table_prep(struct xtc_handle *h, unsigned int *size) {
     unsigned int offset = 0, num = 0;
     int ret = 0;
 
+    /* Everything in front of the first changed chain keeps its
+     * offset.  Unsorted chains were moved around by the parser, so
+     * nothing can be assumed about them. */
+    h->dirty_offset = h->sorted_offsets ? UINT_MAX : 0;
+
     /* First pass: calculate offset for every rule */
     list_for_each_entry(c, &h->chains, list) {
         ret = iptcc_compile_chain_offsets(h, c, &offset, &num);
         if (ret < 0)
             return ret;
+
+        if (h->dirty_offset == UINT_MAX &&
+            (c->dirty || c->head_offset != c->blob_head_offset))
+            h->dirty_offset = c->head_offset;
     }
 
     /* Append one error rule at end of chain */
@@ -1229,7 +1968,83 @@ out_free_handle:
     return NULL;
 }
 
-struct xtc_handle *TC_INIT(const char *tablename) {
+/* Set up the builtin chains of an empty table, see TC_INIT_FLUSHED */
+static int iptcc_init_builtins(struct xtc_handle *h) {
+    unsigned int i;
+
+    h->sorted_offsets = 1;
+    for (i = 0; i < NUMHOOKS; i++) {
+        struct chain_head *c;
+
+        if (!(h->info.valid_hooks & (1 << i)))
+            continue;
+
+        c = iptcc_alloc_chain_head(h, hooknames[i], i + 1);
+        if (!c || iptcc_chain_hash_add(h, c) < 0) {
+            errno = ENOMEM;
+            return -1;
+        }
+        /* no rules to copy from the blob, always compile them */
+        c->dirty = 1;
+        c->verdict = -NF_ACCEPT - 1;
+        list_add_tail(&c->list, &h->chains);
+        h->unknown_policies |= 1 << i;
+    }
+
+    if (iptcc_chain_index_alloc(h) < 0)
+        return -1;
+
+    /* Committing the empty table flushes the kernel's */
+    set_changed(h);
+    return 1;
+}
+
+/* Fetch the table to learn the policies of builtin chains that were not
+ * set on a handle from TC_INIT_FLUSHED.  Their counters are treated like
+ * those of a parsed table. */
+static int iptcc_fetch_policies(struct xtc_handle *h) {
+    STRUCT_GET_ENTRIES *entries;
+    struct chain_head *c;
+    socklen_t tmp;
+
+    if (!h->unknown_policies)
+        return 1;
+
+    entries = realloc(h->entries, sizeof(STRUCT_GET_ENTRIES) + h->info.size);
+    if (!entries) {
+        errno = ENOMEM;
+        return 0;
+    }
+    h->entries = entries;
+    h->entries->size = h->info.size;
+
+    /* Fails with EAGAIN if the table changed since TC_INIT_FLUSHED */
+    tmp = sizeof(STRUCT_GET_ENTRIES) + h->info.size;
+    if (getsockopt(h->sockfd, TC_IPPROTO, SO_GET_ENTRIES, h->entries, &tmp) < 0)
+        return 0;
+
+    list_for_each_entry(c, &h->chains, list) {
+        unsigned int offset;
+        STRUCT_ENTRY *e;
+
+        if (!iptcc_is_builtin(c) ||
+            !(h->unknown_policies & (1 << (c->hooknum - 1))))
+            continue;
+
+        offset = h->info.underflow[c->hooknum - 1];
+        e = iptcb_get_entry(h, offset);
+        c->verdict = *(const int *)GET_TARGET(e)->data;
+        c->counters = e->counters;
+        c->counter_map.maptype = COUNTER_MAP_ZEROED;
+        c->counter_map.mappos = iptcb_offset2index(h, offset);
+    }
+    h->unknown_policies = 0;
+
+    return 1;
+}
+
+static struct xtc_handle *iptcc_init(const char *tablename, int readonly,
+                                     int flushed) {
     struct xtc_handle *h;
     STRUCT_GETINFO info;
     unsigned int tmp;
@@ -1264,7 +2079,8 @@ retry:
     DEBUGP("valid_hooks=0x%08x, num_entries=%u, size=%u\n", info.valid_hooks,
            info.num_entries, info.size);
 
-    if ((h = alloc_handle(info.name, info.size, info.num_entries)) == NULL) {
+    if ((h = alloc_handle(info.name, flushed ? 0 : info.size,
+                          info.num_entries)) == NULL) {
         close(sockfd);
         return NULL;
     }
@@ -1272,6 +2088,14 @@ retry:
     /* Initialize current state */
     h->sockfd = sockfd;
     h->info = info;
+    h->readonly = readonly;
+
+    if (flushed) {
+        if (iptcc_init_builtins(h) < 0)
+            goto error;
+        CHECK(h);
+        return h;
+    }
 
     h->entries->size = h->info.size;
 
@@ -1304,26 +2128,123 @@ error:
     return NULL;
 }
 
-void TC_FREE(struct xtc_handle *h) {
-    struct chain_head *c, *tmp;
+struct xtc_handle *TC_INIT(const char *tablename) {
+    return iptcc_init(tablename, 0, 0);
+}
 
-    iptc_fn = TC_FREE;
-    close(h->sockfd);
+/* Open a table for reading only.  The rules are not copied out of the
+ * blob returned by the kernel, the chain and rule iterators, targets and
+ * counters point straight into it.  Any attempt to change the table
+ * fails with EROFS. */
+struct xtc_handle *TC_INIT_RO(const char *tablename) {
+    return iptcc_init(tablename, 1, 0);
+}
 
-    list_for_each_entry_safe(c, tmp, &h->chains, list) {
-        struct rule_head *r, *rtmp;
+/* Open a table to replace it as a whole, as iptables-restore does when
+ * not told otherwise.  Only the table info is read; the handle starts
+ * out with empty builtin chains and no user defined chains, as if they
+ * had all been flushed and deleted.  Builtin chains keep their policy
+ * unless it is set, it is only fetched from the kernel if needed. */
+struct xtc_handle *TC_INIT_FLUSHED(const char *tablename) {
+    return iptcc_init(tablename, 0, 1);
+}
 
-        list_for_each_entry_safe(r, rtmp, &c->rules, list) { free(r); }
+/* Release the parsed representation of the table */
+static void iptcc_free_cache(struct xtc_handle *h) {
+    struct chain_head *c;
 
-        free(c);
+    list_for_each_entry(c, &h->chains, list) {
+        iptcc_rule_index_free(c);
+        iptcc_rule_hash_free(c);
     }
 
+    iptcc_arena_reset(h);
+    INIT_LIST_HEAD(&h->chains);
+    h->num_chains = 0;
+    h->chain_iterator_cur = NULL;
+    h->rule_iterator_cur = NULL;
+    h->rule_iterator_chain = NULL;
+
     iptcc_chain_index_free(h);
+    iptcc_chain_hash_free(h);
+}
+
+void TC_FREE(struct xtc_handle *h) {
+    iptc_fn = TC_FREE;
+    close(h->sockfd);
+
+    iptcc_free_cache(h);
+    iptcc_arena_release(h);
 
     free(h->entries);
     free(h);
 }
 
+/* Make a handle kept across transactions match the kernel again.  The
+ * table is only fetched and parsed again if the kernel's copy differs
+ * in size, number of entries or hook offsets from what we last read
+ * or committed, or if the handle holds uncommitted changes.  Calling
+ * this also makes TC_COMMIT keep the cache in sync with the table it
+ * pushed, so the handle can be reused for the next transaction.
+ *
+ * Note that the check is based on the table layout only; a same sized
+ * replacement by another process goes unnoticed, so this is meant for
+ * a single writer.  Counters are those of the last fetch or commit. */
+int TC_REFRESH(struct xtc_handle *handle) {
+    STRUCT_GET_ENTRIES *entries;
+    STRUCT_GETINFO info;
+    unsigned int tmp;
+    socklen_t s;
+
+    iptc_fn = TC_REFRESH;
+    handle->reuse = 1;
+
+retry:
+    s = sizeof(info);
+    strcpy(info.name, handle->info.name);
+    if (getsockopt(handle->sockfd, TC_IPPROTO, SO_GET_INFO, &info, &s) < 0)
+        return 0;
+
+    if (!handle->changed && !handle->counters_changed &&
+        !iptcc_arena_fragmented(handle) &&
+        memcmp(&info, &handle->info, sizeof(info)) == 0) {
+        DEBUGP("table `%s' unchanged, reusing cache\n", info.name);
+        return 1;
+    }
+
+    DEBUGP("valid_hooks=0x%08x, num_entries=%u, size=%u\n", info.valid_hooks,
+           info.num_entries, info.size);
+
+    iptcc_free_cache(handle);
+    /* Until the table is parsed again, the cache is unusable */
+    handle->changed = 1;
+
+    entries = realloc(handle->entries, sizeof(STRUCT_GET_ENTRIES) + info.size);
+    if (!entries) {
+        errno = ENOMEM;
+        return 0;
+    }
+    handle->entries = entries;
+    handle->info = info;
+    handle->entries->size = info.size;
+
+    tmp = sizeof(STRUCT_GET_ENTRIES) + info.size;
+    if (getsockopt(handle->sockfd, TC_IPPROTO, SO_GET_ENTRIES, handle->entries,
+                   &tmp) < 0) {
+        /* A different process changed the ruleset size, retry */
+        if (errno == EAGAIN)
+            goto retry;
+        return 0;
+    }
+
+    if (parse_table(handle) < 0)
+        return 0;
+
+    handle->changed = 0;
+    CHECK(handle);
+    return 1;
+}
+
 static inline int print_match(const STRUCT_ENTRY_MATCH *m) {
     printf("Match name: `%s'\n", m->u.user.name);
     return 0;
@@ -1422,6 +2343,15 @@ const STRUCT_ENTRY *TC_FIRST_RULE(const char *chain,
         return NULL;
     }
 
+    if (handle->readonly) {
+        if (c->num_rules == 0) {
+            DEBUGP_C("no rules, returning NULL\n");
+            return NULL;
+        }
+        handle->rule_iterator_chain = c;
+        return iptcb_get_entry(handle, iptcc_ro_rules_offset(handle, c));
+    }
+
     /* Empty chain: single return/policy rule */
     if (list_empty(&c->rules)) {
         DEBUGP_C("no rules, returning NULL\n");
@@ -1441,6 +2371,22 @@ const STRUCT_ENTRY *TC_NEXT_RULE(const STRUCT_ENTRY *prev,
     struct rule_head *r;
 
     iptc_fn = TC_NEXT_RULE;
+
+    if (handle->readonly) {
+        unsigned int offset;
+
+        if (!handle->rule_iterator_chain)
+            return NULL;
+
+        offset = iptcb_entry2offset(handle, (STRUCT_ENTRY *)prev) +
+                 prev->next_offset;
+        if (offset >= handle->rule_iterator_chain->foot_offset) {
+            handle->rule_iterator_chain = NULL;
+            return NULL;
+        }
+        return iptcb_get_entry(handle, offset);
+    }
+
     DEBUGP("rule_iterator_cur=%p...", handle->rule_iterator_cur);
 
     if (handle->rule_iterator_cur == NULL) {
@@ -1493,6 +2439,27 @@ static const char *standard_target_map(int verdict) {
     return NULL;
 }
 
+/* Same as TC_GET_TARGET, but decoding the target from the blob, as
+ * read-only handles don't classify the rules. */
+static const char *iptcc_ro_get_target(struct xtc_handle *h, STRUCT_ENTRY *e) {
+    STRUCT_ENTRY_TARGET *t = GET_TARGET(e);
+    struct chain_head *c;
+    int verdict;
+
+    if (strcmp(t->u.user.name, STANDARD_TARGET) != 0)
+        return t->u.user.name;
+
+    verdict = *(const int *)t->data;
+    if (verdict < 0)
+        return standard_target_map(verdict);
+
+    if (verdict == iptcb_entry2offset(h, e) + e->next_offset)
+        return "";
+
+    c = iptcc_find_chain_by_offset(h, verdict);
+    return c ? c->name : NULL;
+}
+
 /* Returns a pointer to the target name of this position. */
 const char *TC_GET_TARGET(const STRUCT_ENTRY *ce, struct xtc_handle *handle) {
     STRUCT_ENTRY *e = (STRUCT_ENTRY *)ce;
@@ -1501,6 +2468,9 @@ const char *TC_GET_TARGET(const STRUCT_ENTRY *ce, struct xtc_handle *handle) {
 
     iptc_fn = TC_GET_TARGET;
 
+    if (handle->readonly)
+        return iptcc_ro_get_target(handle, e);
+
     switch (r->type) {
         int spos;
     case IPTCC_R_FALLTHROUGH:
@@ -1555,6 +2525,10 @@ const char *TC_GET_POLICY(const char *chain, STRUCT_COUNTERS *counters,
     if (!iptcc_is_builtin(c))
         return NULL;
 
+    if ((handle->unknown_policies & (1 << (c->hooknum - 1))) &&
+        !iptcc_fetch_policies(handle))
+        return NULL;
+
     *counters = c->counters;
 
     return standard_target_map(c->verdict);
@@ -1637,6 +2611,8 @@ int TC_INSERT_ENTRY(const IPT_CHAINLABEL chain, const STRUCT_ENTRY *e,
     struct list_head *prev;
 
     iptc_fn = TC_INSERT_ENTRY;
+    if (!iptcc_writable(handle))
+        return 0;
 
     if (!(c = iptcc_find_label(chain, handle))) {
         errno = ENOENT;
@@ -1655,15 +2631,12 @@ int TC_INSERT_ENTRY(const IPT_CHAINLABEL chain, const STRUCT_ENTRY *e,
        prev points to. */
     if (rulenum == c->num_rules) {
         prev = &c->rules;
-    } else if (rulenum + 1 <= c->num_rules / 2) {
-        r = iptcc_get_rule_num(c, rulenum + 1);
-        prev = &r->list;
     } else {
-        r = iptcc_get_rule_num_reverse(c, c->num_rules - rulenum);
+        r = iptcc_get_rule_num(c, rulenum + 1);
         prev = &r->list;
     }
 
-    if (!(r = iptcc_alloc_rule(c, e->next_offset))) {
+    if (!(r = iptcc_alloc_rule(handle, c, e->next_offset))) {
         errno = ENOMEM;
         return 0;
     }
@@ -1672,14 +2645,16 @@ int TC_INSERT_ENTRY(const IPT_CHAINLABEL chain, const STRUCT_ENTRY *e,
     r->counter_map.maptype = COUNTER_MAP_SET;
 
     if (!iptcc_map_target(handle, r, false)) {
-        free(r);
+        iptcc_free_rule(handle, r);
         return 0;
     }
 
     list_add_tail(&r->list, prev);
+    iptcc_rule_index_insert(c, rulenum, r);
     c->num_rules++;
+    iptcc_rule_hash_add(c, r);
 
-    set_changed(handle);
+    set_chain_changed(handle, c);
 
     return 1;
 }
@@ -1691,6 +2666,8 @@ int TC_REPLACE_ENTRY(const IPT_CHAINLABEL chain, const STRUCT_ENTRY *e,
     struct rule_head *r, *old;
 
     iptc_fn = TC_REPLACE_ENTRY;
+    if (!iptcc_writable(handle))
+        return 0;
 
     if (!(c = iptcc_find_label(chain, handle))) {
         errno = ENOENT;
@@ -1702,14 +2679,9 @@ int TC_REPLACE_ENTRY(const IPT_CHAINLABEL chain, const STRUCT_ENTRY *e,
         return 0;
     }
 
-    /* Take advantage of the double linked list if possible. */
-    if (rulenum + 1 <= c->num_rules / 2) {
-        old = iptcc_get_rule_num(c, rulenum + 1);
-    } else {
-        old = iptcc_get_rule_num_reverse(c, c->num_rules - rulenum);
-    }
+    old = iptcc_get_rule_num(c, rulenum + 1);
 
-    if (!(r = iptcc_alloc_rule(c, e->next_offset))) {
+    if (!(r = iptcc_alloc_rule(handle, c, e->next_offset))) {
         errno = ENOMEM;
         return 0;
     }
@@ -1718,14 +2690,16 @@ int TC_REPLACE_ENTRY(const IPT_CHAINLABEL chain, const STRUCT_ENTRY *e,
     r->counter_map.maptype = COUNTER_MAP_SET;
 
     if (!iptcc_map_target(handle, r, false)) {
-        free(r);
+        iptcc_free_rule(handle, r);
         return 0;
     }
 
     list_add(&r->list, &old->list);
-    iptcc_delete_rule(old);
+    iptcc_delete_rule(handle, old);
+    iptcc_rule_index_replace(c, rulenum, r);
+    iptcc_rule_hash_add(c, r);
 
-    set_changed(handle);
+    set_chain_changed(handle, c);
 
     return 1;
 }
@@ -1738,13 +2712,15 @@ int TC_APPEND_ENTRY(const IPT_CHAINLABEL chain, const STRUCT_ENTRY *e,
     struct rule_head *r;
 
     iptc_fn = TC_APPEND_ENTRY;
+    if (!iptcc_writable(handle))
+        return 0;
     if (!(c = iptcc_find_label(chain, handle))) {
         DEBUGP("unable to find chain `%s'\n", chain);
         errno = ENOENT;
         return 0;
     }
 
-    if (!(r = iptcc_alloc_rule(c, e->next_offset))) {
+    if (!(r = iptcc_alloc_rule(handle, c, e->next_offset))) {
         DEBUGP("unable to allocate rule for chain `%s'\n", chain);
         errno = ENOMEM;
         return 0;
@@ -1755,14 +2731,16 @@ int TC_APPEND_ENTRY(const IPT_CHAINLABEL chain, const STRUCT_ENTRY *e,
 
     if (!iptcc_map_target(handle, r, false)) {
         DEBUGP("unable to map target of rule for chain `%s'\n", chain);
-        free(r);
+        iptcc_free_rule(handle, r);
         return 0;
     }
 
     list_add_tail(&r->list, &c->rules);
+    iptcc_rule_index_insert(c, c->num_rules, r);
     c->num_rules++;
+    iptcc_rule_hash_add(c, r);
 
-    set_changed(handle);
+    set_chain_changed(handle, c);
 
     return 1;
 }
@@ -1830,6 +2808,60 @@ static inline int target_same(struct rule_head *a, struct rule_head *b,
 static unsigned char *is_same(const STRUCT_ENTRY *a, const STRUCT_ENTRY *b,
                               unsigned char *matchmask);
 
+static inline int rule_same(struct rule_head *a, struct rule_head *b,
+                            unsigned char *matchmask) {
+    unsigned char *mask = is_same(a->entry, b->entry, matchmask);
+
+    return mask && target_same(a, b, mask);
+}
+
+/* Find the first rule of chain `c' matching `r', and its position
+ * (0-based), by walking the rules */
+static struct rule_head *iptcc_find_rule(struct chain_head *c,
+                                         struct rule_head *r,
+                                         unsigned char *matchmask,
+                                         unsigned int *pos) {
+    struct rule_head *i;
+
+    *pos = 0;
+    list_for_each_entry(i, &c->rules, list) {
+        if (rule_same(r, i, matchmask))
+            return i;
+        (*pos)++;
+    }
+    return NULL;
+}
+
+/* Same as iptcc_find_rule(), using the rule hash and index of `c'.  If
+ * `any' is set, the match found first is returned and `*pos' is left
+ * alone. */
+static struct rule_head *iptcc_find_rule_hashed(struct chain_head *c,
+                                                struct rule_head *r,
+                                                unsigned char *matchmask,
+                                                bool any, unsigned int *pos) {
+    unsigned int hash = iptcc_rule_fingerprint(r);
+    struct rule_head *found = NULL;
+    struct hlist_node *n;
+
+    hlist_for_each(n, iptcc_rule_hash_bucket(c, hash)) {
+        struct rule_head *i = hlist_entry(n, struct rule_head, hnode);
+        unsigned int p;
+
+        if (i->fingerprint != hash || !rule_same(r, i, matchmask))
+            continue;
+        if (any)
+            return i;
+
+        /* duplicates end up in the same bucket, keep the first one */
+        p = iptcc_rule_index_pos(c, i);
+        if (!found || p < *pos) {
+            found = i;
+            *pos = p;
+        }
+    }
+    return found;
+}
+
 /* find the first rule in `chain' which matches `fw' and remove it unless
  * dry_run is set */
 static int delete_entry(const IPT_CHAINLABEL chain, const STRUCT_ENTRY *origfw,
@@ -1837,15 +2869,18 @@ static int delete_entry(const IPT_CHAINLABEL chain, const STRUCT_ENTRY *origfw,
                         bool dry_run) {
     struct chain_head *c;
     struct rule_head *r, *i;
+    unsigned int pos;
 
     iptc_fn = TC_DELETE_ENTRY;
+    if (!iptcc_writable(handle))
+        return 0;
     if (!(c = iptcc_find_label(chain, handle))) {
         errno = ENOENT;
         return 0;
     }
 
     /* Create a rule_head from origfw. */
-    r = iptcc_alloc_rule(c, origfw->next_offset);
+    r = iptcc_alloc_rule(NULL, c, origfw->next_offset);
     if (!r) {
         errno = ENOMEM;
         return 0;
@@ -1866,41 +2901,42 @@ static int delete_entry(const IPT_CHAINLABEL chain, const STRUCT_ENTRY *origfw,
             r->jump->references--;
     }
 
-    list_for_each_entry(i, &c->rules, list) {
-        unsigned char *mask;
-
-        mask = is_same(r->entry, i->entry, matchmask);
-        if (!mask)
-            continue;
-
-        if (!target_same(r, i, mask))
-            continue;
-
-        /* if we are just doing a dry run, we simply skip the rest */
-        if (dry_run) {
-            free(r);
-            return 1;
-        }
+    if (c->num_rules >= IPTCC_RULE_INDEX_MIN) {
+        if (!c->rule_hash)
+            iptcc_rule_hash_build(c);
+        if (!c->rule_chunks)
+            iptcc_rule_index_build(c);
+    }
 
-        /* If we are about to delete the rule that is the
-         * current iterator, move rule iterator back.  next
-         * pointer will then point to real next node */
-        if (i == handle->rule_iterator_cur) {
-            handle->rule_iterator_cur = list_entry(
-                handle->rule_iterator_cur->list.prev, struct rule_head, list);
-        }
+    if (c->rule_hash && c->rule_chunks)
+        i = iptcc_find_rule_hashed(c, r, matchmask, dry_run, &pos);
+    else
+        i = iptcc_find_rule(c, r, matchmask, &pos);
+    free(r);
 
-        c->num_rules--;
-        iptcc_delete_rule(i);
+    if (!i) {
+        errno = ENOENT;
+        return 0;
+    }
 
-        set_changed(handle);
-        free(r);
+    /* if we are just doing a dry run, we simply skip the rest */
+    if (dry_run)
         return 1;
+
+    /* If we are about to delete the rule that is the
+     * current iterator, move rule iterator back.  next
+     * pointer will then point to real next node */
+    if (i == handle->rule_iterator_cur) {
+        handle->rule_iterator_cur = list_entry(
+            handle->rule_iterator_cur->list.prev, struct rule_head, list);
     }
 
-    free(r);
-    errno = ENOENT;
-    return 0;
+    iptcc_rule_index_remove(c, pos);
+    c->num_rules--;
+    iptcc_delete_rule(handle, i);
+
+    set_chain_changed(handle, c);
+    return 1;
 }
 
 /* check whether a specified rule is present */
@@ -1923,6 +2959,8 @@ int TC_DELETE_NUM_ENTRY(const IPT_CHAINLABEL chain, unsigned int rulenum,
     struct rule_head *r;
 
     iptc_fn = TC_DELETE_NUM_ENTRY;
+    if (!iptcc_writable(handle))
+        return 0;
 
     if (!(c = iptcc_find_label(chain, handle))) {
         errno = ENOENT;
@@ -1934,12 +2972,7 @@ int TC_DELETE_NUM_ENTRY(const IPT_CHAINLABEL chain, unsigned int rulenum,
         return 0;
     }
 
-    /* Take advantage of the double linked list if possible. */
-    if (rulenum + 1 <= c->num_rules / 2) {
-        r = iptcc_get_rule_num(c, rulenum + 1);
-    } else {
-        r = iptcc_get_rule_num_reverse(c, c->num_rules - rulenum);
-    }
+    r = iptcc_get_rule_num(c, rulenum + 1);
 
     /* If we are about to delete the rule that is the current
      * iterator, move rule iterator back.  next pointer will then
@@ -1949,10 +2982,11 @@ int TC_DELETE_NUM_ENTRY(const IPT_CHAINLABEL chain, unsigned int rulenum,
             handle->rule_iterator_cur->list.prev, struct rule_head, list);
     }
 
+    iptcc_rule_index_remove(c, rulenum);
     c->num_rules--;
-    iptcc_delete_rule(r);
+    iptcc_delete_rule(handle, r);
 
-    set_changed(handle);
+    set_chain_changed(handle, c);
 
     return 1;
 }
@@ -1963,16 +2997,22 @@ int TC_FLUSH_ENTRIES(const IPT_CHAINLABEL chain, struct xtc_handle *handle) {
     struct rule_head *r, *tmp;
 
     iptc_fn = TC_FLUSH_ENTRIES;
+    if (!iptcc_writable(handle))
+        return 0;
     if (!(c = iptcc_find_label(chain, handle))) {
         errno = ENOENT;
         return 0;
     }
 
-    list_for_each_entry_safe(r, tmp, &c->rules, list) { iptcc_delete_rule(r); }
+    iptcc_rule_hash_free(c);
+    list_for_each_entry_safe(r, tmp, &c->rules, list) {
+        iptcc_delete_rule(handle, r);
+    }
 
     c->num_rules = 0;
+    iptcc_rule_index_free(c);
 
-    set_changed(handle);
+    set_chain_changed(handle, c);
 
     return 1;
 }
@@ -1983,6 +3023,8 @@ int TC_ZERO_ENTRIES(const IPT_CHAINLABEL chain, struct xtc_handle *handle) {
     struct rule_head *r;
 
     iptc_fn = TC_ZERO_ENTRIES;
+    if (!iptcc_writable(handle))
+        return 0;
     if (!(c = iptcc_find_label(chain, handle))) {
         errno = ENOENT;
         return 0;
@@ -1996,7 +3038,7 @@ int TC_ZERO_ENTRIES(const IPT_CHAINLABEL chain, struct xtc_handle *handle) {
             r->counter_map.maptype = COUNTER_MAP_ZEROED;
     }
 
-    set_changed(handle);
+    set_counters_changed(handle, c);
 
     return 1;
 }
@@ -2015,6 +3057,19 @@ STRUCT_COUNTERS *TC_READ_COUNTER(const IPT_CHAINLABEL chain,
         return NULL;
     }
 
+    if (handle->readonly) {
+        STRUCT_ENTRY *e;
+
+        if (rulenum == 0 || rulenum > c->num_rules) {
+            errno = E2BIG;
+            return NULL;
+        }
+        e = iptcb_get_entry(handle, iptcc_ro_rules_offset(handle, c));
+        while (--rulenum)
+            e = (STRUCT_ENTRY *)((char *)e + e->next_offset);
+        return &e->counters;
+    }
+
     if (!(r = iptcc_get_rule_num(c, rulenum))) {
         errno = E2BIG;
         return NULL;
@@ -2029,6 +3084,8 @@ int TC_ZERO_COUNTER(const IPT_CHAINLABEL chain, unsigned int rulenum,
     struct rule_head *r;
 
     iptc_fn = TC_ZERO_COUNTER;
+    if (!iptcc_writable(handle))
+        return 0;
     CHECK(handle);
 
     if (!(c = iptcc_find_label(chain, handle))) {
@@ -2044,7 +3101,7 @@ int TC_ZERO_COUNTER(const IPT_CHAINLABEL chain, unsigned int rulenum,
     if (r->counter_map.maptype == COUNTER_MAP_NORMAL_MAP)
         r->counter_map.maptype = COUNTER_MAP_ZEROED;
 
-    set_changed(handle);
+    set_counters_changed(handle, c);
 
     return 1;
 }
@@ -2056,6 +3113,8 @@ int TC_SET_COUNTER(const IPT_CHAINLABEL chain, unsigned int rulenum,
     STRUCT_ENTRY *e;
 
     iptc_fn = TC_SET_COUNTER;
+    if (!iptcc_writable(handle))
+        return 0;
     CHECK(handle);
 
     if (!(c = iptcc_find_label(chain, handle))) {
@@ -2073,7 +3132,7 @@ int TC_SET_COUNTER(const IPT_CHAINLABEL chain, unsigned int rulenum,
 
     memcpy(&e->counters, counters, sizeof(STRUCT_COUNTERS));
 
-    set_changed(handle);
+    set_counters_changed(handle, c);
 
     return 1;
 }
@@ -2087,6 +3146,8 @@ int TC_CREATE_CHAIN(const IPT_CHAINLABEL chain, struct xtc_handle *handle) {
     int exceeded;
 
     iptc_fn = TC_CREATE_CHAIN;
+    if (!iptcc_writable(handle))
+        return 0;
 
     /* find_label doesn't cover built-in targets: DROP, ACCEPT,
        QUEUE, RETURN. */
@@ -2104,7 +3165,7 @@ int TC_CREATE_CHAIN(const IPT_CHAINLABEL chain, struct xtc_handle *handle) {
         return 0;
     }
 
-    c = iptcc_alloc_chain_head(chain, 0);
+    c = iptcc_alloc_chain_head(handle, chain, 0);
     if (!c) {
         DEBUGP("Cannot allocate memory for chain `%s'\n", chain);
         errno = ENOMEM;
@@ -2112,6 +3173,14 @@ int TC_CREATE_CHAIN(const IPT_CHAINLABEL chain, struct xtc_handle *handle) {
     }
     handle->num_chains++; /* New user defined chain */
 
+    if (iptcc_chain_hash_add(handle, c) < 0) {
+        DEBUGP("Cannot grow chain hash for chain `%s'\n", chain);
+        handle->num_chains--;
+        iptcc_free_chain_head(handle, c);
+        errno = ENOMEM;
+        return 0;
+    }
+
     DEBUGP("Creating chain `%s'\n", chain);
     iptc_insert_chain(handle, c); /* Insert sorted */
 
@@ -2129,7 +3198,7 @@ int TC_CREATE_CHAIN(const IPT_CHAINLABEL chain, struct xtc_handle *handle) {
         iptcc_chain_index_rebuild(handle);
     }
 
-    set_changed(handle);
+    set_chain_changed(handle, c);
 
     return 1;
 }
@@ -2156,6 +3225,8 @@ int TC_DELETE_CHAIN(const IPT_CHAINLABEL chain, struct xtc_handle *handle) {
     struct chain_head *c;
 
     iptc_fn = TC_DELETE_CHAIN;
+    if (!iptcc_writable(handle))
+        return 0;
 
     if (!(c = iptcc_find_label(chain, handle))) {
         DEBUGP("cannot find chain `%s'\n", chain);
@@ -2195,7 +3266,10 @@ int TC_DELETE_CHAIN(const IPT_CHAINLABEL chain, struct xtc_handle *handle) {
 
     // list_del(&c->list); /* Done in iptcc_chain_index_delete_chain() */
     iptcc_chain_index_delete_chain(c, handle);
-    free(c);
+    iptcc_chain_hash_del(c);
+    iptcc_rule_index_free(c);
+    iptcc_rule_hash_free(c);
+    iptcc_free_chain_head(handle, c);
 
     DEBUGP("chain `%s' deleted\n", chain);
 
@@ -2209,6 +3283,8 @@ int TC_RENAME_CHAIN(const IPT_CHAINLABEL oldname, const IPT_CHAINLABEL newname,
                     struct xtc_handle *handle) {
     struct chain_head *c;
     iptc_fn = TC_RENAME_CHAIN;
+    if (!iptcc_writable(handle))
+        return 0;
 
     /* find_label doesn't cover built-in targets: DROP, ACCEPT,
        QUEUE, RETURN. */
@@ -2233,11 +3309,14 @@ int TC_RENAME_CHAIN(const IPT_CHAINLABEL oldname, const IPT_CHAINLABEL newname,
 
     /* This only unlinks "c" from the list, thus no free(c) */
     iptcc_chain_index_delete_chain(c, handle);
+    iptcc_chain_hash_del(c);
 
     /* Change the name of the chain */
     strncpy(c->name, newname, sizeof(IPT_CHAINLABEL));
 
-    /* Insert sorted into to list again */
+    /* Insert sorted into to list again, the hash cannot grow here as
+     * the number of chains is unchanged */
+    iptcc_chain_hash_add(handle, c);
     iptc_insert_chain(handle, c);
 
     set_changed(handle);
@@ -2251,6 +3330,8 @@ int TC_SET_POLICY(const IPT_CHAINLABEL chain, const IPT_CHAINLABEL policy,
     struct chain_head *c;
 
     iptc_fn = TC_SET_POLICY;
+    if (!iptcc_writable(handle))
+        return 0;
 
     if (!(c = iptcc_find_label(chain, handle))) {
         DEBUGP("cannot find chain `%s'\n", chain);
@@ -2272,6 +3353,7 @@ int TC_SET_POLICY(const IPT_CHAINLABEL chain, const IPT_CHAINLABEL policy,
         errno = EINVAL;
         return 0;
     }
+    handle->unknown_policies &= ~(1 << (c->hooknum - 1));
 
     if (counters) {
         /* set byte and packet counters */
@@ -2343,6 +3425,228 @@ static void counters_map_set(STRUCT_COUNTERS_INFO *newcounters,
     DEBUGP_C("SET\n");
 }
 
+/* Make the cache of a handle kept across transactions describe the table
+ * we just pushed, as if it had been read back from the kernel.  Chains
+ * whose offset and index did not change and that don't jump into moved
+ * chains only get their counters updated. */
+static void iptcc_commit_sync(struct xtc_handle *h, STRUCT_REPLACE *repl,
+                              STRUCT_COUNTERS_INFO *newcounters) {
+    STRUCT_GET_ENTRIES *entries;
+    struct chain_head *c;
+    unsigned int offset, i;
+
+    entries = malloc(sizeof(STRUCT_GET_ENTRIES) + repl->size);
+    if (!entries)
+        return; /* handle stays marked as changed */
+
+    strcpy(entries->name, repl->name);
+    entries->size = repl->size;
+    memcpy(entries->entrytable, repl->entries, repl->size);
+    free(h->entries);
+    h->entries = entries;
+
+    /* clean chains were copied with the counters as read */
+    for (offset = 0, i = 0; offset < repl->size; i++) {
+        STRUCT_ENTRY *e = iptcb_get_entry(h, offset);
+
+        e->counters = newcounters->counters[i];
+        offset += e->next_offset;
+    }
+
+    h->info.num_entries = repl->num_entries;
+    h->info.size = repl->size;
+    memcpy(h->info.hook_entry, repl->hook_entry, sizeof(h->info.hook_entry));
+    memcpy(h->info.underflow, repl->underflow, sizeof(h->info.underflow));
+
+    list_for_each_entry(c, &h->chains, list) {
+        struct rule_head *r;
+        unsigned int index;
+
+        /* same as the parser does for the policy rule */
+        c->counter_map.maptype = COUNTER_MAP_ZEROED;
+        c->counter_map.mappos = c->foot_index;
+        c->counters = newcounters->counters[c->foot_index];
+
+        /* rule indices are counter positions, see counter_map */
+        if (!c->dirty && c->head_offset == c->blob_head_offset &&
+            c->foot_index == c->blob_foot_index &&
+            (c->num_jumps == 0 || c->max_jump < h->dirty_offset)) {
+            list_for_each_entry(r, &c->rules, list) {
+                r->counter_map.maptype = COUNTER_MAP_NORMAL_MAP;
+                r->entry->counters = newcounters->counters[r->index];
+            }
+            continue;
+        }
+
+        offset = c->head_offset;
+        if (!iptcc_is_builtin(c))
+            offset += IPTCB_CHAIN_START_SIZE;
+        index = c->foot_index - c->num_rules;
+
+        c->num_jumps = 0;
+        c->max_jump = 0;
+        list_for_each_entry(r, &c->rules, list) {
+            r->offset = offset;
+            r->index = index;
+            r->counter_map.maptype = COUNTER_MAP_NORMAL_MAP;
+            r->counter_map.mappos = index;
+            r->entry->counters = newcounters->counters[index];
+
+            if (r->type == IPTCC_R_JUMP) {
+                unsigned int verdict =
+                    r->jump->head_offset + IPTCB_CHAIN_START_SIZE;
+                c->num_jumps++;
+                if (verdict > c->max_jump)
+                    c->max_jump = verdict;
+            } else if (r->type == IPTCC_R_FALLTHROUGH) {
+                c->num_jumps++;
+            }
+
+            offset += r->size;
+            index++;
+        }
+
+        c->blob_head_offset = c->head_offset;
+        c->blob_foot_index = c->foot_index;
+        c->dirty = 0;
+    }
+
+    /* the blob was compiled from the sorted chain list */
+    h->sorted_offsets = 1;
+    h->changed = 0;
+    h->counters_changed = 0;
+}
+
+/* What to add to counter `read' to get what TC_COMMIT would put back,
+ * wrapping around */
+static void iptcc_counter_delta(STRUCT_COUNTERS_INFO *newcounters,
+                                struct counter_map *map,
+                                const STRUCT_COUNTERS *read,
+                                STRUCT_COUNTERS *counters) {
+    switch (map->maptype) {
+    case COUNTER_MAP_NORMAL_MAP:
+        newcounters->counters[map->mappos] = ((STRUCT_COUNTERS){0, 0});
+        break;
+    case COUNTER_MAP_ZEROED:
+        subtract_counters(&newcounters->counters[map->mappos],
+                          &((STRUCT_COUNTERS){0, 0}), read);
+        break;
+    case COUNTER_MAP_SET:
+        subtract_counters(&newcounters->counters[map->mappos], counters, read);
+        break;
+    default:
+        break;
+    }
+}
+
+/* Commit a handle where only counters were zeroed or set.  The table
+ * stays in place: rather than replacing it and putting the counters
+ * back, the difference to the counters as read is added to them.
+ * Unlike a replace, which takes the old counters atomically, this keeps
+ * the packets seen since the table was read. */
+static int iptcc_commit_counters(struct xtc_handle *h) {
+    STRUCT_COUNTERS_INFO *newcounters;
+    STRUCT_GETINFO info;
+    struct chain_head *c;
+    unsigned int offset, i;
+    size_t counterlen;
+    socklen_t s;
+    int ret;
+
+    /* Counters are positional, so the table must still be the one we
+     * read.  A replace would fail the same way. */
+    s = sizeof(info);
+    strcpy(info.name, h->info.name);
+    if (getsockopt(h->sockfd, TC_IPPROTO, SO_GET_INFO, &info, &s) < 0)
+        return 0;
+    if (memcmp(&info, &h->info, sizeof(info)) != 0) {
+        errno = EAGAIN;
+        return 0;
+    }
+
+    counterlen = sizeof(STRUCT_COUNTERS_INFO) +
+                 sizeof(STRUCT_COUNTERS) * h->info.num_entries;
+    newcounters = malloc(counterlen);
+    if (!newcounters) {
+        errno = ENOMEM;
+        return 0;
+    }
+    strcpy(newcounters->name, h->info.name);
+    newcounters->num_counters = h->info.num_entries;
+
+    /* Entries without a counter map, like the heads and returns of user
+     * defined chains, are reset as by a replace */
+    for (offset = 0, i = 0; offset < h->entries->size; i++) {
+        STRUCT_ENTRY *e = iptcb_get_entry(h, offset);
+
+        subtract_counters(&newcounters->counters[i], &((STRUCT_COUNTERS){0, 0}),
+                          &e->counters);
+        offset += e->next_offset;
+    }
+
+    list_for_each_entry(c, &h->chains, list) {
+        struct rule_head *r;
+
+        if (iptcc_is_builtin(c))
+            iptcc_counter_delta(newcounters, &c->counter_map, &c->counters,
+                                &c->counters);
+
+        if (!c->dirty) {
+            if (c->num_rules) {
+                r = list_entry(c->rules.next, struct rule_head, list);
+                memset(&newcounters->counters[r->counter_map.mappos], 0,
+                       c->num_rules * sizeof(STRUCT_COUNTERS));
+            }
+            continue;
+        }
+
+        list_for_each_entry(r, &c->rules, list) {
+            STRUCT_ENTRY *e = iptcb_get_entry(h, r->offset);
+
+            iptcc_counter_delta(newcounters, &r->counter_map, &e->counters,
+                                &r->entry->counters);
+        }
+    }
+
+    ret = setsockopt(h->sockfd, TC_IPPROTO, SO_SET_ADD_COUNTERS, newcounters,
+                     counterlen);
+    if (ret < 0) {
+        free(newcounters);
+        return 0;
+    }
+
+    if (h->reuse) {
+        /* as iptcc_commit_sync() does: counters are what we pushed */
+        for (offset = 0, i = 0; offset < h->entries->size; i++) {
+            STRUCT_ENTRY *e = iptcb_get_entry(h, offset);
+
+            e->counters.pcnt += newcounters->counters[i].pcnt;
+            e->counters.bcnt += newcounters->counters[i].bcnt;
+            offset += e->next_offset;
+        }
+
+        list_for_each_entry(c, &h->chains, list) {
+            struct rule_head *r;
+
+            if (iptcc_is_builtin(c))
+                c->counters = iptcb_get_entry(h, c->foot_offset)->counters;
+
+            if (!c->dirty)
+                continue;
+
+            list_for_each_entry(r, &c->rules, list) {
+                r->entry->counters = iptcb_get_entry(h, r->offset)->counters;
+                r->counter_map.maptype = COUNTER_MAP_NORMAL_MAP;
+            }
+            c->dirty = 0;
+        }
+        h->counters_changed = 0;
+    }
+
+    free(newcounters);
+    return 1;
+}
+
 int TC_COMMIT(struct xtc_handle *handle) {
     /* Replace, then map back the counters. */
     STRUCT_REPLACE *repl;
@@ -2357,8 +3661,14 @@ int TC_COMMIT(struct xtc_handle *handle) {
     CHECK(*handle);
 
     /* Don't commit if nothing changed. */
-    if (!handle->changed)
+    if (!handle->changed) {
+        if (handle->counters_changed)
+            return iptcc_commit_counters(handle);
         goto finished;
+    }
+
+    if (!iptcc_fetch_policies(handle))
+        goto out_zero;
 
     new_number = iptcc_compile_table_prep(handle, &new_size);
     if (new_number < 0) {
@@ -2454,6 +3764,21 @@ int TC_COMMIT(struct xtc_handle *handle) {
             }
         }
 
+        /* Clean chains still map their counters one to one, in the
+         * same order as in the blob */
+        if (!c->dirty) {
+            if (c->num_rules) {
+                r = list_entry(c->rules.next, struct rule_head, list);
+                DEBUGP("counters for index %u-%u: NORMAL_MAP => mappos %u\n",
+                       c->foot_index - c->num_rules, c->foot_index - 1,
+                       r->counter_map.mappos);
+                memcpy(&newcounters->counters[c->foot_index - c->num_rules],
+                       &repl->counters[r->counter_map.mappos],
+                       c->num_rules * sizeof(STRUCT_COUNTERS));
+            }
+            continue;
+        }
+
         list_for_each_entry(r, &c->rules, list) {
             DEBUGP("counter for index %u: ", r->index);
             switch (r->counter_map.maptype) {
@@ -2494,6 +3819,9 @@ int TC_COMMIT(struct xtc_handle *handle) {
     if (ret < 0)
         goto out_free_newcounters;
 
+    if (handle->reuse)
+        iptcc_commit_sync(handle, repl, newcounters);
+
     free(repl->counters);
     free(repl);
     free(newcounters);
@@ -2544,6 +3872,7 @@ const char *TC_STRERROR(int err) {
         {NULL, ENOSYS, "Will be implemented real soon.  I promise ;)"},
         {NULL, ENOMEM, "Memory allocation problem"},
         {NULL, ENOENT, "No chain/target/match by that name"},
+        {NULL, EROFS, "Table was opened read-only"},
     };
 
     for (i = 0; i < sizeof(table) / sizeof(struct table_struct); i++) {
@@ -199,6 +199,26 @@ struct xtables_target *xtables_pending_targets;
 struct xtables_match *xtables_matches;
 struct xtables_target *xtables_targets;
 
+/*
+ * Name-keyed index over the four lists above, so that looking up an
+ * extension does not walk every registered one. Each list keeps its order,
+ * the index only points into it. Entries of the same name are chained in
+ * list order.
+ */
+#define XT_EXT_HASH_SIZE 256
+
+struct xt_ext_node {
+    struct xt_ext_node *next;
+    const char *name;
+    uint32_t family;
+    void *ext;
+};
+
+static struct xt_ext_node *xtables_pending_match_hash[XT_EXT_HASH_SIZE];
+static struct xt_ext_node *xtables_pending_target_hash[XT_EXT_HASH_SIZE];
+static struct xt_ext_node *xtables_match_hash[XT_EXT_HASH_SIZE];
+static struct xt_ext_node *xtables_target_hash[XT_EXT_HASH_SIZE];
+
 /* Fully register a match/target which was previously partially registered. */
 static void xtables_fully_register_pending_match(struct xtables_match *me);
 static void xtables_fully_register_pending_target(struct xtables_target *me);
@@ -274,9 +294,16 @@ int xtables_set_params(struct xtables_globals *xtp) {
 }
 
 int xtables_init_all(struct xtables_globals *xtp, uint8_t nfproto) {
+    int ret;
+
+    xtables_trace_init(false);
+    xtables_trace_begin("xtables_init_all");
     xtables_init();
     xtables_set_nfproto(nfproto);
-    return xtables_set_params(xtp);
+    ret = xtables_set_params(xtp);
+    xtables_trace_end();
+
+    return ret;
 }
 
 /**
@@ -412,8 +439,10 @@ int xtables_load_ko(const char *modprobe, bool quiet) {
     if (loaded)
         return 0;
 
+    xtables_trace_begin("xtables_load_ko");
     if (proc_file_exists(afinfo->proc_exists)) {
         loaded = true;
+        xtables_trace_end();
         return 0;
     };
 
@@ -421,6 +450,7 @@ int xtables_load_ko(const char *modprobe, bool quiet) {
     if (ret == 0)
         loaded = true;
 
+    xtables_trace_end();
     return ret;
 }
 
@@ -483,7 +513,10 @@ bool xtables_strtoui(const char *s, char **end, unsigned int *value,
 int xtables_service_to_port(const char *name, const char *proto) {
     struct servent *service;
 
-    if ((service = getservbyname(name, proto)) != NULL)
+    xtables_trace_begin("getservbyname");
+    service = getservbyname(name, proto);
+    xtables_trace_end();
+    if (service != NULL)
         return ntohs((unsigned short)service->s_port);
 
     return -1;
@@ -538,6 +571,93 @@ void xtables_parse_interface(const char *arg, char *vianame,
 }
 
 #ifndef NO_SHARED_LIBS
+/*
+ * All extensions packed into XTABLES_BUNDLE_FILE. Opening it is a single
+ * dlopen() instead of a stat() and dlopen() per extension and directory,
+ * and an extension is only initialized when it is first asked for.
+ */
+static const struct xtables_bundle_ext *xtables_bundle;
+static unsigned int xtables_bundle_size;
+static bool *xtables_bundle_done;
+
+static void bundle_open(const char *search_path) {
+    static bool tried;
+    const char *dir = search_path, *next;
+    const struct xtables_bundle_ext *index;
+    void *handle;
+    struct stat sb;
+    char path[256];
+
+    if (tried || search_path == NULL)
+        return;
+    tried = true;
+
+    do {
+        next = strchr(dir, ':');
+        if (next == NULL)
+            next = dir + strlen(dir);
+
+        snprintf(path, sizeof(path), "%.*s/%s", (unsigned int)(next - dir),
+                 dir, XTABLES_BUNDLE_FILE);
+
+        if (stat(path, &sb) != 0) {
+            dir = next + 1;
+            continue;
+        }
+
+        handle = dlopen(path, RTLD_LAZY);
+        if (handle == NULL) {
+            fprintf(stderr, "%s: %s\n", path, dlerror());
+            return;
+        }
+
+        index = dlsym(handle, XTABLES_BUNDLE_INDEX);
+        if (index == NULL) {
+            fprintf(stderr, "%s: %s\n", path, dlerror());
+            dlclose(handle);
+            return;
+        }
+
+        while (index[xtables_bundle_size].name != NULL)
+            xtables_bundle_size++;
+        xtables_bundle_done = xtables_calloc(xtables_bundle_size,
+                                             sizeof(bool));
+        xtables_bundle = index;
+        return;
+    } while (*next != '\0');
+}
+
+static int bundle_ext_cmp(const void *key, const void *ext) {
+    return strcmp(key, ((const struct xtables_bundle_ext *)ext)->name);
+}
+
+/* Returns true if the bundle has @prefix@name, initializing it if needed */
+static bool bundle_load(const char *prefix, const char *name) {
+    const struct xtables_bundle_ext *ext;
+    char stem[64];
+    unsigned int i;
+
+    if (xtables_bundle == NULL)
+        return false;
+
+    snprintf(stem, sizeof(stem), "%s%s", prefix, name);
+    ext = bsearch(stem, xtables_bundle, xtables_bundle_size,
+                  sizeof(*xtables_bundle), bundle_ext_cmp);
+    if (ext == NULL)
+        return false;
+
+    if (xtables_bundle_done[ext - xtables_bundle])
+        return true;
+
+    /* aliases share the init function of the extension they are part of */
+    for (i = 0; i < xtables_bundle_size; i++) {
+        if (xtables_bundle[i].init == ext->init)
+            xtables_bundle_done[i] = true;
+    }
+    ext->init();
+    return true;
+}
+
 static void *load_extension(const char *search_path, const char *af_prefix,
                             const char *name, bool is_target) {
     const char *all_prefixes[] = {af_prefix, "libxt_", NULL};
@@ -547,6 +667,23 @@ static void *load_extension(const char *search_path, const char *af_prefix,
     struct stat sb;
     char path[256];
 
+    bundle_open(search_path);
+    for (prefix = all_prefixes; *prefix != NULL; ++prefix) {
+        if (!bundle_load(*prefix, name))
+            continue;
+
+        if (is_target)
+            ptr = xtables_find_target(name, XTF_DONT_LOAD);
+        else
+            ptr = xtables_find_match(name, XTF_DONT_LOAD, NULL);
+
+        if (ptr != NULL)
+            return ptr;
+
+        errno = ENOENT;
+        return NULL;
+    }
+
     do {
         next = strchr(dir, ':');
         if (next == NULL)
@@ -594,6 +731,98 @@ static bool extension_cmp(const char *name1, const char *name2,
     return false;
 }
 
+static unsigned int ext_hash(const char *name) {
+    unsigned int hash = 5381;
+
+    while (*name != '\0')
+        hash = hash * 33 + (unsigned char)*name++;
+    return hash % XT_EXT_HASH_SIZE;
+}
+
+/* @prepend mirrors whether the extension goes to the head of its list */
+static void ext_hash_add(struct xt_ext_node **table, const char *name,
+                         uint32_t family, void *ext, bool prepend) {
+    struct xt_ext_node **i, *node;
+
+    node = xtables_malloc(sizeof(*node));
+    node->name = name;
+    node->family = family;
+    node->ext = ext;
+
+    i = &table[ext_hash(name)];
+    if (!prepend) {
+        while (*i != NULL)
+            i = &(*i)->next;
+    }
+    node->next = *i;
+    *i = node;
+}
+
+static void ext_hash_del(struct xt_ext_node **table, const char *name,
+                         const void *ext) {
+    struct xt_ext_node **i, *node;
+
+    for (i = &table[ext_hash(name)]; *i != NULL; i = &(*i)->next) {
+        if ((*i)->ext == ext) {
+            node = *i;
+            *i = node->next;
+            free(node);
+            return;
+        }
+    }
+}
+
+/* Returns the first extension called @name usable for the current family */
+static void *ext_hash_find(struct xt_ext_node **table, const char *name) {
+    struct xt_ext_node *node;
+
+    for (node = table[ext_hash(name)]; node != NULL; node = node->next) {
+        if (extension_cmp(name, node->name, node->family))
+            return node->ext;
+    }
+    return NULL;
+}
+
+/*
+ * Match clones and rule match entries given back by
+ * xtables_rule_matches_free(), handed out again by xtables_find_match() so
+ * that parsing one rule after another does not go through the allocator.
+ * Pooled clones are chained through their next field, which only marks
+ * them as clones while they are in use.
+ */
+static struct xtables_match *xtables_clone_pool;
+static struct xtables_rule_match *xtables_rule_match_pool;
+
+static struct xtables_match *clone_get(void) {
+    struct xtables_match *clone = xtables_clone_pool;
+
+    if (clone == NULL)
+        return xtables_malloc(sizeof(struct xtables_match));
+
+    xtables_clone_pool = clone->next;
+    return clone;
+}
+
+static void clone_put(struct xtables_match *clone) {
+    clone->next = xtables_clone_pool;
+    xtables_clone_pool = clone;
+}
+
+static struct xtables_rule_match *rule_match_get(void) {
+    struct xtables_rule_match *rm = xtables_rule_match_pool;
+
+    if (rm == NULL)
+        return xtables_malloc(sizeof(struct xtables_rule_match));
+
+    xtables_rule_match_pool = rm->next;
+    return rm;
+}
+
+static void rule_match_put(struct xtables_rule_match *rm) {
+    rm->next = xtables_rule_match_pool;
+    xtables_rule_match_pool = rm;
+}
+
 struct xtables_match *xtables_find_match(const char *name,
                                          enum xtables_tryload tryload,
                                          struct xtables_rule_match **matches) {
@@ -613,41 +842,38 @@ struct xtables_match *xtables_find_match(const char *name,
         name = icmp6;
 
     /* Trigger delayed initialization */
-    for (dptr = &xtables_pending_matches; *dptr;) {
-        if (extension_cmp(name, (*dptr)->name, (*dptr)->family)) {
-            ptr = *dptr;
-            *dptr = (*dptr)->next;
-            ptr->next = NULL;
-            xtables_fully_register_pending_match(ptr);
-        } else {
-            dptr = &((*dptr)->next);
-        }
+    while ((ptr = ext_hash_find(xtables_pending_match_hash, name)) != NULL) {
+        ext_hash_del(xtables_pending_match_hash, ptr->name, ptr);
+        for (dptr = &xtables_pending_matches; *dptr != ptr;
+             dptr = &((*dptr)->next))
+            ;
+        *dptr = ptr->next;
+        ptr->next = NULL;
+        xtables_trace_begin("register_extension");
+        xtables_fully_register_pending_match(ptr);
+        xtables_trace_end();
     }
 
-    for (ptr = xtables_matches; ptr; ptr = ptr->next) {
-        if (extension_cmp(name, ptr->name, ptr->family)) {
-            struct xtables_match *clone;
+    ptr = ext_hash_find(xtables_match_hash, name);
+    if (ptr != NULL && ptr->m != NULL) {
+        struct xtables_match *clone;
 
-            /* First match of this type: */
-            if (ptr->m == NULL)
-                break;
-
-            /* Second and subsequent clones */
-            clone = xtables_malloc(sizeof(struct xtables_match));
-            memcpy(clone, ptr, sizeof(struct xtables_match));
-            clone->udata = NULL;
-            clone->mflags = 0;
-            /* This is a clone: */
-            clone->next = clone;
+        /* Second and subsequent clones */
+        clone = clone_get();
+        memcpy(clone, ptr, sizeof(struct xtables_match));
+        clone->udata = NULL;
+        clone->mflags = 0;
+        /* This is a clone: */
+        clone->next = clone;
 
-            ptr = clone;
-            break;
-        }
+        ptr = clone;
     }
 
 #ifndef NO_SHARED_LIBS
     if (!ptr && tryload != XTF_DONT_LOAD && tryload != XTF_DURING_LOAD) {
+        xtables_trace_begin("load_extension");
         ptr = load_extension(xtables_libdir, afinfo->libprefix, name, false);
+        xtables_trace_end();
 
         if (ptr == NULL && tryload == XTF_LOAD_MUST_SUCCEED)
             xt_params->exit_err(PARAMETER_PROBLEM,
@@ -671,7 +897,7 @@ struct xtables_match *xtables_find_match(const char *name,
         struct xtables_rule_match **i;
         struct xtables_rule_match *newentry;
 
-        newentry = xtables_malloc(sizeof(struct xtables_rule_match));
+        newentry = rule_match_get();
 
         for (i = matches; *i; i = &(*i)->next) {
             if (extension_cmp(name, (*i)->match->name, (*i)->match->family))
@@ -699,25 +925,25 @@ struct xtables_target *xtables_find_target(const char *name,
         name = "standard";
 
     /* Trigger delayed initialization */
-    for (dptr = &xtables_pending_targets; *dptr;) {
-        if (extension_cmp(name, (*dptr)->name, (*dptr)->family)) {
-            ptr = *dptr;
-            *dptr = (*dptr)->next;
-            ptr->next = NULL;
-            xtables_fully_register_pending_target(ptr);
-        } else {
-            dptr = &((*dptr)->next);
-        }
+    while ((ptr = ext_hash_find(xtables_pending_target_hash, name)) != NULL) {
+        ext_hash_del(xtables_pending_target_hash, ptr->name, ptr);
+        for (dptr = &xtables_pending_targets; *dptr != ptr;
+             dptr = &((*dptr)->next))
+            ;
+        *dptr = ptr->next;
+        ptr->next = NULL;
+        xtables_trace_begin("register_extension");
+        xtables_fully_register_pending_target(ptr);
+        xtables_trace_end();
     }
 
-    for (ptr = xtables_targets; ptr; ptr = ptr->next) {
-        if (extension_cmp(name, ptr->name, ptr->family))
-            break;
-    }
+    ptr = ext_hash_find(xtables_target_hash, name);
 
 #ifndef NO_SHARED_LIBS
     if (!ptr && tryload != XTF_DONT_LOAD && tryload != XTF_DURING_LOAD) {
+        xtables_trace_begin("load_extension");
         ptr = load_extension(xtables_libdir, afinfo->libprefix, name, true);
+        xtables_trace_end();
 
         if (ptr == NULL && tryload == XTF_LOAD_MUST_SUCCEED)
             xt_params->exit_err(PARAMETER_PROBLEM,
@@ -853,6 +1079,7 @@ void xtables_register_match(struct xtables_match *me) {
     /* place on linked list of matches pending full registration */
     me->next = xtables_pending_matches;
     xtables_pending_matches = me;
+    ext_hash_add(xtables_pending_match_hash, me->name, me->family, me, true);
 }
 
 /**
@@ -937,6 +1164,7 @@ static void xtables_fully_register_pending_match(struct xtables_match *me) {
         for (i = &xtables_matches; *i != old; i = &(*i)->next)
             ;
         *i = old->next;
+        ext_hash_del(xtables_match_hash, old->name, old);
     }
 
     if (me->size != XT_ALIGN(me->size)) {
@@ -950,6 +1178,7 @@ static void xtables_fully_register_pending_match(struct xtables_match *me) {
         ;
     me->next = NULL;
     *i = me;
+    ext_hash_add(xtables_match_hash, me->name, me->family, me, false);
 
     me->m = NULL;
     me->mflags = 0;
@@ -1000,6 +1229,7 @@ void xtables_register_target(struct xtables_target *me) {
     /* place on linked list of targets pending full registration */
     me->next = xtables_pending_targets;
     xtables_pending_targets = me;
+    ext_hash_add(xtables_pending_target_hash, me->name, me->family, me, true);
 }
 
 static void xtables_fully_register_pending_target(struct xtables_target *me) {
@@ -1032,6 +1262,7 @@ static void xtables_fully_register_pending_target(struct xtables_target *me) {
         for (i = &xtables_targets; *i != old; i = &(*i)->next)
             ;
         *i = old->next;
+        ext_hash_del(xtables_target_hash, old->name, old);
     }
 
     if (me->size != XT_ALIGN(me->size)) {
@@ -1043,6 +1274,7 @@ static void xtables_fully_register_pending_target(struct xtables_target *me) {
     /* Prepend to list. */
     me->next = xtables_targets;
     xtables_targets = me;
+    ext_hash_add(xtables_target_hash, me->name, me->family, me, true);
     me->t = NULL;
     me->tflags = 0;
 }
@@ -1064,10 +1296,10 @@ void xtables_rule_matches_free(struct xtables_rule_match **matches) {
             matchp->match->m = NULL;
         }
         if (matchp->match == matchp->match->next) {
-            free(matchp->match);
+            clone_put(matchp->match);
             matchp->match = NULL;
         }
-        free(matchp);
+        rule_match_put(matchp);
         matchp = tmp;
     }
 
@@ -1820,7 +2052,9 @@ uint16_t xtables_parse_protocol(const char *s) {
     if (strcmp(s, "all") == 0)
         return 0;
 
+    xtables_trace_begin("getprotobyname");
     pent = getprotobyname(s);
+    xtables_trace_end();
     if (pent != NULL)
         return pent->p_proto;
 
@@ -1869,6 +2103,7 @@ void get_kernel_version(void) {
     static struct utsname uts;
     int x = 0, y = 0, z = 0;
 
+    xtables_trace_begin("get_kernel_version");
     if (uname(&uts) == -1) {
         fprintf(stderr, "Unable to retrieve kernel version.\n");
         xtables_free_opts(1);
@@ -1877,6 +2112,7 @@ void get_kernel_version(void) {
 
     sscanf(uts.release, "%d.%d.%d", &x, &y, &z);
     kernel_version = LINUX_VERSION(x, y, z);
+    xtables_trace_end();
 }
 
 #include <linux/netfilter/nf_tables.h>
@@ -0,0 +1,220 @@
+/*
+ *	Startup tracer
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License as
+ *	published by the Free Software Foundation; either version 2 of
+ *	the License, or (at your option) any later version.
+ */
+#include "xtables.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Phases are accumulated by name, so a phase entered once per rule (say a
+ * protocol lookup) shows up as one line with its number of calls. Phases
+ * may nest, each line then includes the time of the phases inside it.
+ *
+ * The kernel does not export a per-process count of all system calls, the
+ * counts reported are those of /proc/self/io: read-like (syscr) and
+ * write-like (syscw) calls. The reads done by the tracer itself to get
+ * them, also for nested phases, are subtracted.
+ */
+#define XTTRACE_MAX_PHASES 32
+#define XTTRACE_MAX_DEPTH 8
+
+struct xttrace_sample {
+    /* number of samples taken so far, including this one */
+    unsigned long seq;
+    uint64_t ns;
+    uint64_t syscr;
+    uint64_t syscw;
+    long minflt;
+};
+
+struct xttrace_phase {
+    const char *name;
+    unsigned int calls;
+    struct xttrace_sample total;
+};
+
+static bool xttrace_enabled;
+static struct xttrace_sample xttrace_start, xttrace_cost;
+static unsigned long xttrace_seq;
+static struct xttrace_phase xttrace_phases[XTTRACE_MAX_PHASES];
+static unsigned int xttrace_num_phases;
+
+static struct {
+    struct xttrace_phase *phase;
+    struct xttrace_sample begin;
+} xttrace_stack[XTTRACE_MAX_DEPTH];
+static unsigned int xttrace_depth;
+
+/* Leaves errno alone, callers may still have to report it */
+static void xttrace_sample(struct xttrace_sample *s) {
+    char buf[256], *p;
+    struct timespec ts;
+    struct rusage ru;
+    int err = errno;
+    FILE *fp;
+
+    s->seq = ++xttrace_seq;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    s->ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+    s->syscr = s->syscw = 0;
+    fp = fopen("/proc/self/io", "r");
+    if (fp != NULL) {
+        while (fgets(buf, sizeof(buf), fp) != NULL) {
+            p = strchr(buf, ':');
+            if (p == NULL)
+                continue;
+            if (strncmp(buf, "syscr", p - buf) == 0)
+                s->syscr = strtoull(p + 1, NULL, 10);
+            else if (strncmp(buf, "syscw", p - buf) == 0)
+                s->syscw = strtoull(p + 1, NULL, 10);
+        }
+        fclose(fp);
+    }
+
+    getrusage(RUSAGE_SELF, &ru);
+    s->minflt = ru.ru_minflt;
+    errno = err;
+}
+
+/* @a - @b, without the cost of the samples taken in between */
+static void xttrace_delta(struct xttrace_sample *d,
+                          const struct xttrace_sample *a,
+                          const struct xttrace_sample *b) {
+    uint64_t cost = (a->seq - b->seq) * xttrace_cost.syscr;
+
+    d->ns = a->ns - b->ns;
+    d->syscr = a->syscr - b->syscr;
+    d->syscr -= d->syscr > cost ? cost : d->syscr;
+    d->syscw = a->syscw - b->syscw;
+    d->minflt = a->minflt - b->minflt;
+}
+
+static void xttrace_report(void) {
+    struct xttrace_sample now, d;
+    unsigned int i;
+
+    xttrace_sample(&now);
+    xttrace_delta(&d, &now, &xttrace_start);
+
+    fprintf(stderr, "startup trace (%d):\n", (int)getpid());
+    fprintf(stderr, "  %-24s %6s %10s %8s %8s %8s\n", "phase", "calls",
+            "ms", "syscr", "syscw", "minflt");
+    for (i = 0; i < xttrace_num_phases; i++) {
+        const struct xttrace_phase *ph = &xttrace_phases[i];
+
+        fprintf(stderr,
+                "  %-24s %6u %10.3f %8" PRIu64 " %8" PRIu64 " %8ld\n",
+                ph->name, ph->calls, ph->total.ns / 1e6, ph->total.syscr,
+                ph->total.syscw, ph->total.minflt);
+    }
+    fprintf(stderr, "  %-24s %6u %10.3f %8" PRIu64 " %8" PRIu64 " %8ld\n",
+            "total", 1, d.ns / 1e6, d.syscr, d.syscw, d.minflt);
+}
+
+/**
+ * xtables_trace_init - enable the startup tracer
+ * @force:	enable it even if XTABLES_TRACE_STARTUP is not set
+ *
+ * Tracing starts at the first call that enables it, the report goes to
+ * stderr when the process exits.
+ */
+void xtables_trace_init(bool force) {
+    struct xttrace_sample a, b;
+
+    if (xttrace_enabled || (!force && getenv("XTABLES_TRACE_STARTUP") == NULL))
+        return;
+
+    xttrace_enabled = true;
+    xttrace_sample(&a);
+    xttrace_sample(&b);
+    xttrace_cost.syscr = b.syscr - a.syscr;
+    xttrace_start = b;
+    atexit(xttrace_report);
+}
+
+/**
+ * xtables_trace_args - strip --trace-startup from the command line
+ *
+ * The option has to take effect before xtables_init_all() and does not
+ * belong to any command, so it is handled before option parsing.
+ */
+void xtables_trace_args(int *argc, char *argv[]) {
+    int i;
+
+    for (i = 1; i < *argc; i++) {
+        if (strcmp(argv[i], "--trace-startup") != 0)
+            continue;
+
+        memmove(&argv[i], &argv[i + 1], (*argc - i) * sizeof(argv[0]));
+        (*argc)--;
+        xtables_trace_init(true);
+        return;
+    }
+}
+
+void xtables_trace_begin(const char *phase) {
+    struct xttrace_phase *ph = NULL;
+    unsigned int i;
+
+    if (!xttrace_enabled)
+        return;
+
+    /* too deep, only keep track of the depth */
+    if (xttrace_depth >= XTTRACE_MAX_DEPTH) {
+        xttrace_depth++;
+        return;
+    }
+
+    for (i = 0; i < xttrace_num_phases; i++) {
+        if (strcmp(xttrace_phases[i].name, phase) == 0) {
+            ph = &xttrace_phases[i];
+            break;
+        }
+    }
+    if (ph == NULL && xttrace_num_phases < XTTRACE_MAX_PHASES) {
+        ph = &xttrace_phases[xttrace_num_phases++];
+        ph->name = phase;
+    }
+
+    xttrace_stack[xttrace_depth].phase = ph;
+    xttrace_sample(&xttrace_stack[xttrace_depth].begin);
+    xttrace_depth++;
+}
+
+void xtables_trace_end(void) {
+    struct xttrace_phase *ph;
+    struct xttrace_sample now, d;
+
+    if (!xttrace_enabled || xttrace_depth == 0)
+        return;
+
+    if (--xttrace_depth >= XTTRACE_MAX_DEPTH)
+        return;
+
+    ph = xttrace_stack[xttrace_depth].phase;
+    if (ph == NULL)
+        return;
+
+    xttrace_sample(&now);
+    xttrace_delta(&d, &now, &xttrace_stack[xttrace_depth].begin);
+
+    ph->calls++;
+    ph->total.ns += d.ns;
+    ph->total.syscr += d.syscr;
+    ph->total.syscw += d.syscw;
+    ph->total.minflt += d.minflt;
+}
@@ -0,0 +1,153 @@
+#!/usr/bin/env python3
+# encoding: utf-8
+#
+# Runs an iptables command many times with the startup tracer enabled
+# (XTABLES_TRACE_STARTUP) and compares the median total against the median
+# of the last recorded runs of the same command. Runs that pass are recorded
+# in a history file with the median of every phase, runs that regress are
+# not, so they never become the baseline.
+
+import os
+import sys
+import json
+import time
+import shlex
+import argparse
+import statistics
+from subprocess import Popen, PIPE, DEVNULL
+
+
+if sys.stdout.isatty():
+    colors = {"green": "\033[92m", "yellow": "\033[93m", "red": "\033[91m",
+              "end": "\033[0m"}
+else:
+    colors = {"green": "", "yellow": "", "red": "", "end": ""}
+
+
+def red(string):
+    return colors["red"] + string + colors["end"]
+
+
+def yellow(string):
+    return colors["yellow"] + string + colors["end"]
+
+
+def green(string):
+    return colors["green"] + string + colors["end"]
+
+
+def parse_trace(text):
+    """Returns {phase: (calls, ms, syscr, syscw, minflt)} of one report"""
+    phases = {}
+    in_report = False
+
+    for line in text.splitlines():
+        if line.startswith("startup trace"):
+            in_report = True
+            continue
+        if not in_report or not line.startswith("  "):
+            continue
+        fields = line.split()
+        if fields[0] == "phase":
+            continue
+        phases[fields[0]] = (int(fields[1]), float(fields[2]),
+                             int(fields[3]), int(fields[4]), int(fields[5]))
+    return phases
+
+
+def run_once(command):
+    env = dict(os.environ, XTABLES_TRACE_STARTUP="1")
+    process = Popen(command, stdout=DEVNULL, stderr=PIPE, env=env)
+    (_, error) = process.communicate()
+    phases = parse_trace(error.decode("utf-8"))
+    if "total" not in phases:
+        print(red("Error: ") + "no startup trace from " + " ".join(command))
+        print(error.decode("utf-8"))
+        sys.exit(1)
+    return phases
+
+
+def summarize(runs):
+    summary = {}
+    for name in runs[0]:
+        samples = [run[name] for run in runs if name in run]
+        summary[name] = {
+            "calls": statistics.median(s[0] for s in samples),
+            "ms": statistics.median(s[1] for s in samples),
+            "syscr": statistics.median(s[2] for s in samples),
+            "syscw": statistics.median(s[3] for s in samples),
+            "minflt": statistics.median(s[4] for s in samples),
+        }
+    return summary
+
+
+def git_revision():
+    try:
+        process = Popen(["git", "describe", "--always", "--dirty"],
+                        stdout=PIPE, stderr=DEVNULL)
+        (output, _) = process.communicate()
+        return output.decode("utf-8").strip()
+    except OSError:
+        return ""
+
+
+def previous_entries(history, command, count):
+    """Returns the last count entries recorded for command, oldest first"""
+    entries = []
+    try:
+        with open(history, "r") as log:
+            for line in log:
+                entry = json.loads(line)
+                if entry["command"] == command:
+                    entries.append(entry)
+    except IOError:
+        pass
+    return entries[-count:]
+
+
+def main():
+    command = shlex.split(args.command)
+    runs = [run_once(command) for _ in range(args.runs)]
+    summary = summarize(runs)
+
+    print(yellow("## " + args.command) + " (median of %d runs)" % args.runs)
+    print("  %-24s %6s %10s %8s %8s %8s" %
+          ("phase", "calls", "ms", "syscr", "syscw", "minflt"))
+    for name, s in summary.items():
+        print("  %-24s %6g %10.3f %8g %8g %8g" %
+              (name, s["calls"], s["ms"], s["syscr"], s["syscw"],
+               s["minflt"]))
+
+    entry = {"time": int(time.time()), "revision": git_revision(),
+             "command": args.command, "runs": args.runs, "phases": summary}
+    earlier = previous_entries(args.history, args.command, args.baseline)
+    if earlier:
+        before = statistics.median(e["phases"]["total"]["ms"]
+                                   for e in earlier)
+        now = summary["total"]["ms"]
+        change = (now - before) * 100.0 / before if before > 0 else 0.0
+        text = "total %.3f ms, median of the last %d recorded was " \
+            "%.3f ms (%+.1f%%)" % (now, len(earlier), before, change)
+        if change > args.threshold:
+            print(red("Regression: ") + text + ", not recorded")
+            return 1
+        print(green("Ok: ") + text)
+
+    with open(args.history, "a") as log:
+        log.write(json.dumps(entry) + "\n")
+    return 0
+
+
+parser = argparse.ArgumentParser()
+parser.add_argument("--runs", type=int, default=50,
+                    help="number of runs to take the median of")
+parser.add_argument("--history", default="startup-bench.log",
+                    help="file the results that pass are appended to")
+parser.add_argument("--baseline", type=int, default=5,
+                    help="number of recorded results to take the median of")
+parser.add_argument("--threshold", type=float, default=10.0,
+                    help="slowdown of the total in percent that fails")
+parser.add_argument("command", nargs="?", default="iptables -n -L INPUT",
+                    help="command to measure")
+args = parser.parse_args()
+sys.exit(main())